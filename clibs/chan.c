@@ -0,0 +1,123 @@
+#include "chan.h"
+
+#include <sys/eventfd.h>
+
+#include "util.h"
+
+int chan_init(chan_t *self) {
+    memset(self, 0, sizeof(chan_t));
+    self->head = self->tail = &self->stub;
+
+    self->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (self->efd < 0) {
+        ERR("eventfd fail");
+        return -1;
+    }
+    return 0;
+}
+
+static void chan_push(chan_t *self, chan_msg_t *msg) {
+    __atomic_store_n(&msg->next, NULL, __ATOMIC_RELAXED);
+    chan_msg_t *prev = __atomic_exchange_n(&self->tail, msg, __ATOMIC_ACQ_REL);
+    // the consumer stops at prev until this link is visible
+    __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+// NULL when empty or when a sender is in the middle of chan_push()
+static chan_msg_t *chan_pop(chan_t *self) {
+    chan_msg_t *head = self->head;
+    chan_msg_t *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    if (head == &self->stub) {
+        if (next == NULL) return NULL;
+        self->head = head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        self->head = next;
+        return head;
+    }
+
+    // head is the last message, put the stub behind it to take it out
+    if (head != __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE)) return NULL;
+    chan_push(self, &self->stub);
+
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) return NULL;
+    self->head = next;
+    return head;
+}
+
+chan_msg_t *chan_msg_new(int tag, size_t len) {
+    chan_msg_t *msg = (chan_msg_t *)malloc(sizeof(chan_msg_t) + len);
+    if (msg == NULL) return NULL;
+    msg->len = len;
+    msg->tag = tag;
+    return msg;
+}
+
+int chan_send(chan_t *self, int tag, const void *data, size_t len) {
+    chan_msg_t *msg = chan_msg_new(tag, len);
+    if (msg == NULL) return -1;
+    memcpy(msg->data, data, len);
+
+    chan_post(self, msg);
+    return 0;
+}
+
+void chan_post(chan_t *self, chan_msg_t *msg) {
+    chan_push(self, msg);
+    __atomic_fetch_add(&self->sent, 1, __ATOMIC_RELAXED);
+
+    /*
+     * after the push: a consumer arming before it sees the message, and one
+     * arming after finds it on its second look. Store (next) then load
+     * (sleeping) here against store (sleeping) then load (next) in
+     * chan_recv(): only a full fence on both sides keeps either from being
+     * reordered, release/acquire does not.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&self->sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&self->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(self->efd, &one, sizeof(one)) < 0) ERR("eventfd write fail");
+        __atomic_fetch_add(&self->wakeups, 1, __ATOMIC_RELAXED);
+    }
+}
+
+chan_msg_t *chan_recv(chan_t *self) {
+    if (self->armed) {
+        // back from sleep, senders need not signal while the queue drains
+        uint64_t n;
+        self->armed = 0;
+        __atomic_store_n(&self->sleeping, 0, __ATOMIC_SEQ_CST);
+        if (read(self->efd, &n, sizeof(n)) < 0 && errno != EAGAIN) ERR("eventfd read fail");
+    }
+
+    chan_msg_t *msg = chan_pop(self);
+    if (msg == NULL) {
+        self->armed = 1;
+        __atomic_store_n(&self->sleeping, 1, __ATOMIC_SEQ_CST);
+        // a message pushed before the flag was up did not signal, look again,
+        // behind the fence pairing with the one in chan_post()
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        msg = chan_pop(self);
+    }
+
+    if (msg) self->received++;
+    return msg;
+}
+
+void chan_stats(chan_t *self, chan_stats_t *stats) {
+    stats->sent = __atomic_load_n(&self->sent, __ATOMIC_RELAXED);
+    stats->received = self->received;
+    stats->wakeups = __atomic_load_n(&self->wakeups, __ATOMIC_RELAXED);
+}
+
+void chan_term(chan_t *self) {
+    chan_msg_t *msg;
+    self->armed = 0;
+    while ((msg = chan_pop(self)) != NULL) chan_msg_free(msg);
+    safe_close(self->efd);
+}
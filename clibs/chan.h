@@ -0,0 +1,87 @@
+#ifndef CLIBS_CHAN_H_
+#define CLIBS_CHAN_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * multi producer, single consumer message queue between threads. Any thread
+ * may chan_send() a byte buffer, which is copied into a message of its own,
+ * only the owner chan_recv()s. Pushing is one atomic exchange, nothing is
+ * locked (Vyukov's intrusive MPSC queue).
+ *
+ * The consumer sleeps in its reactor on chan_fd(), an eventfd. A sender
+ * only writes it when the consumer announced it is about to sleep, i.e. when
+ * chan_recv() came back empty, so a busy consumer costs no syscalls.
+ *
+ * Messages are malloc()ed by the sender and freed by the receiver, they can
+ * not come from the per-thread pool.
+ */
+
+typedef struct chan_msg {
+    struct chan_msg *next;
+    size_t len;
+    int tag;  // what kind of message, up to the users
+    char data[];
+} chan_msg_t;
+
+typedef struct chan_stats {
+    uint64_t sent;
+    uint64_t received;
+    uint64_t wakeups;  // eventfd writes, i.e. messages that found the consumer asleep
+} chan_stats_t;
+
+typedef struct chan {
+    // consumer side
+    chan_msg_t *head;
+    chan_msg_t stub;
+    int efd;
+    int armed;  // sleeping was set, efd may hold a signal
+    uint64_t received;
+
+    // producer side, on a cache line of its own
+    chan_msg_t *tail __attribute__((aligned(64)));  // senders swap their message in here
+    int sleeping;  // consumer saw the queue empty, the next sender signals efd
+    uint64_t sent;
+    uint64_t wakeups;
+} chan_t;
+
+int chan_init(chan_t *self);
+// free the messages still queued and close the eventfd
+void chan_term(chan_t *self);
+
+// queue a copy of data, -1 when out of memory
+int chan_send(chan_t *self, int tag, const void *data, size_t len);
+
+/*
+ * the two halves of chan_send() for senders that produce the payload in
+ * place: a message with room for len bytes (NULL when out of memory), to
+ * fill and hand to chan_post(), which takes it over.
+ */
+chan_msg_t *chan_msg_new(int tag, size_t len);
+void chan_post(chan_t *self, chan_msg_t *msg);
+
+/*
+ * the oldest message, to be released with chan_msg_free(). NULL when the
+ * queue is empty: the eventfd is armed then and the consumer may wait for
+ * it to become readable before calling again.
+ */
+chan_msg_t *chan_recv(chan_t *self);
+
+inline static void chan_msg_free(chan_msg_t *msg) { free(msg); }
+
+// a snapshot of the counters, from the consumer thread
+void chan_stats(chan_t *self, chan_stats_t *stats);
+
+inline static int chan_fd(chan_t *self) { return self->efd; }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // CLIBS_CHAN_H_
@@ -3,90 +3,372 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "uring.h"
 #include "util.h"
 
 #define EPOLL_DEFAULT_SIZE (1024)
 
-int epoll_fd_create(epoll_fd_t *self, size_t size) {
+static int uring_create(epoll_fd_t *self, size_t size) {
+    uring_t *ring = (uring_t *)MALLOC(sizeof(uring_t));
+    if (ring == NULL) return -1;
+
+    if (uring_init(ring, size) < 0) {
+        free(ring);
+        return -1;
+    }
+
+    self->ring = ring;
+    self->epfd = ring->ring_fd;
+    return 0;
+}
+
+int epoll_fd_create_backend(epoll_fd_t *self, size_t size, reactor_backend_t backend) {
     if (!size) size = EPOLL_DEFAULT_SIZE;
 
-    int epfd = epoll_create(size);
-    if (epfd < 0) return -1;
+    self->ring = NULL;
+    self->fds = NULL;
+    self->nfds = 0;
+    self->spin_us = 0;
+    self->active_ns = 0;
+    self->backend = REACTOR_EPOLL;
+    memset(&self->stats, 0, sizeof(self->stats));
+    if (backend == REACTOR_URING) {
+        if (uring_create(self, size) == 0)
+            self->backend = REACTOR_URING;
+        else
+            DBG("io_uring unavailable, fall back to epoll");
+    }
+
+    if (self->backend == REACTOR_EPOLL) {
+        self->epfd = epoll_create(size);
+        if (self->epfd < 0) return -1;
+    }
 
     self->size = size;
     self->events = (struct epoll_event *)malloc(sizeof(struct epoll_event) * size);
-    if (self->events == NULL) {
-        close(epfd);
+    self->timers = (timer_wheel_t *)malloc(sizeof(timer_wheel_t));
+    if (self->events == NULL || self->timers == NULL) {
+        safe_free(self->events);
+        safe_free(self->timers);
+        if (self->ring) {
+            uring_exit(self->ring);
+            safe_free(self->ring);
+        } else {
+            close(self->epfd);
+        }
         return -1;
     }
 
-    self->epfd = epfd;
+    timer_wheel_init(self->timers);
     return 0;
 }
 
+int epoll_fd_create(epoll_fd_t *self, size_t size) { return epoll_fd_create_backend(self, size, REACTOR_EPOLL); }
+
 void epoll_fd_close(epoll_fd_t *self) {
     assert(self);
     if (self && self->events) {
         free(self->events);
         self->events = NULL;
         self->size = 0;
-        close(self->epfd);
+        safe_free(self->timers);
+        safe_free(self->fds);
+        self->nfds = 0;
+        if (self->ring) {
+            // uring_exit closes the ring fd, which is also epfd
+            uring_exit(self->ring);
+            safe_free(self->ring);
+        } else {
+            close(self->epfd);
+        }
     }
 }
 
+static int fd_reserve(epoll_fd_t *self, int fd) {
+    if (fd < self->nfds) return 0;
+
+    int size = self->nfds ? self->nfds : 1024;
+    while (size <= fd) size <<= 1;
+
+    reactor_fd_t *fds = (reactor_fd_t *)realloc(self->fds, sizeof(reactor_fd_t) * size);
+    if (fds == NULL) return -1;
+
+    int i;
+    for (i = self->nfds; i < size; i++) {
+        fds[i].data = 0;
+        fds[i].mask = -1;
+    }
+    self->fds = fds;
+    self->nfds = size;
+    return 0;
+}
+
+static inline void fd_set_mask(epoll_fd_t *self, int fd, int event, uint64_t data) {
+    if (fd < 0 || fd_reserve(self, fd) < 0) return;  // no cache, every mod goes through
+    self->fds[fd].mask = event;
+    self->fds[fd].data = data;
+}
+
 int epoll_fd_add(epoll_fd_t *self, int fd, int event, void *ptr) {
     if (set_nonblock(fd) < 0) {
         ERR("set_nonblock fd=%d fail", fd);
         return -1;
     }
 
-    struct epoll_event ev;
+    return epoll_fd_attach(self, fd, event, ptr);
+}
+
+int epoll_fd_attach(epoll_fd_t *self, int fd, int event, void *ptr) {
+    epoll_data_t data;
+    MEMSET(data);
     if (ptr)
-        ev.data.ptr = ptr;
+        data.ptr = ptr;
     else
-        ev.data.fd = fd;
+        data.fd = fd;
+
+    return epoll_fd_attach_data(self, fd, event, data.u64);
+}
+
+int epoll_fd_attach_data(epoll_fd_t *self, int fd, int event, uint64_t data) {
+    struct epoll_event ev;
+    MEMSET(ev);
+    ev.data.u64 = data;
     ev.events = event;
 
+    if (self->ring) {
+        if (uring_fd_add(self->ring, fd, event, ev.data.u64) < 0) {
+            ERR("uring_fd_add fd=%d, event=%d fail", fd, event);
+            return -1;
+        }
+        fd_set_mask(self, fd, event, data);
+        self->stats.ctl_add++;
+        return 0;
+    }
+
     if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
         ERR("epoll_ctl_add fd=%d, event=%d fail", fd, event);
         return -1;
     }
+    fd_set_mask(self, fd, event, data);
+    self->stats.ctl_add++;
 
-    DBG("epoll_ctl_add fd=%d, event=%d, ptr=%p", fd, event, ptr);
+    DBG("epoll_ctl_add fd=%d, event=%d, data=%llx", fd, event, (unsigned long long)data);
     return 0;
 }
 
 int epoll_fd_mod(epoll_fd_t *self, int fd, int event, void *ptr) {
-    struct epoll_event ev;
+    epoll_data_t data;
+    MEMSET(data);
     if (ptr)
-        ev.data.ptr = ptr;
+        data.ptr = ptr;
     else
-        ev.data.fd = fd;
+        data.fd = fd;
+
+    return epoll_fd_mod_data(self, fd, event, data.u64);
+}
+
+int epoll_fd_mod_data(epoll_fd_t *self, int fd, int event, uint64_t data) {
+    if (fd >= 0 && fd < self->nfds && self->fds[fd].mask == event && self->fds[fd].data == data &&
+        !(event & EPOLLONESHOT)) {
+        self->stats.ctl_mod_skipped++;
+        return 0;
+    }
+
+    struct epoll_event ev;
+    MEMSET(ev);
+    ev.data.u64 = data;
     ev.events = event;
 
+    if (self->ring) {
+        if (uring_fd_mod(self->ring, fd, event, ev.data.u64) < 0) {
+            ERR("uring_fd_mod fd=%d, event=%d fail", fd, event);
+            return -1;
+        }
+        fd_set_mask(self, fd, event, data);
+        self->stats.ctl_mod++;
+        return 0;
+    }
+
     if (epoll_ctl(self->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
         ERR("epoll_ctl_mod fd=%d, event=%d fail", fd, event);
         return -1;
     }
+    fd_set_mask(self, fd, event, data);
+    self->stats.ctl_mod++;
 
     DBG("epoll_ctl_mod fd=%d, event=%d", fd, event);
     return 0;
 }
 
 int epoll_fd_del(epoll_fd_t *self, int fd) {
+    if (fd >= 0 && fd < self->nfds) self->fds[fd].mask = -1;
+
+    if (self->ring) {
+        if (uring_fd_del(self->ring, fd) < 0) {
+            ERR("uring_fd_del fd=%d fail", fd);
+            return -1;
+        }
+        self->stats.ctl_del++;
+        return 0;
+    }
+
     if (epoll_ctl(self->epfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
         ERR("epoll_ctl_del fd=%d fail", fd);
         return -1;
     }
+    self->stats.ctl_del++;
 
     DBG("epoll_ctl_del fd=%d", fd);
     return 0;
 }
 
-int epoll_fd_wait(epoll_fd_t *self, int timeout) { return epoll_wait(self->epfd, self->events, self->size, timeout); }
+static inline void count_wait(reactor_stats_t *stats, int n, size_t size) {
+    stats->waits++;
+    if (n <= 0) {
+        stats->waits_empty++;
+        stats->hist[0]++;
+        return;
+    }
+
+    int b = 32 - __builtin_clz((unsigned int)n);
+    stats->hist[b < REACTOR_HIST_BUCKETS ? b : REACTOR_HIST_BUCKETS - 1]++;
+    stats->events += n;
+    if ((size_t)n == size) stats->waits_full++;
+}
+
+static void count_done(reactor_stats_t *stats, struct epoll_event *events, int n) {
+    int i = 0;
+    for (i = 0; i < n; i++) {
+        uint32_t done = events[i].events & REACTOR_DONE_MASK;
+        if (!done) continue;
+
+        int res = reactor_event_result(&events[i]);
+        if (res < 0) continue;
+        if (done == REACTOR_DONE_READ)
+            stats->done_rx_bytes += res;
+        else if (done == REACTOR_DONE_WRITE)
+            stats->done_tx_bytes += res;
+        else
+            stats->done_accepted++;
+    }
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#ifdef __NR_epoll_pwait2
+static int pwait2_ok = 1;  // cleared on the first ENOSYS
+#endif
+
+static int sys_wait(epoll_fd_t *self, int64_t timeout_us) {
+    if (self->ring) return uring_wait(self->ring, self->events, self->size, timeout_us);
+
+#ifdef __NR_epoll_pwait2
+    if (timeout_us > 0 && timeout_us % 1000 && pwait2_ok) {
+        struct timespec ts = {timeout_us / 1000000, (timeout_us % 1000000) * 1000};
+        int n = (int)syscall(__NR_epoll_pwait2, self->epfd, self->events, self->size, &ts, NULL, 0);
+        if (n >= 0 || errno != ENOSYS) return n;
+        pwait2_ok = 0;
+    }
+#endif
+
+    int ms = timeout_us < 0 ? -1 : (int)((timeout_us + 999) / 1000);
+    return epoll_wait(self->epfd, self->events, self->size, ms);
+}
+
+/*
+ * zero timeout polls until events show up, the spin budget since the last
+ * activity runs out or timeout_us passes. Returns the events found, 0 when
+ * the caller should block for the (updated) *timeout_us, -1 on error.
+ */
+static int spin_wait(epoll_fd_t *self, int64_t *timeout_us) {
+    uint64_t start = now_ns();
+    uint64_t until = self->active_ns + (uint64_t)self->spin_us * 1000;
+    if (start >= until) return 0;
+
+    uint64_t now = start;
+    while (1) {
+        self->stats.spins++;
+        int n = sys_wait(self, 0);
+        if (n != 0) {
+            if (n > 0) self->stats.spin_hits++;
+            return n;
+        }
+
+        now = now_ns();
+        if (now >= until) break;
+        if (*timeout_us >= 0 && (int64_t)(now - start) / 1000 >= *timeout_us) break;
+    }
+
+    if (*timeout_us > 0) {
+        *timeout_us -= (int64_t)(now - start) / 1000;
+        if (*timeout_us < 0) *timeout_us = 0;
+    }
+    return 0;
+}
+
+int epoll_fd_wait_us(epoll_fd_t *self, int64_t timeout_us) {
+    int next = timer_next_timeout(self->timers);
+    if (next >= 0 && (timeout_us < 0 || (int64_t)next * 1000 < timeout_us)) timeout_us = (int64_t)next * 1000;
+
+    int n = 0;
+    if (self->spin_us && timeout_us != 0) n = spin_wait(self, &timeout_us);
+    if (n == 0) n = sys_wait(self, timeout_us);
+    if (n > 0 && self->spin_us) self->active_ns = now_ns();
+
+    if (self->ring && n > 0) count_done(&self->stats, self->events, n);
+    count_wait(&self->stats, n, self->size);
+    return n;
+}
+
+int epoll_fd_wait(epoll_fd_t *self, int timeout) {
+    return epoll_fd_wait_us(self, timeout < 0 ? -1 : (int64_t)timeout * 1000);
+}
+
+void epoll_fd_set_busy_poll(epoll_fd_t *self, uint32_t spin_us) {
+    self->spin_us = spin_us;
+    self->active_ns = spin_us ? now_ns() : 0;
+}
 
 struct epoll_event *epoll_events(epoll_fd_t *self) {
     return self->events;
 }
+
+int epoll_fd_submit_read(epoll_fd_t *self, int fd, void *buf, size_t len) {
+    if (self->ring == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return uring_submit_read(self->ring, fd, buf, len);
+}
+
+int epoll_fd_submit_write(epoll_fd_t *self, int fd, const void *buf, size_t len) {
+    if (self->ring == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return uring_submit_write(self->ring, fd, buf, len);
+}
+
+int epoll_fd_submit_accept(epoll_fd_t *self, int fd) {
+    if (self->ring == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return uring_submit_accept(self->ring, fd);
+}
+
+int epoll_fd_submit_cancel(epoll_fd_t *self, int fd, uint32_t done) {
+    if (self->ring == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return uring_submit_cancel(self->ring, fd, done);
+}
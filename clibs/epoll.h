@@ -5,24 +5,149 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <sys/epoll.h>
 
+#include "timer.h"
+
+typedef enum {
+    REACTOR_EPOLL = 0,
+    REACTOR_URING,
+} reactor_backend_t;
+
+/*
+ * io_uring completions are delivered through the same events array as
+ * readiness, tagged with one of these bits (none of them collide with an
+ * EPOLL* flag). For such an event data.u64 holds the fd in its low and the
+ * syscall result (bytes, new fd or -errno) in its high 32 bits.
+ */
+#define REACTOR_DONE_READ (1u << 20)
+#define REACTOR_DONE_WRITE (1u << 21)
+#define REACTOR_DONE_ACCEPT (1u << 22)
+#define REACTOR_DONE_MASK (REACTOR_DONE_READ | REACTOR_DONE_WRITE | REACTOR_DONE_ACCEPT)
+
+inline static int reactor_event_result(struct epoll_event *ev) { return (int32_t)(ev->data.u64 >> 32); }
+
+struct uring;
+
+/*
+ * reactor counters, bumped inline, cleared only by an explicit reset.
+ * hist[] counts waits by the events they returned: bucket 0 holds empty
+ * waits, bucket b >= 1 those with [2^(b-1), 2^b) events, the last one
+ * everything above. The done_* fields sum up io_uring completions, which
+ * bypass the sock layer and its counters. stale is up to whoever
+ * dispatches the events.
+ */
+#define REACTOR_HIST_BUCKETS 10
+
+typedef struct reactor_stats {
+    uint64_t waits;
+    uint64_t waits_empty;  // timed out or interrupted
+    uint64_t waits_full;   // filled the whole events array, size may be too small
+    uint64_t events;
+    uint64_t hist[REACTOR_HIST_BUCKETS];
+    uint64_t ctl_add;  // registration changes that went through, failed ones are not counted
+    uint64_t ctl_mod;
+    uint64_t ctl_mod_skipped;  // epoll_fd_mod() calls that changed nothing, no syscall made
+    uint64_t ctl_del;
+    uint64_t done_rx_bytes;
+    uint64_t done_tx_bytes;
+    uint64_t done_accepted;
+    uint64_t stale;  // events dropped because their fd had been closed and reused meanwhile
+    uint64_t spins;      // zero timeout polls made by busy polling
+    uint64_t spin_hits;  // waits busy polling answered without blocking
+} reactor_stats_t;
+
+/*
+ * what an fd is registered with, so a modify that would not change anything
+ * costs no syscall. mask is -1 while fd is not registered.
+ */
+typedef struct reactor_fd {
+    uint64_t data;
+    int mask;
+} reactor_fd_t;
+
 typedef struct epoll_fd {
     int epfd;
     size_t size;
     struct epoll_event *events;
+    reactor_backend_t backend;
+    struct uring *ring;  // REACTOR_URING only
+    timer_wheel_t *timers;
+    reactor_stats_t stats;
+    reactor_fd_t *fds;  // indexed by fd, grown on demand
+    int nfds;
+    uint32_t spin_us;    // busy poll budget, 0 if off
+    uint64_t active_ns;  // CLOCK_MONOTONIC of the last wait that returned events
 } epoll_fd_t;
 
 int epoll_fd_create(epoll_fd_t *self, size_t size);
+/*
+ * REACTOR_URING falls back to REACTOR_EPOLL when the kernel has no usable
+ * io_uring, check self->backend for what was actually created.
+ */
+int epoll_fd_create_backend(epoll_fd_t *self, size_t size, reactor_backend_t backend);
 void epoll_fd_close(epoll_fd_t *self);
 
 int epoll_fd_add(epoll_fd_t *self, int fd, int event, void *ptr);
+// epoll_fd_add() for an fd already known to be non-blocking, skips the fcntl
+int epoll_fd_attach(epoll_fd_t *self, int fd, int event, void *ptr);
 int epoll_fd_del(epoll_fd_t *self, int fd);
+/*
+ * a no-op when fd is registered with event and ptr already (EPOLLONESHOT
+ * always goes through, it re-arms). An fd must be deleted before it is
+ * closed, or its cached registration outlives it.
+ */
 int epoll_fd_mod(epoll_fd_t *self, int fd, int event, void *ptr);
+/*
+ * attach/mod with the raw 64 bit epoll_data of the registration, which
+ * comes back as data.u64 of every readiness event of fd. The low 32 bits
+ * should still be fd: completions only carry that much.
+ */
+int epoll_fd_attach_data(epoll_fd_t *self, int fd, int event, uint64_t data);
+int epoll_fd_mod_data(epoll_fd_t *self, int fd, int event, uint64_t data);
 
+/*
+ * timeout is shortened to the next pending timer, so a loop that calls
+ * epoll_fd_expire() after every wait never oversleeps a deadline. A loop
+ * that does not expire them keeps waking up at timeout 0 once one is due.
+ */
 int epoll_fd_wait(epoll_fd_t *self, int timeout);
+/*
+ * epoll_fd_wait() with the timeout in microseconds (-1 forever). Sub
+ * millisecond timeouts use epoll_pwait2() where the kernel has it and are
+ * rounded up to the next millisecond otherwise.
+ */
+int epoll_fd_wait_us(epoll_fd_t *self, int64_t timeout_us);
 struct epoll_event *epoll_events(epoll_fd_t *self);
 
+/*
+ * hybrid polling: for spin_us after a wait that returned events, waits keep
+ * polling with a zero timeout instead of putting the thread to sleep, so a
+ * request that follows shortly is picked up without a wakeup. Once the
+ * budget passes without activity they block again. Burns a core while
+ * spinning, 0 (the default) turns it off.
+ */
+void epoll_fd_set_busy_poll(epoll_fd_t *self, uint32_t spin_us);
+
+inline static void epoll_fd_timer_add(epoll_fd_t *self, timer_node_t *node, uint32_t ms) {
+    timer_add(self->timers, node, ms);
+}
+inline static void epoll_fd_timer_del(epoll_fd_t *self, timer_node_t *node) { timer_del(self->timers, node); }
+// move the due timers onto expired, see timer_expire()
+inline static int epoll_fd_expire(epoll_fd_t *self, timer_node_t *expired) {
+    return timer_expire(self->timers, expired);
+}
+
+/*
+ * completion based I/O, REACTOR_URING only (-1 with ENOTSUP otherwise). The
+ * buffer must stay valid until the matching REACTOR_DONE_* event is reaped.
+ */
+int epoll_fd_submit_read(epoll_fd_t *self, int fd, void *buf, size_t len);
+int epoll_fd_submit_write(epoll_fd_t *self, int fd, const void *buf, size_t len);
+int epoll_fd_submit_accept(epoll_fd_t *self, int fd);
+int epoll_fd_submit_cancel(epoll_fd_t *self, int fd, uint32_t done);
+
 #ifdef __cplusplus
 }
 #endif
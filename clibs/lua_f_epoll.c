@@ -1,13 +1,206 @@
 #include "epoll.h"
 #include "lua_f_util.h"
+#include "pool.h"
 
 #define EPOLL_METATABLE_NAME "ywh.EpollMT"
 
 #define check_epoll_fd(L) luaL_checkudata(L, 1, EPOLL_METATABLE_NAME)
 
+/*
+ * per fd state of an epoll object: the coroutine waiting on it, so
+ * run()/run_once() can resume them straight from C, and with the io_uring
+ * backend the buffers of its in-flight read/write submissions.
+ *
+ * gen is bumped whenever a coroutine lets go of the fd. Registrations made
+ * through attach/modify carry it in the high half of their epoll data and
+ * submissions remember it in sgen, so an event that was already queued for
+ * a closed fd is recognized and dropped once the number got reused.
+ */
+typedef struct lua_epoll_slot {
+    int co_ref;  // luaL_ref of the bound coroutine, LUA_NOREF if none
+    uint32_t gen;
+    uint32_t sgen;  // gen of the last submission on fd
+    int wref;    // string pinned by an in-flight submit_write, LUA_NOREF if none
+    char *rbuf;  // landing buffer of submit_read, a pool block held until the data is handed out
+    size_t rsize;
+    int rlen;     // bytes in rbuf, filled by the read completion
+    int res;      // result of the last completion on fd
+    int8_t rbusy;  // a read is in flight
+} lua_epoll_slot_t;
+
+/*
+ * a pending ep:timer(). Entries are allocated one by one and recycled through
+ * a free list (never moved, the wheel links them in place), Lua refers to
+ * them by a handle of index and generation so a stale cancel is harmless.
+ */
+typedef struct lua_epoll_timer {
+    timer_node_t node;  // must stay first, expired nodes are cast back
+    int co_ref;         // coroutine resumed with 0 on expiry
+    int index;
+    uint32_t gen;
+    int next_free;
+} lua_epoll_timer_t;
+
+#define TIMER_HANDLE_SPAN (1 << 24)
+
+/*
+ * the userdata behind an epoll object. ep must stay the first member, every
+ * binding below casts the userdata to epoll_fd_t directly.
+ */
+typedef struct lua_epoll {
+    epoll_fd_t ep;
+    lua_epoll_slot_t *slots;  // indexed by fd
+    int nslots;
+    int co_nums;  // number of bound coroutines
+
+    lua_epoll_timer_t **timers;
+    int ntimers;
+    int timer_free;  // head of the free list, -1 if empty
+    int timer_nums;  // pending timers, run() returns once both counts drop to 0
+} lua_epoll_t;
+
+static int slot_reserve(lua_epoll_t *self, int fd) {
+    if (fd < self->nslots) return 0;
+
+    int size = self->nslots ? self->nslots : 1024;
+    while (size <= fd) size <<= 1;
+
+    lua_epoll_slot_t *slots = (lua_epoll_slot_t *)realloc(self->slots, sizeof(lua_epoll_slot_t) * size);
+    if (slots == NULL) return -1;
+
+    memset(slots + self->nslots, 0, sizeof(lua_epoll_slot_t) * (size - self->nslots));
+    int i;
+    for (i = self->nslots; i < size; i++) {
+        slots[i].co_ref = LUA_NOREF;
+        slots[i].wref = LUA_NOREF;
+    }
+    self->slots = slots;
+    self->nslots = size;
+    return 0;
+}
+
+static void slot_rbuf_put(lua_epoll_slot_t *slot) {
+    pool_put(slot->rbuf, slot->rsize);
+    slot->rbuf = NULL;
+    slot->rsize = 0;
+}
+
+// epoll data of a registration through slot: the fd tagged with its gen
+static inline uint64_t slot_data(lua_epoll_t *self, int fd) {
+    return ((uint64_t)self->slots[fd].gen << 32) | (uint32_t)fd;
+}
+
+// an event queued before fd last changed hands, see lua_epoll_slot_t
+static inline int slot_stale(lua_epoll_slot_t *slot, struct epoll_event *ev) {
+    if (ev->events & REACTOR_DONE_MASK) return slot->sgen != slot->gen;
+    return (uint32_t)(ev->data.u64 >> 32) != slot->gen;
+}
+
+// attach (mod == 0) or modify fd, tagged with the gen of its slot
+static int slot_ctl(lua_epoll_t *self, int fd, int event, int mod) {
+    if (slot_reserve(self, fd) < 0) return -1;
+
+    // slot_park() may have taken fd out of the set, put it back
+    if (mod && fd < self->ep.nfds && self->ep.fds[fd].mask < 0) mod = 0;
+
+    if (mod) return epoll_fd_mod_data(&self->ep, fd, event, slot_data(self, fd));
+    return epoll_fd_attach_data(&self->ep, fd, event, slot_data(self, fd));
+}
+
+static void co_unbind(lua_State *L, lua_epoll_t *self, int fd) {
+    if (fd < 0 || fd >= self->nslots || self->slots[fd].co_ref == LUA_NOREF) return;
+
+    luaL_unref(L, LUA_REGISTRYINDEX, self->slots[fd].co_ref);
+    self->slots[fd].co_ref = LUA_NOREF;
+    self->slots[fd].gen++;
+    self->co_nums--;
+}
+
+/*
+ * bookkeeping for a REACTOR_DONE_* event: record its result and release
+ * what the submission pinned. Returns the slot, NULL for plain readiness.
+ */
+static lua_epoll_slot_t *io_complete(lua_State *L, lua_epoll_t *self, struct epoll_event *ev) {
+    if (!(ev->events & REACTOR_DONE_MASK)) return NULL;
+
+    int fd = ev->data.fd;
+    if (fd < 0 || fd >= self->nslots) return NULL;
+
+    lua_epoll_slot_t *slot = &self->slots[fd];
+    slot->res = reactor_event_result(ev);
+    if (ev->events & REACTOR_DONE_READ) {
+        slot->rbusy = 0;
+        slot->rlen = slot->res > 0 ? slot->res : 0;
+        if (slot->rlen == 0) slot_rbuf_put(slot);
+    }
+    if ((ev->events & REACTOR_DONE_WRITE) && slot->wref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, slot->wref);
+        slot->wref = LUA_NOREF;
+    }
+
+    return slot;
+}
+
+static lua_epoll_timer_t *timer_alloc(lua_epoll_t *self) {
+    if (self->timer_free < 0) {
+        if (self->ntimers >= TIMER_HANDLE_SPAN) return NULL;
+
+        lua_epoll_timer_t **timers =
+            (lua_epoll_timer_t **)realloc(self->timers, sizeof(lua_epoll_timer_t *) * (self->ntimers + 1));
+        if (timers == NULL) return NULL;
+        self->timers = timers;
+
+        lua_epoll_timer_t *t = (lua_epoll_timer_t *)MALLOC(sizeof(lua_epoll_timer_t));
+        if (t == NULL) return NULL;
+        t->co_ref = LUA_NOREF;
+        t->index = self->ntimers;
+        t->next_free = -1;
+        self->timers[self->ntimers++] = t;
+        self->timer_free = t->index;
+    }
+
+    lua_epoll_timer_t *t = self->timers[self->timer_free];
+    self->timer_free = t->next_free;
+    return t;
+}
+
+static void timer_release(lua_State *L, lua_epoll_t *self, lua_epoll_timer_t *t) {
+    epoll_fd_timer_del(&self->ep, &t->node);
+    luaL_unref(L, LUA_REGISTRYINDEX, t->co_ref);
+    t->co_ref = LUA_NOREF;
+    t->gen++;
+    t->next_free = self->timer_free;
+    self->timer_free = t->index;
+    self->timer_nums--;
+}
+
 static int lua_f_epoll_close(lua_State *L) {
-    epoll_fd_t *self = (epoll_fd_t *)check_epoll_fd(L);
-    epoll_fd_close(self);
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
+    epoll_fd_close(&self->ep);
+
+    int i;
+    for (i = 0; i < self->ntimers; i++) {
+        luaL_unref(L, LUA_REGISTRYINDEX, self->timers[i]->co_ref);
+        free(self->timers[i]);
+    }
+    safe_free(self->timers);
+    self->ntimers = 0;
+    self->timer_free = -1;
+    self->timer_nums = 0;
+
+    /*
+     * the ring tears down asynchronously, an operation still in flight may
+     * go on using its buffer after the close: leak the buffer of such a
+     * read and leave the string of such a write pinned.
+     */
+    int fd;
+    for (fd = 0; fd < self->nslots; fd++) {
+        lua_epoll_slot_t *slot = &self->slots[fd];
+        co_unbind(L, self, fd);
+        if (!slot->rbusy) slot_rbuf_put(slot);
+    }
+    safe_free(self->slots);
+    self->nslots = 0;
     return 0;
 }
 
@@ -16,18 +209,23 @@ static int lua_f_epoll_add(lua_State *L) {
         RETERR("invalid args");
     }
 
-    epoll_fd_t *self = (epoll_fd_t *)check_epoll_fd(L);
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
     int fd = luaL_checkint(L, 2);
     int event = luaL_checkint(L, 3);
-    void *ptr = NULL;
-
-    if (lua_isuserdata(L, 4)) ptr = lua_touserdata(L, 4);
 
     if (fd < 0) {
         RETERR("invalid fd");
     }
 
-    if (epoll_fd_add(self, fd, event, ptr) < 0) {
+    if (lua_isuserdata(L, 4)) {
+        if (epoll_fd_add(&self->ep, fd, event, lua_touserdata(L, 4)) < 0) {
+            RETERR("epoll_fd_add fail");
+        }
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    if (set_nonblock(fd) < 0 || slot_ctl(self, fd, event, 0) < 0) {
         RETERR("epoll_fd_add fail");
     }
 
@@ -35,23 +233,50 @@ static int lua_f_epoll_add(lua_State *L) {
     return 1;
 }
 
+/*
+ * ep:attach(fd, event)
+ * add() for fds that are non-blocking already (sock.new, accept_batch,
+ * sock.from_fd), registers without touching the fd flags.
+ */
+static int lua_f_epoll_attach(lua_State *L) {
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
+    int fd = luaL_checkint(L, 2);
+    int event = luaL_checkint(L, 3);
+
+    if (fd < 0) {
+        RETERR("invalid fd");
+    }
+
+    if (slot_ctl(self, fd, event, 0) < 0) {
+        RETERR("epoll_fd_attach fail");
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 static int lua_f_epoll_modify(lua_State *L) {
     if (lua_gettop(L) < 3) {
         RETERR("invalid args");
     }
 
-    epoll_fd_t *self = (epoll_fd_t *)check_epoll_fd(L);
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
     int fd = luaL_checkint(L, 2);
     int event = luaL_checkint(L, 3);
-    void *ptr = NULL;
-
-    if (lua_isuserdata(L, 4)) ptr = lua_touserdata(L, 4);
 
     if (fd < 0) {
         RETERR("invalid fd");
     }
 
-    if (epoll_fd_mod(self, fd, event, ptr) < 0) {
+    if (lua_isuserdata(L, 4)) {
+        if (epoll_fd_mod(&self->ep, fd, event, lua_touserdata(L, 4)) < 0) {
+            RETERR("epoll_fd_mod fail");
+        }
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    if (slot_ctl(self, fd, event, 1) < 0) {
         RETERR("epoll_fd_mod fail");
     }
 
@@ -64,14 +289,20 @@ static int lua_f_epoll_del(lua_State *L) {
         RETERR("invalid args");
     }
 
-    epoll_fd_t *self = (epoll_fd_t *)check_epoll_fd(L);
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
     int fd = luaL_checkint(L, 2);
 
     if (fd < 0) {
         RETERR("invalid fd");
     }
 
-    if (epoll_fd_del(self, fd) < 0) {
+    // already out of the set, e.g. dropped by slot_park()
+    if (fd < self->ep.nfds && self->ep.fds[fd].mask < 0) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    if (epoll_fd_del(&self->ep, fd) < 0) {
         RETERR("epoll_fd_del fail");
     }
 
@@ -79,6 +310,9 @@ static int lua_f_epoll_del(lua_State *L) {
     return 1;
 }
 
+// wait and wait_into fire due timers too, see below
+static void timer_dispatch(lua_State *L, lua_epoll_t *self);
+
 static int lua_f_epoll_wait(lua_State *L) {
     epoll_fd_t *self = (epoll_fd_t *)check_epoll_fd(L);
     int timeout = luaL_optint(L, 2, -1);
@@ -98,6 +332,7 @@ static int lua_f_epoll_wait(lua_State *L) {
     lua_newtable(L);
     int i;
     for (i = 0; i < n; ++i) {
+        io_complete(L, (lua_epoll_t *)self, &self->events[i]);
         lua_pushinteger(L, self->events[i].events);
         lua_rawseti(L, -2, i + 1);
     }
@@ -114,18 +349,595 @@ static int lua_f_epoll_wait(lua_State *L) {
         DBG("setfield: %s", key);
     }
 
+    timer_dispatch(L, (lua_epoll_t *)self);
     return 2;
 }
 
+/*
+ * ep:wait_into(t_ev, t_fd [, timeout]) -> n
+ * fill the caller-owned t_ev/t_fd arrays in place with event masks and
+ * integer fds, only slots [1, n] are valid after the call. Reusing the same
+ * two tables across calls keeps the steady-state loop allocation free.
+ * For fds added without a ptr only: the fd reported is the low half of the
+ * event data, which an ep:add(fd, ev, ptr) registration fills with ptr.
+ * Like wait() and run(), due ep:timer()s are resumed before it returns: the
+ * wait is cut short for them, skipping them would spin at timeout 0.
+ */
+static int lua_f_epoll_wait_into(lua_State *L) {
+    epoll_fd_t *self = (epoll_fd_t *)check_epoll_fd(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    int timeout = luaL_optint(L, 4, -1);
+
+    int n = epoll_fd_wait(self, timeout);
+    if (n < 0) {
+        if (errno != EINTR) {
+            RETERR("epoll_fd_wait fail");
+        }
+        n = 0;
+    }
+    DBG("epoll_fd_wait timeout=%d, n=%d", timeout, n);
+
+    int i;
+    for (i = 0; i < n; ++i) {
+        io_complete(L, (lua_epoll_t *)self, &self->events[i]);
+        lua_pushinteger(L, self->events[i].events);
+        lua_rawseti(L, 2, i + 1);
+        lua_pushinteger(L, self->events[i].data.fd);
+        lua_rawseti(L, 3, i + 1);
+    }
+
+    timer_dispatch(L, (lua_epoll_t *)self);
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+/*
+ * ep:bind(fd, co)
+ * register co as the coroutine to resume when fd becomes ready.
+ * ep:unbind(fd) lets go of fd: events still queued for it are dropped.
+ */
+static int lua_f_epoll_bind(lua_State *L) {
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
+    int fd = luaL_checkint(L, 2);
+    luaL_checktype(L, 3, LUA_TTHREAD);
+
+    if (fd < 0) {
+        RETERR("invalid fd");
+    }
+
+    if (slot_reserve(self, fd) < 0) {
+        RETERR("slot_reserve fail");
+    }
+
+    // handing fd over to another coroutine keeps its gen, the events
+    // already queued belong to the new owner
+    lua_epoll_slot_t *slot = &self->slots[fd];
+    if (slot->co_ref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, slot->co_ref);
+        self->co_nums--;
+    }
+
+    lua_pushvalue(L, 3);
+    slot->co_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    self->co_nums++;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int lua_f_epoll_unbind(lua_State *L) {
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
+    int fd = luaL_checkint(L, 2);
+    co_unbind(L, self, fd);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * push what a coroutine gets for a completion besides the mask:
+ * the result and, for a read the data, for a failure the error string.
+ */
+static int push_completion(lua_State *co, struct epoll_event *ev, lua_epoll_slot_t *slot) {
+    lua_pushinteger(co, slot->res);
+    if (slot->res < 0) {
+        lua_pushstring(co, strerror(-slot->res));
+        return 2;
+    }
+
+    if ((ev->events & REACTOR_DONE_READ) && slot->rlen > 0) {
+        lua_pushlstring(co, slot->rbuf, slot->rlen);
+        slot->rlen = 0;
+        slot_rbuf_put(slot);
+        return 2;
+    }
+
+    return 1;
+}
+
+/*
+ * what a coroutine yields (epoll.PARKED) while it waits for something other
+ * than its fds, a timer or an offloaded task, see slot_park()
+ */
+#define CO_PARKED (-1)
+
+/*
+ * resume co (anchored on L by the caller) with the narg values already
+ * pushed on it. Errors are reported and otherwise swallowed, one failing
+ * coroutine must not stop the loop. Returns LUA_YIELD, CO_PARKED for a
+ * yield of epoll.PARKED, else the error status.
+ */
+static int co_resume(lua_State *co, int narg, const char *what, int id) {
+    int status = lua_resume(co, narg);
+    if (status == LUA_YIELD) {
+        if (lua_gettop(co) > 0 && lua_type(co, 1) == LUA_TNUMBER && lua_tointeger(co, 1) == CO_PARKED)
+            status = CO_PARKED;
+        lua_settop(co, 0);
+        return status;
+    }
+
+    if (status != 0) {
+        fprintf(stderr, "co at %s=%d fail: %s\n", what, id, lua_tostring(co, -1));
+    }
+    return status;
+}
+
+/*
+ * the coroutine bound to fd was woken by events and went on waiting for a
+ * timer or an offloaded task. A level-triggered interest left behind by its
+ * last read or write would wake it on every pass until then (pipelined
+ * data, a half-closed peer), so fd drops to errors only, and errors and
+ * hangups, which can not be masked, take it out of the set. The next
+ * ep:modify() puts the interest back. Edge-triggered registrations only
+ * fire on new edges and are left alone, completions are not polled.
+ */
+static void slot_park(lua_epoll_t *self, int fd, uint32_t events) {
+    epoll_fd_t *ep = &self->ep;
+    if (ep->ring || fd >= ep->nfds || ep->fds[fd].mask < 0 || (ep->fds[fd].mask & EPOLLET)) return;
+
+    if (events & (EPOLLERR | EPOLLHUP))
+        epoll_fd_del(ep, fd);
+    else
+        epoll_fd_mod_data(ep, fd, EPOLLERR, ep->fds[fd].data);
+}
+
+/*
+ * resume the coroutine bound to each ready fd with the event mask as the
+ * resume value, completions also pass (res, data|err), see push_completion.
+ * A coroutine that finishes or raises is unbound, one that parks gets fd
+ * muted.
+ */
+static void co_dispatch(lua_State *L, lua_epoll_t *self, int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        struct epoll_event *ev = &self->ep.events[i];
+        lua_epoll_slot_t *done = io_complete(L, self, ev);
+        int fd = ev->data.fd;
+        if (fd < 0 || fd >= self->nslots || self->slots[fd].co_ref == LUA_NOREF) {
+            DBG("co is nil at fd=%d", fd);
+            continue;
+        }
+
+        if (slot_stale(&self->slots[fd], ev)) {
+            DBG("stale event at fd=%d", fd);
+            if (done) {
+                done->rlen = 0;
+                slot_rbuf_put(done);
+            }
+            self->ep.stats.stale++;
+            continue;
+        }
+
+        // keep co anchored on L, it may unbind itself while running
+        lua_rawgeti(L, LUA_REGISTRYINDEX, self->slots[fd].co_ref);
+        lua_State *co = lua_tothread(L, -1);
+
+        int narg = 1;
+        lua_pushinteger(co, ev->events);
+        if (done) narg += push_completion(co, ev, done);
+
+        int status = co_resume(co, narg, "fd", fd);
+        if (status == CO_PARKED && !done) slot_park(self, fd, ev->events);
+        if (status == LUA_YIELD || status == CO_PARKED) {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        // drop the binding unless the coroutine already handed fd to another one
+        if (fd < self->nslots && self->slots[fd].co_ref != LUA_NOREF) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, self->slots[fd].co_ref);
+            if (lua_tothread(L, -1) == co) co_unbind(L, self, fd);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+/*
+ * resume the coroutine of every due timer with 0 (epoll.TIMEOUT). The whole
+ * batch is unlinked from the wheel first, so callbacks may re-arm freely.
+ */
+static void timer_dispatch(lua_State *L, lua_epoll_t *self) {
+    timer_node_t expired;
+    timer_list_init(&expired);
+    if (epoll_fd_expire(&self->ep, &expired) == 0) return;
+
+    while (!timer_list_empty(&expired)) {
+        lua_epoll_timer_t *t = (lua_epoll_timer_t *)expired.next;
+        expired.next = t->node.next;
+        t->node.next->prev = &expired;
+        t->node.prev = t->node.next = NULL;
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, t->co_ref);
+        int index = t->index;
+        timer_release(L, self, t);
+
+        lua_State *co = lua_tothread(L, -1);
+        // finished (or running) coroutines have nothing to resume
+        if (co && (lua_status(co) == LUA_YIELD || lua_gettop(co) > 0)) {
+            lua_pushinteger(co, 0);
+            co_resume(co, 1, "timer", index);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+static int epoll_run_once(lua_State *L, lua_epoll_t *self, int timeout) {
+    int n = epoll_fd_wait(&self->ep, timeout);
+    if (n < 0) {
+        if (errno != EINTR) return -1;
+        n = 0;
+    }
+
+    co_dispatch(L, self, n);
+    timer_dispatch(L, self);
+    return n;
+}
+
+/*
+ * ep:timer(ms, co) -> handle
+ * resume co with 0 (epoll.TIMEOUT) once ms have passed.
+ */
+static int lua_f_epoll_timer(lua_State *L) {
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
+    int ms = luaL_checkint(L, 2);
+    luaL_checktype(L, 3, LUA_TTHREAD);
+
+    if (ms < 0) ms = 0;
+
+    lua_epoll_timer_t *t = timer_alloc(self);
+    if (t == NULL) {
+        RETERR("timer_alloc fail");
+    }
+
+    lua_pushvalue(L, 3);
+    t->co_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    t->node.next = t->node.prev = NULL;
+    epoll_fd_timer_add(&self->ep, &t->node, ms);
+    self->timer_nums++;
+
+    lua_pushnumber(L, (lua_Number)t->gen * TIMER_HANDLE_SPAN + t->index);
+    return 1;
+}
+
+/*
+ * ep:cancel(handle)
+ * drop a pending timer, a handle that already fired is ignored.
+ */
+static int lua_f_epoll_cancel(lua_State *L) {
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
+    lua_Number handle = luaL_checknumber(L, 2);
+
+    uint32_t gen = (uint32_t)(handle / TIMER_HANDLE_SPAN);
+    int index = (int)(handle - (lua_Number)gen * TIMER_HANDLE_SPAN);
+    if (index >= 0 && index < self->ntimers) {
+        lua_epoll_timer_t *t = self->timers[index];
+        if (t->gen == gen && t->co_ref != LUA_NOREF) timer_release(L, self, t);
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * ep:run_once([timeout]) -> n
+ * wait once, dispatch the ready events to their bound coroutines and fire
+ * the due timers. The wait never outlasts the next timer.
+ */
+static int lua_f_epoll_run_once(lua_State *L) {
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
+    int timeout = luaL_optint(L, 2, -1);
+
+    int n = epoll_run_once(L, self, timeout);
+    if (n < 0) {
+        RETERR("epoll_fd_wait fail");
+    }
+
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+/*
+ * ep:run()
+ * dispatch events and timers until no coroutine is bound and no timer is
+ * pending any more.
+ */
+static int lua_f_epoll_run(lua_State *L) {
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
+
+    while (self->co_nums > 0 || self->timer_nums > 0) {
+        if (epoll_run_once(L, self, -1) < 0) {
+            RETERR("epoll_fd_wait fail");
+        }
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * ep:busy_poll(us)
+ * spin for up to us microseconds after activity before blocking, see
+ * epoll_fd_set_busy_poll(). 0 turns it off.
+ */
+static int lua_f_epoll_busy_poll(lua_State *L) {
+    epoll_fd_t *self = (epoll_fd_t *)check_epoll_fd(L);
+    int us = luaL_checkint(L, 2);
+    if (us < 0) {
+        RETERR("invalid budget");
+    }
+
+    epoll_fd_set_busy_poll(self, (uint32_t)us);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int lua_f_epoll_backend(lua_State *L) {
+    epoll_fd_t *self = (epoll_fd_t *)check_epoll_fd(L);
+    lua_pushstring(L, self->backend == REACTOR_URING ? "uring" : "epoll");
+    return 1;
+}
+
+/*
+ * ep:stats([reset])
+ * the reactor counters (see reactor_stats_t): waits, waits_empty, waits_full,
+ * events, hist (waits by events returned, keyed "0", "1", "2-3", ... "256+"),
+ * ctl_add, ctl_mod, ctl_mod_skipped, ctl_del, the done_* io_uring completion
+ * sums, stale (events dropped by run() because their fd had changed hands),
+ * spins and spin_hits of busy polling and the bytes this module's pool has
+ * handed out (pool_inuse) or keeps (pool_cached).
+ * reset clears the counters afterwards, for per-interval sampling.
+ */
+static int lua_f_epoll_stats(lua_State *L) {
+    epoll_fd_t *self = (epoll_fd_t *)check_epoll_fd(L);
+    reactor_stats_t *stats = &self->stats;
+
+    lua_createtable(L, 0, 16);
+    LTABLE_SET_NUMBER(L, "waits", stats->waits);
+    LTABLE_SET_NUMBER(L, "waits_empty", stats->waits_empty);
+    LTABLE_SET_NUMBER(L, "waits_full", stats->waits_full);
+    LTABLE_SET_NUMBER(L, "events", stats->events);
+    LTABLE_SET_NUMBER(L, "ctl_add", stats->ctl_add);
+    LTABLE_SET_NUMBER(L, "ctl_mod", stats->ctl_mod);
+    LTABLE_SET_NUMBER(L, "ctl_mod_skipped", stats->ctl_mod_skipped);
+    LTABLE_SET_NUMBER(L, "ctl_del", stats->ctl_del);
+    LTABLE_SET_NUMBER(L, "done_rx_bytes", stats->done_rx_bytes);
+    LTABLE_SET_NUMBER(L, "done_tx_bytes", stats->done_tx_bytes);
+    LTABLE_SET_NUMBER(L, "done_accepted", stats->done_accepted);
+    LTABLE_SET_NUMBER(L, "stale", stats->stale);
+    LTABLE_SET_NUMBER(L, "spins", stats->spins);
+    LTABLE_SET_NUMBER(L, "spin_hits", stats->spin_hits);
+    LTABLE_SET_NUMBER(L, "pool_inuse", pool_stats()->inuse);
+    LTABLE_SET_NUMBER(L, "pool_cached", pool_stats()->cached);
+
+    lua_createtable(L, 0, REACTOR_HIST_BUCKETS);
+    int b = 0;
+    for (b = 0; b < REACTOR_HIST_BUCKETS; b++) {
+        char name[32];
+        if (b < 2)
+            snprintf(name, sizeof(name), "%d", b);
+        else if (b == REACTOR_HIST_BUCKETS - 1)
+            snprintf(name, sizeof(name), "%d+", 1 << (b - 1));
+        else
+            snprintf(name, sizeof(name), "%d-%d", 1 << (b - 1), (1 << b) - 1);
+        LTABLE_SET_NUMBER(L, name, stats->hist[b]);
+    }
+    lua_setfield(L, -2, "hist");
+
+    if (lua_toboolean(L, 2)) memset(stats, 0, sizeof(*stats));
+    return 1;
+}
+
+/*
+ * ep:submit_read(fd [, size])
+ * queue a recv of up to size bytes (default 4096), the data comes back with
+ * the DONE_READ completion. One read in flight per fd.
+ */
+static int lua_f_epoll_submit_read(lua_State *L) {
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
+    int fd = luaL_checkint(L, 2);
+    size_t size = luaL_optint(L, 3, 4096);
+
+    if (fd < 0 || size == 0) {
+        RETERR("invalid args");
+    }
+
+    if (slot_reserve(self, fd) < 0) {
+        RETERR("slot_reserve fail");
+    }
+
+    lua_epoll_slot_t *slot = &self->slots[fd];
+    if (slot->rbusy) {
+        errno = EBUSY;
+        RETERR("read in flight");
+    }
+
+    if (slot->rsize < size) {
+        slot_rbuf_put(slot);
+        slot->rbuf = (char *)pool_get(size, &slot->rsize);
+        if (slot->rbuf == NULL) {
+            slot->rsize = 0;
+            RETERR("pool_get fail");
+        }
+    }
+
+    if (epoll_fd_submit_read(&self->ep, fd, slot->rbuf, size) < 0) {
+        RETERR("epoll_fd_submit_read fail");
+    }
+    slot->rbusy = 1;
+    slot->rlen = 0;
+    slot->sgen = slot->gen;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * ep:submit_write(fd, data [, offset])
+ * queue a send of data starting at byte offset. data is pinned, not copied,
+ * until the DONE_WRITE completion. One write in flight per fd.
+ */
+static int lua_f_epoll_submit_write(lua_State *L) {
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
+    int fd = luaL_checkint(L, 2);
+    size_t len = 0;
+    const char *data = luaL_checklstring(L, 3, &len);
+    size_t offset = luaL_optint(L, 4, 0);
+
+    if (fd < 0 || offset > len) {
+        RETERR("invalid args");
+    }
+
+    if (slot_reserve(self, fd) < 0) {
+        RETERR("slot_reserve fail");
+    }
+
+    lua_epoll_slot_t *slot = &self->slots[fd];
+    if (slot->wref != LUA_NOREF) {
+        errno = EBUSY;
+        RETERR("write in flight");
+    }
+
+    if (epoll_fd_submit_write(&self->ep, fd, data + offset, len - offset) < 0) {
+        RETERR("epoll_fd_submit_write fail");
+    }
+    lua_pushvalue(L, 3);
+    slot->wref = luaL_ref(L, LUA_REGISTRYINDEX);
+    slot->sgen = slot->gen;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int lua_f_epoll_submit_accept(lua_State *L) {
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
+    int fd = luaL_checkint(L, 2);
+
+    if (fd < 0) {
+        RETERR("invalid fd");
+    }
+
+    if (slot_reserve(self, fd) < 0) {
+        RETERR("slot_reserve fail");
+    }
+
+    if (epoll_fd_submit_accept(&self->ep, fd) < 0) {
+        RETERR("epoll_fd_submit_accept fail");
+    }
+    self->slots[fd].sgen = self->slots[fd].gen;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * ep:submit_cancel(fd, kind)
+ * cancel the in-flight submission of kind (epoll.DONE_READ/WRITE/ACCEPT),
+ * its completion still arrives, with -ECANCELED unless it won the race.
+ */
+static int lua_f_epoll_submit_cancel(lua_State *L) {
+    epoll_fd_t *self = (epoll_fd_t *)check_epoll_fd(L);
+    int fd = luaL_checkint(L, 2);
+    uint32_t kind = (uint32_t)luaL_checkinteger(L, 3);
+
+    if (epoll_fd_submit_cancel(self, fd, kind) < 0) {
+        RETERR("epoll_fd_submit_cancel fail");
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * ep:take(fd) -> res [, data|err]
+ * the result of the last completion on fd for wait()/wait_into() users,
+ * run() hands the same values to the coroutine directly.
+ */
+static int lua_f_epoll_take(lua_State *L) {
+    lua_epoll_t *self = (lua_epoll_t *)check_epoll_fd(L);
+    int fd = luaL_checkint(L, 2);
+
+    if (fd < 0 || fd >= self->nslots) {
+        RETERR("invalid fd");
+    }
+
+    lua_epoll_slot_t *slot = &self->slots[fd];
+    lua_pushinteger(L, slot->res);
+    if (slot->res < 0) {
+        lua_pushstring(L, strerror(-slot->res));
+        return 2;
+    }
+
+    if (slot->rlen > 0) {
+        lua_pushlstring(L, slot->rbuf, slot->rlen);
+        slot->rlen = 0;
+        slot_rbuf_put(slot);
+        return 2;
+    }
+
+    return 1;
+}
+
 static const struct luaL_Reg lua_f_epoll_func[] = {
     {"close", lua_f_epoll_close}, {"add", lua_f_epoll_add},   {"modify", lua_f_epoll_modify},
-    {"del", lua_f_epoll_del},     {"wait", lua_f_epoll_wait}, {NULL, NULL},
+    {"del", lua_f_epoll_del},     {"wait", lua_f_epoll_wait},
+    {"wait_into", lua_f_epoll_wait_into},
+    {"attach", lua_f_epoll_attach},
+    {"bind", lua_f_epoll_bind},
+    {"unbind", lua_f_epoll_unbind},
+    {"timer", lua_f_epoll_timer},
+    {"cancel", lua_f_epoll_cancel},
+    {"run_once", lua_f_epoll_run_once},
+    {"run", lua_f_epoll_run},
+    {"backend", lua_f_epoll_backend},
+    {"busy_poll", lua_f_epoll_busy_poll},
+    {"stats", lua_f_epoll_stats},
+    {"submit_read", lua_f_epoll_submit_read},
+    {"submit_write", lua_f_epoll_submit_write},
+    {"submit_accept", lua_f_epoll_submit_accept},
+    {"submit_cancel", lua_f_epoll_submit_cancel},
+    {"take", lua_f_epoll_take},
+    {NULL, NULL},
 };
 
+/*
+ * epoll.create([size [, backend]])
+ * backend is "epoll" (default) or "uring", the latter silently falls back to
+ * epoll when io_uring is unusable, see ep:backend().
+ */
 static int lua_f_epoll_create(lua_State *L) {
     size_t size = luaL_optint(L, 1, 0);
-    epoll_fd_t *self = (epoll_fd_t *)lua_newuserdata(L, sizeof(epoll_fd_t));
-    if (epoll_fd_create(self, size) < 0) {
+    const char *name = luaL_optstring(L, 2, "epoll");
+    reactor_backend_t backend = REACTOR_EPOLL;
+    if (strcmp(name, "uring") == 0)
+        backend = REACTOR_URING;
+    else if (strcmp(name, "epoll") != 0)
+        RETERR("invalid backend");
+
+    lua_epoll_t *self = (lua_epoll_t *)lua_newuserdata(L, sizeof(lua_epoll_t));
+    memset(self, 0, sizeof(lua_epoll_t));
+    self->timer_free = -1;
+    if (epoll_fd_create_backend(&self->ep, size, backend) < 0) {
         RETERR("epoll_fd_create fail");
     }
 
@@ -152,9 +964,25 @@ static const struct luaL_Reg lua_f_epoll_mod[] = {
     __index = {
         close = lua_f_epoll_close,
         add = lua_f_epoll_add,
+        attach = lua_f_epoll_attach,
         modify = lua_f_epoll_modify,
         del = lua_f_epoll_del,
         wait = lua_f_epoll_wait,
+        wait_into = lua_f_epoll_wait_into,
+        bind = lua_f_epoll_bind,
+        unbind = lua_f_epoll_unbind,
+        timer = lua_f_epoll_timer,
+        cancel = lua_f_epoll_cancel,
+        run_once = lua_f_epoll_run_once,
+        run = lua_f_epoll_run,
+        backend = lua_f_epoll_backend,
+        busy_poll = lua_f_epoll_busy_poll,
+        stats = lua_f_epoll_stats,
+        submit_read = lua_f_epoll_submit_read,
+        submit_write = lua_f_epoll_submit_write,
+        submit_accept = lua_f_epoll_submit_accept,
+        submit_cancel = lua_f_epoll_submit_cancel,
+        take = lua_f_epoll_take,
     },
   };
 
@@ -174,6 +1002,11 @@ static const struct luaL_Reg lua_f_epoll_mod[] = {
     EPOLLRDHUP = EPOLLRDHUP,
     EPOLLONESHOT = EPOLLONESHOT,
     EPOLLET = EPOLLET,
+    DONE_READ = REACTOR_DONE_READ,
+    DONE_WRITE = REACTOR_DONE_WRITE,
+    DONE_ACCEPT = REACTOR_DONE_ACCEPT,
+    TIMEOUT = 0,
+    PARKED = -1,
   };
 
 */
@@ -208,5 +1041,16 @@ int luaopen_epoll(lua_State *L) {
 
 #undef SETCONST
 
+    lua_pushnumber(L, REACTOR_DONE_READ);
+    lua_setfield(L, -2, "DONE_READ");
+    lua_pushnumber(L, REACTOR_DONE_WRITE);
+    lua_setfield(L, -2, "DONE_WRITE");
+    lua_pushnumber(L, REACTOR_DONE_ACCEPT);
+    lua_setfield(L, -2, "DONE_ACCEPT");
+    lua_pushnumber(L, 0);
+    lua_setfield(L, -2, "TIMEOUT");
+    lua_pushnumber(L, CO_PARKED);
+    lua_setfield(L, -2, "PARKED");
+
     return 1;
 }
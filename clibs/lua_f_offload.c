@@ -0,0 +1,164 @@
+#include "lua_f_util.h"
+#include "offload.h"
+
+#define OFFLOAD_METATABLE_NAME "ywh.OffloadMT"
+
+/*
+ * a completion queue of the offload pool, one per reactor: its fd goes
+ * into the reactor, tasks are submitted through it and their results are
+ * polled from it once the fd turns readable.
+ */
+typedef struct lua_offload {
+    offload_queue_t *q;
+} lua_offload_t;
+
+static lua_offload_t *check_offload(lua_State *L) {
+    lua_offload_t *self = (lua_offload_t *)luaL_checkudata(L, 1, OFFLOAD_METATABLE_NAME);
+    if (self->q == NULL) luaL_error(L, "offload queue closed");
+    return self;
+}
+
+static int lua_f_offload_close(lua_State *L) {
+    lua_offload_t *self = (lua_offload_t *)luaL_checkudata(L, 1, OFFLOAD_METATABLE_NAME);
+    // tasks still running keep the queue alive, their results are dropped
+    offload_queue_release(self->q);
+    self->q = NULL;
+    return 0;
+}
+
+static int lua_f_offload_fd(lua_State *L) {
+    lua_offload_t *self = check_offload(L);
+    lua_pushinteger(L, chan_fd(offload_queue_chan(self->q)));
+    return 1;
+}
+
+/*
+ * q:submit(id, name, ...) -> true
+ * run task name with up to OFFLOAD_ARGS string arguments on the pool, its
+ * result comes back from q:poll() tagged with id.
+ */
+static int lua_f_offload_submit(lua_State *L) {
+    lua_offload_t *self = check_offload(L);
+    int id = luaL_checkint(L, 2);
+    const char *name = luaL_checkstring(L, 3);
+    int nargs = lua_gettop(L) - 3;
+
+    offload_fn_t fn = offload_lookup(name);
+    if (fn == NULL) {
+        errno = ENOENT;
+        RETERR("unknown task");
+    }
+    if (nargs > OFFLOAD_ARGS) {
+        errno = E2BIG;
+        RETERR("too many task arguments");
+    }
+
+    const char *args[OFFLOAD_ARGS];
+    size_t lens[OFFLOAD_ARGS];
+    int i;
+    for (i = 0; i < nargs; i++) args[i] = luaL_checklstring(L, 4 + i, &lens[i]);
+
+    if (offload_submit(self->q, id, fn, nargs, args, lens) < 0) {
+        RETERR("offload_submit fail");
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * q:poll() -> id, result | id, nil, err
+ * the next completion, nothing when there is none: wait for q:fd() then.
+ */
+static int lua_f_offload_poll(lua_State *L) {
+    lua_offload_t *self = check_offload(L);
+
+    chan_msg_t *msg = chan_recv(offload_queue_chan(self->q));
+    if (msg == NULL) return 0;
+
+    lua_pushinteger(L, msg->tag);
+    if (msg->data[0] == OFFLOAD_OK) {
+        lua_pushlstring(L, msg->data + 1, msg->len - 1);
+        chan_msg_free(msg);
+        return 2;
+    }
+
+    lua_pushnil(L);
+    lua_pushlstring(L, msg->data + 1, msg->len - 1);
+    chan_msg_free(msg);
+    return 3;
+}
+
+static const struct luaL_Reg lua_f_offload_func[] = {
+    {"close", lua_f_offload_close},
+    {"fd", lua_f_offload_fd},
+    {"submit", lua_f_offload_submit},
+    {"poll", lua_f_offload_poll},
+    {NULL, NULL},
+};
+
+// offload.queue() -> a completion queue for the calling reactor
+static int lua_f_offload_queue(lua_State *L) {
+    lua_offload_t *self = (lua_offload_t *)lua_newuserdata(L, sizeof(lua_offload_t));
+    self->q = offload_queue_new();
+    if (self->q == NULL) {
+        RETERR("offload_queue_new fail");
+    }
+
+    luaL_getmetatable(L, OFFLOAD_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+// offload.start([n]) -> pool size, n threads (default OFFLOAD_THREADS) unless it runs
+static int lua_f_offload_start(lua_State *L) {
+    int n = luaL_optint(L, 1, 0);
+    if ((n = offload_start(n)) < 0) {
+        RETERR("offload_start fail");
+    }
+
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+static int lua_f_offload_version(lua_State *L) {
+    const char *ver = "Lua-Offload V0.0.1 by wenhaoye@126.com";
+    lua_pushstring(L, ver);
+    return 1;
+}
+
+static const struct luaL_Reg lua_f_offload_mod[] = {
+    {"queue", lua_f_offload_queue},
+    {"start", lua_f_offload_start},
+    {"version", lua_f_offload_version},
+    {NULL, NULL},
+};
+
+/*
+  mt = {
+    __gc = lua_f_offload_close,
+    __index = {
+        close = lua_f_offload_close,
+        fd = lua_f_offload_fd,
+        submit = lua_f_offload_submit,
+        poll = lua_f_offload_poll,
+    },
+  };
+
+  offload = {
+    queue = lua_f_offload_queue,
+    start = lua_f_offload_start,
+    version = lua_f_offload_version,
+  };
+*/
+int luaopen_offload(lua_State *L) {
+    luaL_newmetatable(L, OFFLOAD_METATABLE_NAME);
+    LTABLE_ADD_CFUNC(L, -1, "__gc", lua_f_offload_close);
+    lua_newtable(L);
+    luaL_register(L, NULL, lua_f_offload_func);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_register(L, "offload", lua_f_offload_mod);
+    return 1;
+}
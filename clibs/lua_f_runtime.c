@@ -0,0 +1,283 @@
+#include <pthread.h>
+
+#include "chan.h"
+#include "lua_f_util.h"
+
+/*
+ * thread-per-core runtime: runtime.start() runs a Lua script on n threads,
+ * each in a lua_State of its own. Whatever the script requires (cosock and
+ * its reactor included) is private to that thread, nothing Lua is shared.
+ * Threads talk through one inbox per thread, a chan_t any thread can send
+ * byte strings to. The starting thread is id 0 and has an inbox as well.
+ * Each thread also publishes a load figure the others can read, for
+ * balancing work between them.
+ *
+ * The runtime lives as long as the process, it is started once.
+ */
+typedef struct rt_thread {
+    int id;
+    pthread_t tid;
+    chan_t inbox;
+    uint32_t load;  // set_load() * 1000, written by the thread only
+} rt_thread_t;
+
+typedef struct runtime {
+    int n;                 // spawned threads, ids 1..n
+    rt_thread_t *threads;  // n + 1, index 0 is the starting thread
+    char *script;
+    char *arg;    // passed to every thread after id and n, NULL if none
+    char *path;   // package.path and cpath of the starting state
+    char *cpath;
+} runtime_t;
+
+static runtime_t *rt;
+static __thread int rt_self;  // id of the calling thread
+
+static void *rt_main(void *arg) {
+    rt_thread_t *t = (rt_thread_t *)arg;
+    rt_self = t->id;
+
+    lua_State *L = luaL_newstate();
+    if (L == NULL) {
+        ERR("thread %d: luaL_newstate fail", t->id);
+        return NULL;
+    }
+    luaL_openlibs(L);
+
+    // the same module search path as the starting state
+    lua_getglobal(L, "package");
+    lua_pushstring(L, rt->path);
+    lua_setfield(L, -2, "path");
+    lua_pushstring(L, rt->cpath);
+    lua_setfield(L, -2, "cpath");
+    lua_pop(L, 1);
+
+    if (luaL_loadfile(L, rt->script) == 0) {
+        lua_pushinteger(L, t->id);
+        lua_pushinteger(L, rt->n);
+        if (rt->arg)
+            lua_pushstring(L, rt->arg);
+        else
+            lua_pushnil(L);
+        lua_pcall(L, 3, 0, 0);
+    }
+    if (lua_gettop(L) > 0) fprintf(stderr, "runtime thread %d: %s\n", t->id, lua_tostring(L, -1));
+
+    lua_close(L);
+    return NULL;
+}
+
+static char *pkg_field(lua_State *L, const char *name) {
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, name);
+    const char *s = lua_tostring(L, -1);
+    char *copy = strdup(s ? s : "");
+    lua_pop(L, 2);
+    return copy;
+}
+
+/*
+ * runtime.start(script [, n [, arg]]) -> n
+ * n threads (default: one per online cpu) each run the file script with
+ * (id, n, arg) as arguments, arg an optional string. Only once per
+ * process, from thread 0.
+ */
+static int lua_f_runtime_start(lua_State *L) {
+    const char *script = luaL_checkstring(L, 1);
+    int n = luaL_optint(L, 2, 0);
+    const char *arg = luaL_optstring(L, 3, NULL);
+    if (n <= 0) n = cpu_count();
+
+    if (rt != NULL || rt_self != 0) {
+        errno = EBUSY;
+        RETERR("runtime already started");
+    }
+
+    runtime_t *self = (runtime_t *)MALLOC(sizeof(runtime_t));
+    if (self == NULL) RETERR("out of memory");
+    self->threads = (rt_thread_t *)MALLOC(sizeof(rt_thread_t) * (n + 1));
+    if (self->threads == NULL) {
+        free(self);
+        RETERR("out of memory");
+    }
+
+    int i;
+    for (i = 0; i <= n; i++) {
+        self->threads[i].id = i;
+        if (chan_init(&self->threads[i].inbox) < 0) {
+            while (--i >= 0) chan_term(&self->threads[i].inbox);
+            free(self->threads);
+            free(self);
+            RETERR("chan_init fail");
+        }
+    }
+    self->n = n;
+    self->script = strdup(script);
+    self->arg = arg ? strdup(arg) : NULL;
+    self->path = pkg_field(L, "path");
+    self->cpath = pkg_field(L, "cpath");
+
+    // published before the first thread exists, never changes afterwards
+    rt = self;
+    for (i = 1; i <= n; i++) {
+        int rc = pthread_create(&self->threads[i].tid, NULL, rt_main, &self->threads[i]);
+        if (rc != 0) {
+            errno = rc;
+            ERR("pthread_create %d fail", i);
+            // the threads that run keep the runtime, the rest is never heard of
+            self->n = i - 1;
+            break;
+        }
+    }
+
+    lua_pushinteger(L, self->n);
+    return 1;
+}
+
+// runtime.join(): wait for every spawned thread to return, thread 0 only
+static int lua_f_runtime_join(lua_State *L) {
+    if (rt == NULL) RETERR("runtime not started");
+    if (rt_self != 0) RETERR("join from a runtime thread");
+
+    int i;
+    for (i = 1; i <= rt->n; i++) pthread_join(rt->threads[i].tid, NULL);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// runtime.id() -> id of the calling thread, 0 outside the spawned ones
+static int lua_f_runtime_id(lua_State *L) {
+    lua_pushinteger(L, rt_self);
+    return 1;
+}
+
+// runtime.count() -> n of start(), 0 before it
+static int lua_f_runtime_count(lua_State *L) {
+    lua_pushinteger(L, rt ? rt->n : 0);
+    return 1;
+}
+
+/*
+ * runtime.send(id, data [, tag]) -> true
+ * queue a copy of the string data in the inbox of thread id (0..n). tag, an
+ * integer (default 0), travels along to tell kinds of messages apart.
+ */
+static int lua_f_runtime_send(lua_State *L) {
+    int id = luaL_checkint(L, 1);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+    int tag = luaL_optint(L, 3, 0);
+
+    if (rt == NULL) RETERR("runtime not started");
+    if (id < 0 || id > rt->n) {
+        errno = EINVAL;
+        RETERR("invalid thread id");
+    }
+
+    if (chan_send(&rt->threads[id].inbox, tag, data, len) < 0) RETERR("chan_send fail");
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * runtime.recv() -> data, tag
+ * the next message to the calling thread, nil when there is none: wait for
+ * runtime.fd() to become readable then.
+ */
+static int lua_f_runtime_recv(lua_State *L) {
+    if (rt == NULL) RETERR("runtime not started");
+
+    chan_msg_t *msg = chan_recv(&rt->threads[rt_self].inbox);
+    if (msg == NULL) return 0;
+
+    lua_pushlstring(L, msg->data, msg->len);
+    lua_pushinteger(L, msg->tag);
+    chan_msg_free(msg);
+    return 2;
+}
+
+// runtime.set_load(x): publish the calling thread's load, x >= 0
+static int lua_f_runtime_set_load(lua_State *L) {
+    lua_Number x = luaL_checknumber(L, 1);
+    if (rt == NULL) RETERR("runtime not started");
+
+    uint32_t load = x > 0 ? (x < 4e6 ? (uint32_t)(x * 1000) : 4000000000u) : 0;
+    __atomic_store_n(&rt->threads[rt_self].load, load, __ATOMIC_RELAXED);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// runtime.loads() -> {[0] = load of thread 0, load of thread 1, ...}
+static int lua_f_runtime_loads(lua_State *L) {
+    if (rt == NULL) RETERR("runtime not started");
+
+    int i;
+    lua_createtable(L, rt->n, 1);
+    for (i = 0; i <= rt->n; i++) {
+        lua_pushnumber(L, __atomic_load_n(&rt->threads[i].load, __ATOMIC_RELAXED) / 1000.0);
+        lua_rawseti(L, -2, i);
+    }
+    return 1;
+}
+
+// runtime.fd() -> the eventfd of the calling thread's inbox, to register in its reactor
+static int lua_f_runtime_fd(lua_State *L) {
+    if (rt == NULL) RETERR("runtime not started");
+
+    lua_pushinteger(L, chan_fd(&rt->threads[rt_self].inbox));
+    return 1;
+}
+
+// runtime.stats() -> {sent, received, wakeups} of the calling thread's inbox
+static int lua_f_runtime_stats(lua_State *L) {
+    if (rt == NULL) RETERR("runtime not started");
+
+    chan_stats_t st;
+    chan_stats(&rt->threads[rt_self].inbox, &st);
+    lua_createtable(L, 0, 3);
+    LTABLE_SET_NUMBER(L, "sent", st.sent);
+    LTABLE_SET_NUMBER(L, "received", st.received);
+    LTABLE_SET_NUMBER(L, "wakeups", st.wakeups);
+    return 1;
+}
+
+static int lua_f_runtime_version(lua_State *L) {
+    const char *ver = "Lua-Runtime V0.0.1 by wenhaoye@126.com";
+    lua_pushstring(L, ver);
+    return 1;
+}
+
+static const struct luaL_Reg lua_f_runtime_mod[] = {
+    {"start", lua_f_runtime_start},
+    {"join", lua_f_runtime_join},
+    {"id", lua_f_runtime_id},
+    {"count", lua_f_runtime_count},
+    {"send", lua_f_runtime_send},
+    {"recv", lua_f_runtime_recv},
+    {"set_load", lua_f_runtime_set_load},
+    {"loads", lua_f_runtime_loads},
+    {"fd", lua_f_runtime_fd},
+    {"stats", lua_f_runtime_stats},
+    {"version", lua_f_runtime_version},
+    {NULL, NULL},
+};
+
+/*
+  runtime = {
+    start = lua_f_runtime_start,
+    join = lua_f_runtime_join,
+    id = lua_f_runtime_id,
+    count = lua_f_runtime_count,
+    send = lua_f_runtime_send,
+    recv = lua_f_runtime_recv,
+    set_load = lua_f_runtime_set_load,
+    loads = lua_f_runtime_loads,
+    fd = lua_f_runtime_fd,
+    stats = lua_f_runtime_stats,
+    version = lua_f_runtime_version,
+  };
+*/
+int luaopen_runtime(lua_State *L) {
+    luaL_register(L, "runtime", lua_f_runtime_mod);
+    return 1;
+}
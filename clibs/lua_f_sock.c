@@ -1,13 +1,65 @@
+#include <signal.h>
+
 #include "lua_f_util.h"
+#include "pool.h"
 #include "sock.h"
 
 #define SOCK_METATABLE_NAME "ywh.SockMT"
+#define PIPE_METATABLE_NAME "ywh.PipeMT"
+
+#define SOCK_FRAME_MAX (1024 * 1024)  // default bound for delimited frames
+#define SOCK_IOV_MAX 64                // strings per writev, the rest goes next call
+#define SOCK_ACCEPT_BATCH 64           // max connections per accept_batch()
+
+/*
+ * a Lua sock is only a handle, the sock_t itself lives in the fd-indexed
+ * slab (see sock.h). A handle outliving its socket resolves to a closed
+ * dummy, so every method fails the way it does on a closed socket.
+ */
+typedef struct lua_sock {
+    int fd;
+    uint32_t gen;
+} lua_sock_t;
+
+#define check_sock(L) to_sock(L, 1)
+#define check_pipe(L) (sock_pipe_t *)luaL_checkudata(L, 1, PIPE_METATABLE_NAME)
+
+static sock_t *to_sock(lua_State *L, int idx) {
+    // one per thread, the runtime runs several Lua states at once
+    static __thread sock_t closed = {.fd = -1};
+
+    lua_sock_t *h = (lua_sock_t *)luaL_checkudata(L, idx, SOCK_METATABLE_NAME);
+    sock_t *self = sock_slab_get(h->fd, h->gen);
+    if (self) return self;
+
+    // whatever a previous call left on the dummy goes away
+    sock_term(&closed);
+    return &closed;
+}
+
+// move sk into the slab and push its handle, nil, err on failure
+static int push_sock(lua_State *L, sock_t *sk) {
+    uint32_t gen = 0;
+    int fd = sk->fd;
+
+    if (sock_slab_add(sk, &gen) == NULL) {
+        sock_term(sk);
+        RETERR("sock_slab_add fail");
+    }
 
-#define check_sock(L) (sock_t *)luaL_checkudata(L, 1, SOCK_METATABLE_NAME)
+    lua_sock_t *h = (lua_sock_t *)lua_newuserdata(L, sizeof(lua_sock_t));
+    h->fd = fd;
+    h->gen = gen;
+
+    luaL_getmetatable(L, SOCK_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    return 1;
+}
 
 static int lua_f_sock_close(lua_State *L) {
-    sock_t *self = check_sock(L);
-    sock_term(self);
+    lua_sock_t *h = (lua_sock_t *)luaL_checkudata(L, 1, SOCK_METATABLE_NAME);
+    sock_t *self = sock_slab_get(h->fd, h->gen);
+    if (self) sock_slab_release(self);
     return 0;
 }
 
@@ -31,6 +83,10 @@ static int lua_f_sock_accept(lua_State *L) {
     sock_t *self = check_sock(L);
     sock_t cli;
 
+    if (sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
     int ret = sock_accept(self, &cli);
     if (ret == -EAGAIN) {
         lua_pushnil(L);
@@ -40,14 +96,47 @@ static int lua_f_sock_accept(lua_State *L) {
         RETERR("sock_accept fail");
     }
 
-    sock_t *udata = lua_newuserdata(L, sizeof(sock_t));
-    sock_lcopy(&cli, udata);
+    return push_sock(L, &cli);
+}
+
+/*
+ * sk:accept_batch([max])
+ * drain up to max (default SOCK_ACCEPT_BATCH) pending connections in one
+ * call, returns an array of socks, empty when the backlog is empty.
+ */
+static int lua_f_sock_accept_batch(lua_State *L) {
+    sock_t *self = check_sock(L);
+    int max = luaL_optint(L, 2, SOCK_ACCEPT_BATCH);
+    sock_t clis[SOCK_ACCEPT_BATCH];
+    if (max <= 0 || max > SOCK_ACCEPT_BATCH) max = SOCK_ACCEPT_BATCH;
+
+    if (sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
+    int n = sock_accept_batch(self, clis, max);
+    if (n < 0) {
+        RETERR("sock_accept_batch fail");
+    }
+
+    int i, j = 0;
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+        if (push_sock(L, &clis[i]) != 1) {
+            lua_pop(L, 2);  // nil, err
+            continue;
+        }
+        lua_rawseti(L, -2, ++j);
+    }
 
-    luaL_getmetatable(L, SOCK_METATABLE_NAME);
-    lua_setmetatable(L, -2);
     return 1;
 }
 
+/*
+ * sk:write(data [, offset])
+ * offset: bytes of data already sent, a partial write resumes from there
+ * without cutting a substring.
+ */
 static int lua_f_sock_write(lua_State *L) {
     if (lua_gettop(L) < 2) {
         RETERR("invalid args");
@@ -56,17 +145,18 @@ static int lua_f_sock_write(lua_State *L) {
     sock_t *self = check_sock(L);
     size_t len = 0;
     const char *data = luaL_checklstring(L, 2, &len);
+    size_t offset = luaL_optinteger(L, 3, 0);
 
     if (sock_is_closed(self)) {
         RETERR("socket has closed");
     }
 
-    if (0 == len) {
+    if (offset >= len) {
         lua_pushinteger(L, 0);
         return 1;
     }
 
-    int ret = sock_write(self, (void *)data, len);
+    int ret = sock_write(self, (void *)(data + offset), len - offset);
     if (ret < 0) {
         RETERR("sock_send fail");
     }
@@ -75,6 +165,59 @@ static int lua_f_sock_write(lua_State *L) {
     return 1;
 }
 
+/*
+ * sk:writev({s1, s2, ...} [, offset])
+ * send the strings as one stream with a single writev, offset counts bytes
+ * of that stream already sent. Returns bytes written, 0 when the socket
+ * buffer is full.
+ */
+static int lua_f_sock_writev(lua_State *L) {
+    sock_t *self = check_sock(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    size_t offset = luaL_optinteger(L, 3, 0);
+
+    if (sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
+    struct iovec iov[SOCK_IOV_MAX];
+    int cnt = 0;
+    int i, n = lua_objlen(L, 2);
+
+    for (i = 1; i <= n && cnt < SOCK_IOV_MAX; i++) {
+        size_t len = 0;
+        lua_rawgeti(L, 2, i);
+        const char *data = lua_tolstring(L, -1, &len);
+        lua_pop(L, 1);  // still referenced by the table
+        if (data == NULL) {
+            RETERR("writev: not a string");
+        }
+
+        if (offset >= len) {
+            offset -= len;
+            continue;
+        }
+
+        iov[cnt].iov_base = (void *)(data + offset);
+        iov[cnt].iov_len = len - offset;
+        offset = 0;
+        cnt++;
+    }
+
+    if (cnt == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    int ret = sock_writev(self, iov, cnt);
+    if (ret < 0) {
+        RETERR("sock_writev fail");
+    }
+
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
 static int lua_f_sock_read(lua_State *L) {
     if (lua_gettop(L) < 1) {
         RETERR("invalid args");
@@ -85,6 +228,15 @@ static int lua_f_sock_read(lua_State *L) {
         RETERR("socket has closed");
     }
 
+    // bytes already taken by a framed read come first
+    if (self->rbuf && rbuf_len(self->rbuf) > 0) {
+        size_t len = rbuf_len(self->rbuf);
+        lua_pushinteger(L, len);
+        lua_pushlstring(L, rbuf_peek(self->rbuf), len);
+        rbuf_consume(self->rbuf, len);
+        return 2;
+    }
+
     char buf[4096];
     int ret = sock_read(self, buf, sizeof(buf));
     if (ret < 0 && ret != -EAGAIN) {
@@ -104,32 +256,711 @@ static int lua_f_sock_read(lua_State *L) {
     return 2;
 }
 
+/*
+ * framed reads over the socket's receive buffer. Each of them returns
+ *   data       a complete frame, exactly one string
+ *   nil        not enough data yet, wait for EPOLLIN and call again
+ *   nil, err   "EOF" or a read error
+ */
+static rbuf_t *sock_rbuf(sock_t *self) {
+    if (self->rbuf == NULL) self->rbuf = (rbuf_t *)MALLOC(sizeof(rbuf_t));
+    return self->rbuf;
+}
+
+#define check_rbuf_sock(L, self)                                 \
+    do {                                                         \
+        if (sock_is_closed(self)) RETERR("socket has closed");   \
+        if (sock_rbuf(self) == NULL) RETERR("rbuf alloc fail");  \
+    } while (0)
+
+/*
+ * pull more bytes in, 0 if some arrived and the caller should look again,
+ * otherwise the number of results pushed for it to return.
+ */
+static int sock_rbuf_more(lua_State *L, sock_t *self, size_t want) {
+    ssize_t ret = sock_fill(self, want);
+    if (ret > 0) return 0;
+
+    lua_pushnil(L);
+    if (ret == -EAGAIN) return 1;
+
+    if (ret == 0)
+        lua_pushliteral(L, "EOF");
+    else
+        lua_pushfstring(L, "%s: sock_read fail", strerror(errno));
+    return 2;
+}
+
+/*
+ * sk:readn(n [, max])
+ * exactly n bytes, nil, "frame too long" when n is over max (default
+ * SOCK_FRAME_MAX): n usually comes off the wire, nothing is buffered then.
+ */
+static int lua_f_sock_readn(lua_State *L) {
+    sock_t *self = check_sock(L);
+    int n = luaL_checkint(L, 2);
+    size_t max = luaL_optinteger(L, 3, SOCK_FRAME_MAX);
+    if (n < 0) {
+        RETERR("invalid size");
+    }
+    if ((size_t)n > max) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "frame too long");
+        return 2;
+    }
+    check_rbuf_sock(L, self);
+
+    int nret;
+    while (rbuf_len(self->rbuf) < (size_t)n) {
+        if ((nret = sock_rbuf_more(L, self, n)) > 0) return nret;
+    }
+
+    lua_pushlstring(L, rbuf_peek(self->rbuf), n);
+    rbuf_consume(self->rbuf, n);
+    return 1;
+}
+
+static int sock_read_delim(lua_State *L, sock_t *self, const char *delim, size_t dlen, size_t max, int chomp) {
+    ssize_t pos;
+    int nret;
+
+    while ((pos = rbuf_find(self->rbuf, delim, dlen)) < 0) {
+        if (rbuf_len(self->rbuf) >= max) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "frame too long");
+            return 2;
+        }
+        if ((nret = sock_rbuf_more(L, self, 0)) > 0) return nret;
+    }
+
+    size_t len = pos;
+    const char *data = rbuf_peek(self->rbuf);
+    if (chomp && len > 0 && data[len - 1] == '\r') len--;
+
+    lua_pushlstring(L, data, len);
+    rbuf_consume(self->rbuf, pos + dlen);
+    return 1;
+}
+
+/*
+ * sk:readline([max])
+ * a line without its "\n" or "\r\n", nil, "frame too long" once max bytes
+ * (default SOCK_FRAME_MAX) are buffered without a line end.
+ */
+static int lua_f_sock_readline(lua_State *L) {
+    sock_t *self = check_sock(L);
+    size_t max = luaL_optinteger(L, 2, SOCK_FRAME_MAX);
+    check_rbuf_sock(L, self);
+
+    return sock_read_delim(L, self, "\n", 1, max, 1);
+}
+
+// sk:read_until(delim [, max]), the frame before delim, delim is dropped
+static int lua_f_sock_read_until(lua_State *L) {
+    sock_t *self = check_sock(L);
+    size_t dlen = 0;
+    const char *delim = luaL_checklstring(L, 2, &dlen);
+    size_t max = luaL_optinteger(L, 3, SOCK_FRAME_MAX);
+    if (dlen == 0) {
+        RETERR("empty delimiter");
+    }
+    check_rbuf_sock(L, self);
+
+    return sock_read_delim(L, self, delim, dlen, max, 0);
+}
+
+/*
+ * sk:peek(n [, max])
+ * up to n buffered bytes without consuming them, e.g. to look at a length
+ * prefix. Reads more first when fewer than n are buffered. nil, "frame too
+ * long" when n is over max (default SOCK_FRAME_MAX), like readn().
+ */
+static int lua_f_sock_peek(lua_State *L) {
+    sock_t *self = check_sock(L);
+    int n = luaL_checkint(L, 2);
+    size_t max = luaL_optinteger(L, 3, SOCK_FRAME_MAX);
+    if (n < 0) {
+        RETERR("invalid size");
+    }
+    if ((size_t)n > max) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "frame too long");
+        return 2;
+    }
+    check_rbuf_sock(L, self);
+
+    if (rbuf_len(self->rbuf) < (size_t)n) {
+        int nret = sock_rbuf_more(L, self, n);
+        if (nret > 0 && rbuf_len(self->rbuf) == 0) return nret;
+        lua_settop(L, 2);
+    }
+
+    size_t len = rbuf_len(self->rbuf);
+    if (len > (size_t)n) len = n;
+    lua_pushlstring(L, rbuf_peek(self->rbuf), len);
+    return 1;
+}
+
+// sk:consume(n), drop up to n buffered bytes, returns how many were dropped
+static int lua_f_sock_consume(lua_State *L) {
+    sock_t *self = check_sock(L);
+    int n = luaL_checkint(L, 2);
+    size_t len = self->rbuf ? rbuf_len(self->rbuf) : 0;
+    if (n < 0) n = 0;
+    if ((size_t)n > len) n = len;
+
+    if (n > 0) rbuf_consume(self->rbuf, n);
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+static int lua_f_sock_buffered(lua_State *L) {
+    sock_t *self = check_sock(L);
+    lua_pushinteger(L, self->rbuf ? rbuf_len(self->rbuf) : 0);
+    return 1;
+}
+
+/*
+ * sk:sendfile(path_or_fd, offset [, len])
+ * send len bytes (default: up to the end of the file) of a file from offset
+ * without them ever leaving the kernel. Returns bytes sent, 0 when the
+ * socket buffer is full, nil, "EOF" when the file ends before the range.
+ * A path is opened and closed within the call, resuming senders should
+ * sys.open() the file once and pass the fd.
+ */
+static int lua_f_sock_sendfile(lua_State *L) {
+    sock_t *self = check_sock(L);
+    off_t offset = luaL_optinteger(L, 3, 0);
+    int fd = -1;
+    int own = 0;
+
+    if (sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        fd = open(lua_tostring(L, 2), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            RETERR("open fail");
+        }
+        own = 1;
+    } else {
+        fd = luaL_checkint(L, 2);
+    }
+
+    size_t count;
+    if (lua_isnoneornil(L, 4)) {
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            if (own) close(fd);
+            RETERR("fstat fail");
+        }
+        count = st.st_size > offset ? st.st_size - offset : 0;
+    } else {
+        count = luaL_checkinteger(L, 4);
+    }
+
+    errno = 0;
+    int ret = count ? sock_sendfile(self, fd, &offset, count) : 0;
+    int err = errno;
+    if (own) close(fd);
+
+    if (ret < 0) {
+        errno = err;
+        RETERR("sock_sendfile fail");
+    }
+
+    // sendfile() of a non-empty range only returns 0 past the end of file
+    if (ret == 0 && count && err != EAGAIN && err != EWOULDBLOCK) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "EOF");
+        return 2;
+    }
+
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+/*
+ * sk:recv_batch([n]) -> datas, peers
+ * up to n (default and max SOCK_MMSG_MAX) datagrams with one recvmmsg, as
+ * two arrays: payloads and their "ip:port" sources. Both are empty when
+ * nothing is pending. With sk:set_gro(true) every receive may hold many
+ * datagrams, they are split in C so the arrays can be longer than n.
+ */
+static int lua_f_sock_recv_batch(lua_State *L) {
+    sock_t *self = check_sock(L);
+    int n = luaL_optint(L, 2, SOCK_MMSG_MAX);
+    if (n <= 0 || n > SOCK_MMSG_MAX) n = SOCK_MMSG_MAX;
+
+    if (sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
+    int ret = sock_recv_batch(self, n);
+    if (ret < 0) {
+        RETERR("sock_recv_batch fail");
+    }
+
+    char peer[INET6_ADDRSTRLEN + 16];
+    int i, k = 0;
+
+    lua_createtable(L, ret, 0);
+    lua_createtable(L, ret, 0);
+    for (i = 0; i < ret; i++) {
+        size_t len = 0, off = 0;
+        const char *data = sock_mmsg_data(self, i, &len);
+        size_t seg = sock_mmsg_segsize(self, i);
+        if (seg == 0) seg = len;
+
+        size_t plen = sock_mmsg_peer(self, i, peer, sizeof(peer));
+
+        // a coalesced (UDP_GRO) receive goes back out as its datagrams
+        do {
+            size_t n = len - off > seg ? seg : len - off;
+            lua_pushlstring(L, data + off, n);
+            lua_rawseti(L, -3, ++k);
+            lua_pushlstring(L, peer, plen);
+            lua_rawseti(L, -2, k);
+            off += n;
+        } while (off < len);
+    }
+
+    return 2;
+}
+
+/*
+ * sk:send_batch(datas [, peers [, first]])
+ * send datas[first..] (first defaults to 1) with one sendmmsg, each to
+ * peers[i] as "ip:port", or to the connected peer when peers is nil.
+ * At most SOCK_MMSG_MAX go per call. Returns how many were sent, 0 when
+ * the socket buffer is full.
+ */
+static int lua_f_sock_send_batch(lua_State *L) {
+    sock_t *self = check_sock(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int has_peers = lua_istable(L, 3);
+    int first = luaL_optint(L, 4, 1);
+
+    if (sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
+    int total = lua_objlen(L, 2);
+    int n = 0;
+    for (; first + n <= total && n < SOCK_MMSG_MAX; n++) {
+        size_t len = 0;
+        const char *peer = NULL;
+
+        // both strings stay referenced by their tables
+        lua_rawgeti(L, 2, first + n);
+        const char *data = lua_tolstring(L, -1, &len);
+        lua_pop(L, 1);
+        if (data == NULL) {
+            RETERR("send_batch: not a string");
+        }
+
+        if (has_peers) {
+            lua_rawgeti(L, 3, first + n);
+            peer = lua_tostring(L, -1);
+            lua_pop(L, 1);
+            if (peer == NULL) {
+                errno = EINVAL;
+                RETERR("send_batch: peer missing");
+            }
+        }
+
+        if (sock_mmsg_set(self, n, data, len, peer) < 0) {
+            RETERR("send_batch: bad peer");
+        }
+    }
+
+    int ret = sock_send_batch(self, n);
+    if (ret < 0) {
+        RETERR("sock_send_batch fail");
+    }
+
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+// sk:set_gro(on), accept UDP_GRO coalesced receives in recv_batch()
+static int lua_f_sock_set_gro(lua_State *L) {
+    sock_t *self = check_sock(L);
+    int on = lua_isnone(L, 2) ? 1 : lua_toboolean(L, 2);
+
+    if (sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
+    if (sock_set_gro(self, on) < 0) {
+        RETERR("sock_set_gro fail");
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// sk:set_busy_poll(us [, prefer]), see sock_set_busy_poll()
+static int lua_f_sock_set_busy_poll(lua_State *L) {
+    sock_t *self = check_sock(L);
+    int us = luaL_checkint(L, 2);
+    int prefer = lua_toboolean(L, 3);
+
+    if (sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
+    if (us < 0 || sock_set_busy_poll(self, us, prefer) < 0) {
+        RETERR("sock_set_busy_poll fail");
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// sk:steer_by_cpu(n), on one listener of a SO_REUSEPORT group, see sock_steer_by_cpu()
+static int lua_f_sock_steer_by_cpu(lua_State *L) {
+    sock_t *self = check_sock(L);
+    int n = luaL_checkint(L, 2);
+
+    if (sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
+    if (sock_steer_by_cpu(self, n) < 0) {
+        RETERR("sock_steer_by_cpu fail");
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// sk:set_incoming_cpu(cpu), the cpu a listener prefers connections of
+static int lua_f_sock_set_incoming_cpu(lua_State *L) {
+    sock_t *self = check_sock(L);
+    int cpu = luaL_checkint(L, 2);
+
+    if (sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
+    if (sock_set_incoming_cpu(self, cpu) < 0) {
+        RETERR("sock_set_incoming_cpu fail");
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// sk:incoming_cpu() -> the cpu the packets of a connection are received on
+static int lua_f_sock_incoming_cpu(lua_State *L) {
+    sock_t *self = check_sock(L);
+    int cpu = sock_incoming_cpu(self);
+    if (cpu < 0) {
+        RETERR("sock_incoming_cpu fail");
+    }
+
+    lua_pushinteger(L, cpu);
+    return 1;
+}
+
+/*
+ * sk:send_gso(data, seg [, peer [, offset]])
+ * send data from offset as seg byte datagrams (the last may be shorter),
+ * the kernel cuts them up with UDP_SEGMENT, one syscall per 64 of them.
+ * Returns bytes sent, 0 when the socket buffer is full.
+ */
+static int lua_f_sock_send_gso(lua_State *L) {
+    sock_t *self = check_sock(L);
+    size_t len = 0;
+    const char *data = luaL_checklstring(L, 2, &len);
+    int seg = luaL_checkint(L, 3);
+    const char *peer = luaL_optstring(L, 4, NULL);
+    size_t offset = luaL_optinteger(L, 5, 0);
+
+    if (sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
+    if (seg <= 0 || seg > 0xffff) {
+        errno = EINVAL;
+        RETERR("invalid segment size");
+    }
+
+    if (offset >= len) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    int ret = sock_send_gso(self, data + offset, len - offset, seg, peer);
+    if (ret < 0) {
+        RETERR("sock_send_gso fail");
+    }
+
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+// sk:shutdown(["r"|"w"|"rw"]), the write side by default (half-close)
+static int lua_f_sock_shutdown(lua_State *L) {
+    sock_t *self = check_sock(L);
+    const char *how = luaL_optstring(L, 2, "w");
+    int flag = SHUT_WR;
+
+    if (strcmp(how, "r") == 0)
+        flag = SHUT_RD;
+    else if (strcmp(how, "rw") == 0)
+        flag = SHUT_RDWR;
+
+    if (sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
+    if (shutdown(sock_fd(self), flag) < 0 && errno != ENOTCONN) {
+        RETERR("shutdown fail");
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 static int lua_f_sock_is_closed(lua_State *L) {
     sock_t *self = check_sock(L);
     lua_pushboolean(L, sock_is_closed(self));
     return 1;
 }
 
+static void push_stats(lua_State *L, sock_stats_t *stats, int totals) {
+    lua_createtable(L, 0, 6);
+    LTABLE_SET_NUMBER(L, "rx_bytes", stats->rx_bytes);
+    LTABLE_SET_NUMBER(L, "tx_bytes", stats->tx_bytes);
+    LTABLE_SET_NUMBER(L, "rx_eagain", stats->rx_eagain);
+    LTABLE_SET_NUMBER(L, "tx_eagain", stats->tx_eagain);
+    LTABLE_SET_NUMBER(L, "accepted", stats->accepted);
+    if (totals) {
+        LTABLE_SET_NUMBER(L, "closed", stats->closed);
+    }
+}
+
+/*
+ * sk:stats()
+ * this socket's counters: rx_bytes, tx_bytes, rx_eagain, tx_eagain and, for
+ * a listening socket, accepted
+ */
+static int lua_f_sock_stats(lua_State *L) {
+    sock_t *self = check_sock(L);
+    push_stats(L, &self->stats, 0);
+    return 1;
+}
+
+/*
+ * sk:peer()
+ * "ip:port", "[ip6]:port" or the unix path of the other end, looked up
+ * from the kernel on every call.
+ */
+static int lua_f_sock_peer(lua_State *L) {
+    sock_t *self = check_sock(L);
+    char buf[128];
+
+    if (sock_peer(self, buf, sizeof(buf)) < 0) {
+        RETERR("sock_peer fail");
+    }
+
+    lua_pushstring(L, buf);
+    return 1;
+}
+
+/*
+ * sk:detach() -> fd, pending
+ * let go of the connection without closing it: the handle turns stale and
+ * the fd plus the bytes a framed read had buffered are returned, for
+ * sock.from_fd(fd, pending) on another thread.
+ */
+static int lua_f_sock_detach(lua_State *L) {
+    lua_sock_t *h = (lua_sock_t *)luaL_checkudata(L, 1, SOCK_METATABLE_NAME);
+    sock_t *self = sock_slab_get(h->fd, h->gen);
+    if (self == NULL || sock_is_closed(self)) {
+        RETERR("socket has closed");
+    }
+
+    if (self->rbuf && rbuf_len(self->rbuf) > 0)
+        lua_pushlstring(L, rbuf_peek(self->rbuf), rbuf_len(self->rbuf));
+    else
+        lua_pushliteral(L, "");
+
+    lua_pushinteger(L, sock_slab_detach(self));
+    lua_insert(L, -2);
+    return 2;
+}
+
 static const struct luaL_Reg lua_f_sock_func[] = {
     {"close", lua_f_sock_close},
     {"fd", lua_f_sock_fd},
     {"set_nonblock", lua_f_sock_set_nonblock},
     {"accept", lua_f_sock_accept},
+    {"accept_batch", lua_f_sock_accept_batch},
     {"write", lua_f_sock_write},
+    {"writev", lua_f_sock_writev},
     {"read", lua_f_sock_read},
+    {"readn", lua_f_sock_readn},
+    {"readline", lua_f_sock_readline},
+    {"read_until", lua_f_sock_read_until},
+    {"peek", lua_f_sock_peek},
+    {"consume", lua_f_sock_consume},
+    {"buffered", lua_f_sock_buffered},
+    {"sendfile", lua_f_sock_sendfile},
+    {"recv_batch", lua_f_sock_recv_batch},
+    {"send_batch", lua_f_sock_send_batch},
+    {"set_gro", lua_f_sock_set_gro},
+    {"set_busy_poll", lua_f_sock_set_busy_poll},
+    {"steer_by_cpu", lua_f_sock_steer_by_cpu},
+    {"set_incoming_cpu", lua_f_sock_set_incoming_cpu},
+    {"incoming_cpu", lua_f_sock_incoming_cpu},
+    {"send_gso", lua_f_sock_send_gso},
+    {"shutdown", lua_f_sock_shutdown},
     {"is_closed", lua_f_sock_is_closed},
+    {"stats", lua_f_sock_stats},
+    {"peer", lua_f_sock_peer},
+    {"detach", lua_f_sock_detach},
+    {NULL, NULL},
+};
+
+static int lua_f_pipe_close(lua_State *L) {
+    sock_pipe_t *self = check_pipe(L);
+    sock_pipe_term(self);
+    return 0;
+}
+
+/*
+ * p:pump(src, dst) -> moved, state
+ * splice what src has through the pipe into dst, state holds the
+ * sock.PUMP_* bits (see sock_pump). nil, err on failure.
+ */
+static int lua_f_pipe_pump(lua_State *L) {
+    sock_pipe_t *self = check_pipe(L);
+    sock_t *src = to_sock(L, 2);
+    sock_t *dst = to_sock(L, 3);
+    int state = 0;
+
+    if (self->fds[0] < 0 || sock_is_closed(src) || sock_is_closed(dst)) {
+        RETERR("pump on a closed fd");
+    }
+
+    int ret = sock_pump(self, src, dst, &state);
+    if (ret < 0) {
+        RETERR("sock_pump fail");
+    }
+
+    lua_pushinteger(L, ret);
+    lua_pushinteger(L, state);
+    return 2;
+}
+
+static int lua_f_pipe_pending(lua_State *L) {
+    sock_pipe_t *self = check_pipe(L);
+    lua_pushinteger(L, self->pending);
+    return 1;
+}
+
+static const struct luaL_Reg lua_f_pipe_func[] = {
+    {"close", lua_f_pipe_close},
+    {"pump", lua_f_pipe_pump},
+    {"pending", lua_f_pipe_pending},
     {NULL, NULL},
 };
 
+// sock.pipe(), one relay direction, see p:pump()
+static int lua_f_sock_pipe(lua_State *L) {
+    sock_pipe_t *self = lua_newuserdata(L, sizeof(sock_pipe_t));
+    if (sock_pipe_init(self) < 0) {
+        RETERR("sock_pipe_init fail");
+    }
+
+    luaL_getmetatable(L, PIPE_METATABLE_NAME);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
 static int lua_f_sock_create(lua_State *L) {
     const char *info = luaL_checkstring(L, 1);
-    sock_t *self = lua_newuserdata(L, sizeof(sock_t));
-    if (sock_init(self, info) < 0) {
+    sock_t sk;
+    if (sock_init(&sk, info) < 0) {
         RETERR("sock_init fail");
     }
 
-    luaL_getmetatable(L, SOCK_METATABLE_NAME);
-    lua_setmetatable(L, -2);
+    return push_sock(L, &sk);
+}
+
+/*
+ * sock.from_fd(fd [, pending])
+ * adopt a connected tcp fd, e.g. the result of an io_uring accept or of
+ * sk:detach() elsewhere. pending: bytes the next reads return first.
+ */
+static int lua_f_sock_from_fd(lua_State *L) {
+    int fd = luaL_checkint(L, 1);
+    size_t len = 0;
+    const char *pending = luaL_optlstring(L, 2, NULL, &len);
+    if (fd < 0) {
+        RETERR("invalid fd");
+    }
+
+    sock_t sk;
+    if (sock_from_fd(&sk, fd) < 0) {
+        close(fd);
+        RETERR("sock_from_fd fail");
+    }
+
+    if (len > 0 && (sock_rbuf(&sk) == NULL || rbuf_append(sk.rbuf, pending, len) < 0)) {
+        sock_term(&sk);
+        RETERR("rbuf alloc fail");
+    }
+
+    return push_sock(L, &sk);
+}
+
+/*
+ * sock.from_listen_fd(fd)
+ * adopt a listening tcp fd, e.g. one of the group a master bound before
+ * forking its workers.
+ */
+static int lua_f_sock_from_listen_fd(lua_State *L) {
+    int fd = luaL_checkint(L, 1);
+
+    sock_t sk;
+    if (sock_from_listen_fd(&sk, fd) < 0) {
+        RETERR("sock_from_listen_fd fail");
+    }
+
+    return push_sock(L, &sk);
+}
+
+/*
+ * sock.stats([reset])
+ * the counters of sk:stats() summed over every socket of this thread, closed
+ * ones included, plus closed connections. reset clears them afterwards.
+ */
+static int lua_f_sock_totals(lua_State *L) {
+    push_stats(L, &sock_totals, 1);
+    if (lua_toboolean(L, 1)) memset(&sock_totals, 0, sizeof(sock_totals));
+    return 1;
+}
+
+/*
+ * sock.pool_stats([trim])
+ * the buffer pool behind the receive buffers of this thread: gets, hits,
+ * puts, inuse and cached bytes. trim frees the cached blocks first.
+ */
+static int lua_f_sock_pool_stats(lua_State *L) {
+    if (lua_toboolean(L, 1)) pool_trim();
+
+    pool_stats_t *stats = pool_stats();
+    lua_createtable(L, 0, 5);
+    LTABLE_SET_NUMBER(L, "gets", stats->gets);
+    LTABLE_SET_NUMBER(L, "hits", stats->hits);
+    LTABLE_SET_NUMBER(L, "puts", stats->puts);
+    LTABLE_SET_NUMBER(L, "inuse", stats->inuse);
+    LTABLE_SET_NUMBER(L, "cached", stats->cached);
     return 1;
 }
 
@@ -141,6 +972,11 @@ static int lua_f_sock_version(lua_State *L) {
 
 static const struct luaL_Reg lua_f_sock_mod[] = {
     {"new", lua_f_sock_create},
+    {"from_fd", lua_f_sock_from_fd},
+    {"pipe", lua_f_sock_pipe},
+    {"from_listen_fd", lua_f_sock_from_listen_fd},
+    {"stats", lua_f_sock_totals},
+    {"pool_stats", lua_f_sock_pool_stats},
     {"version", lua_f_sock_version},
     {NULL, NULL},
 };
@@ -153,6 +989,23 @@ int luaopen_sock(lua_State *L) {
     lua_setfield(L, -2, "__index");
     lua_pop(L, 1);
 
+    luaL_newmetatable(L, PIPE_METATABLE_NAME);
+    LTABLE_ADD_CFUNC(L, -1, "__gc", lua_f_pipe_close);
+    lua_newtable(L);
+    luaL_register(L, NULL, lua_f_pipe_func);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    // a peer that goes away must show up as EPIPE, not kill the process
+    struct sigaction sa;
+    if (sigaction(SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) signal(SIGPIPE, SIG_IGN);
+
     luaL_register(L, "sock", lua_f_sock_mod);
+    lua_pushinteger(L, SOCK_PUMP_IN);
+    lua_setfield(L, -2, "PUMP_IN");
+    lua_pushinteger(L, SOCK_PUMP_OUT);
+    lua_setfield(L, -2, "PUMP_OUT");
+    lua_pushinteger(L, SOCK_PUMP_EOF);
+    lua_setfield(L, -2, "PUMP_EOF");
     return 1;
 }
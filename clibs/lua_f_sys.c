@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "lua_f_util.h"
+
+/*
+ * process, cpu and plain fd helpers the servers built on sock and epoll
+ * need around them: forking prefork workers and reaping them, pinning
+ * threads, files for sk:sendfile() and fds handed between threads.
+ */
+
+/*
+ * sys.fork() -> pid
+ * fork(), the child is sent SIGTERM once its parent dies. With getpid()
+ * and wait_child() what cosock.serve() is built on, all three were
+ * sock.fork(), sock.getpid() and sock.wait_child() before sys existed.
+ */
+static int lua_f_sys_fork(lua_State *L) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        RETERR("fork fail");
+    }
+
+    /*
+     * a worker never outlives its master. The master may have died before
+     * PR_SET_PDEATHSIG took effect: then we were reparented, to init or a
+     * subreaper, whose pid is not known, so compare against the old parent.
+     */
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent) _exit(1);
+    }
+
+    lua_pushinteger(L, pid);
+    return 1;
+}
+
+static int lua_f_sys_getpid(lua_State *L) {
+    lua_pushinteger(L, getpid());
+    return 1;
+}
+
+/*
+ * sys.wait_child() -> pid, code
+ * block until any child exits, code is its exit status or -signal.
+ */
+static int lua_f_sys_wait_child(lua_State *L) {
+    int status = 0;
+    pid_t pid;
+
+    do {
+        pid = waitpid(-1, &status, 0);
+    } while (pid < 0 && errno == EINTR);
+
+    if (pid < 0) {
+        RETERR("waitpid fail");
+    }
+
+    lua_pushinteger(L, pid);
+    if (WIFEXITED(status))
+        lua_pushinteger(L, WEXITSTATUS(status));
+    else
+        lua_pushinteger(L, -WTERMSIG(status));
+    return 2;
+}
+
+// sys.now() -> ms of a monotonic clock, for measuring intervals only
+static int lua_f_sys_now(lua_State *L) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    lua_pushnumber(L, (lua_Number)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+    return 1;
+}
+
+// sys.sleep(ms): block the whole thread, for a process without a reactor loop
+static int lua_f_sys_sleep(lua_State *L) {
+    int ms = luaL_checkint(L, 1);
+    if (ms < 0) ms = 0;
+    struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000};
+    int rc;
+
+    do {
+        rc = nanosleep(&ts, &ts);
+    } while (rc < 0 && errno == EINTR);
+    return 0;
+}
+
+// sys.set_affinity(cpu): pin the calling thread, a worker process has only one
+static int lua_f_sys_set_affinity(lua_State *L) {
+    int cpu = luaL_checkint(L, 1);
+    if (set_cpu_affinity(cpu) < 0) {
+        RETERR("set_cpu_affinity fail");
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// sys.cpus() -> online cpus, sys.cpu() -> the one running the caller now
+static int lua_f_sys_cpus(lua_State *L) {
+    lua_pushinteger(L, cpu_count());
+    return 1;
+}
+
+static int lua_f_sys_cpu(lua_State *L) {
+    lua_pushinteger(L, sched_getcpu());
+    return 1;
+}
+
+/*
+ * sys.open(path) -> fd, size
+ * a read-only fd for sk:sendfile(), release it with sys.close_fd(). open()
+ * and fsize() were sock.open() and sock.fsize() before sys existed.
+ */
+static int lua_f_sys_open(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    struct stat st;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        RETERR("open fail");
+    }
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        RETERR("fstat fail");
+    }
+
+    lua_pushinteger(L, fd);
+    lua_pushinteger(L, st.st_size);
+    return 2;
+}
+
+static int lua_f_sys_fsize(lua_State *L) {
+    int fd = luaL_checkint(L, 1);
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        RETERR("fstat fail");
+    }
+
+    lua_pushinteger(L, st.st_size);
+    return 1;
+}
+
+static int lua_f_sys_close_fd(lua_State *L) {
+    int fd = luaL_checkint(L, 1);
+    safe_close(fd);
+    return 0;
+}
+
+static int lua_f_sys_version(lua_State *L) {
+    const char *ver = "Lua-Sys V0.0.1 by wenhaoye@126.com";
+    lua_pushstring(L, ver);
+    return 1;
+}
+
+static const struct luaL_Reg lua_f_sys_mod[] = {
+    {"fork", lua_f_sys_fork},
+    {"getpid", lua_f_sys_getpid},
+    {"wait_child", lua_f_sys_wait_child},
+    {"now", lua_f_sys_now},
+    {"sleep", lua_f_sys_sleep},
+    {"set_affinity", lua_f_sys_set_affinity},
+    {"cpus", lua_f_sys_cpus},
+    {"cpu", lua_f_sys_cpu},
+    {"open", lua_f_sys_open},
+    {"fsize", lua_f_sys_fsize},
+    {"close_fd", lua_f_sys_close_fd},
+    {"version", lua_f_sys_version},
+    {NULL, NULL},
+};
+
+/*
+  sys = {
+    fork = lua_f_sys_fork,
+    getpid = lua_f_sys_getpid,
+    wait_child = lua_f_sys_wait_child,
+    now = lua_f_sys_now,
+    sleep = lua_f_sys_sleep,
+    set_affinity = lua_f_sys_set_affinity,
+    cpus = lua_f_sys_cpus,
+    cpu = lua_f_sys_cpu,
+    open = lua_f_sys_open,
+    fsize = lua_f_sys_fsize,
+    close_fd = lua_f_sys_close_fd,
+    version = lua_f_sys_version,
+  };
+*/
+int luaopen_sys(lua_State *L) {
+    luaL_register(L, "sys", lua_f_sys_mod);
+    return 1;
+}
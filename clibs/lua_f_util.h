@@ -30,6 +30,11 @@ extern "C" {
     lua_pushcfunction(L, (func));              \
     lua_setfield(L, (index)-1, (name));
 
+// t[name] = value for the table on top, counters go out as lua_Number
+#define LTABLE_SET_NUMBER(L, name, value)   \
+    lua_pushnumber(L, (lua_Number)(value)); \
+    lua_setfield(L, -2, (name));
+
 static inline void stack_dump(lua_State *L) {
     int i;
     int top = lua_gettop(L);
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include "offload.h"
+
+#include <netdb.h>
+#include <pthread.h>
+
+#include "util.h"
+
+struct offload_queue {
+    chan_t done;
+    int refs;  // the owner plus every task in flight
+};
+
+typedef struct offload_entry {
+    char name[32];
+    offload_fn_t fn;
+} offload_entry_t;
+
+/*
+ * the pool: a FIFO of tasks under one mutex. Workers block anyway, a lock
+ * around two pointer updates costs nothing next to the work they do.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    offload_task_t *head;
+    offload_task_t *tail;
+    int nthreads;
+    offload_entry_t tasks[OFFLOAD_TASKS];
+    int ntasks;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void task_free(offload_task_t *t) {
+    int i;
+    for (i = 0; i < t->nargs; i++) free(t->args[i]);
+    if (t->result) chan_msg_free(t->result);
+    if (t->oom) chan_msg_free(t->oom);
+    free(t);
+}
+
+static void queue_unref(offload_queue_t *q) {
+    if (__atomic_sub_fetch(&q->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    chan_term(&q->done);
+    free(q);
+}
+
+static void *offload_worker(void *arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.head == NULL) pthread_cond_wait(&pool.cond, &pool.lock);
+        offload_task_t *t = pool.head;
+        pool.head = t->next;
+        if (pool.head == NULL) pool.tail = NULL;
+        pthread_mutex_unlock(&pool.lock);
+
+        errno = 0;
+        if (t->fn(t) < 0) {
+            // whatever was produced before the failure is dropped
+            if (t->result == NULL || t->result->data[0] != OFFLOAD_ERR) offload_fail(t, strerror(errno ? errno : EIO));
+        } else if (t->result == NULL) {
+            offload_reply(t, "", 0);
+        }
+
+        // out of memory for the result as well, the waiter hears of it anyway
+        offload_queue_t *q = t->q;
+        if (t->result == NULL) {
+            t->result = t->oom;
+            t->oom = NULL;
+        }
+        chan_post(&q->done, t->result);
+        t->result = NULL;
+        task_free(t);
+        queue_unref(q);
+    }
+
+    return NULL;
+}
+
+/*
+ * a forked child has the memory of the pool but none of its threads: start
+ * over, the tasks of the parent are the parent's business.
+ */
+static void pool_atfork_child(void) {
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.head = pool.tail = NULL;
+    pool.nthreads = 0;
+}
+
+// add or replace name, pool.lock held
+static int pool_register(const char *name, offload_fn_t fn) {
+    if (strlen(name) >= sizeof(pool.tasks[0].name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < pool.ntasks; i++) {
+        if (strcmp(pool.tasks[i].name, name) == 0) break;
+    }
+    if (i == OFFLOAD_TASKS) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    strcpy(pool.tasks[i].name, name);
+    pool.tasks[i].fn = fn;
+    if (i == pool.ntasks) pool.ntasks++;
+    return 0;
+}
+
+static int task_read_file(offload_task_t *t);
+static int task_write_file(offload_task_t *t);
+static int task_resolve(offload_task_t *t);
+
+static void pool_init(void) {
+    pthread_atfork(NULL, NULL, pool_atfork_child);
+    pthread_mutex_lock(&pool.lock);
+    pool_register("read_file", task_read_file);
+    pool_register("write_file", task_write_file);
+    pool_register("resolve", task_resolve);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+int offload_start(int n) {
+    pthread_once(&pool_once, pool_init);
+    if (n <= 0) n = OFFLOAD_THREADS;
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.nthreads < n) {
+        pthread_t tid;
+        int rc = pthread_create(&tid, NULL, offload_worker, NULL);
+        if (rc != 0) {
+            errno = rc;
+            ERR("pthread_create fail");
+            break;
+        }
+        pthread_detach(tid);
+        pool.nthreads++;
+    }
+    n = pool.nthreads;
+    pthread_mutex_unlock(&pool.lock);
+
+    return n > 0 ? n : -1;
+}
+
+int offload_register(const char *name, offload_fn_t fn) {
+    pthread_once(&pool_once, pool_init);
+
+    pthread_mutex_lock(&pool.lock);
+    int rc = pool_register(name, fn);
+    pthread_mutex_unlock(&pool.lock);
+    return rc;
+}
+
+offload_fn_t offload_lookup(const char *name) {
+    pthread_once(&pool_once, pool_init);
+
+    offload_fn_t fn = NULL;
+    int i;
+    pthread_mutex_lock(&pool.lock);
+    for (i = 0; i < pool.ntasks; i++) {
+        if (strcmp(pool.tasks[i].name, name) == 0) {
+            fn = pool.tasks[i].fn;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return fn;
+}
+
+offload_queue_t *offload_queue_new(void) {
+    offload_queue_t *q = (offload_queue_t *)MALLOC(sizeof(offload_queue_t));
+    if (q == NULL) return NULL;
+
+    if (chan_init(&q->done) < 0) {
+        free(q);
+        return NULL;
+    }
+    q->refs = 1;
+    return q;
+}
+
+void offload_queue_release(offload_queue_t *q) {
+    if (q) queue_unref(q);
+}
+
+chan_t *offload_queue_chan(offload_queue_t *q) { return &q->done; }
+
+int offload_submit(offload_queue_t *q, int id, offload_fn_t fn, int nargs, const char **args, const size_t *lens) {
+    if (nargs < 0 || nargs > OFFLOAD_ARGS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pool.nthreads == 0 && offload_start(0) < 0) return -1;
+
+    offload_task_t *t = (offload_task_t *)MALLOC(sizeof(offload_task_t));
+    if (t == NULL) return -1;
+    t->fn = fn;
+    t->q = q;
+    t->id = id;
+
+    // allocated up front, a worker that runs out of memory has to answer all the same
+    const char *oom = strerror(ENOMEM);
+    size_t len = strlen(oom);
+    t->oom = chan_msg_new(id, len + 1);
+    if (t->oom == NULL) {
+        task_free(t);
+        return -1;
+    }
+    t->oom->data[0] = OFFLOAD_ERR;
+    memcpy(t->oom->data + 1, oom, len);
+
+    int i;
+    for (i = 0; i < nargs; i++) {
+        t->args[i] = (char *)malloc(lens[i] + 1);
+        if (t->args[i] == NULL) {
+            task_free(t);
+            return -1;
+        }
+        memcpy(t->args[i], args[i], lens[i]);
+        t->args[i][lens[i]] = 0;
+        t->lens[i] = lens[i];
+        t->nargs++;
+    }
+
+    __atomic_add_fetch(&q->refs, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.tail)
+        pool.tail->next = t;
+    else
+        pool.head = t;
+    pool.tail = t;
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+char *offload_reply_buf(offload_task_t *t, size_t len) {
+    if (t->result) chan_msg_free(t->result);
+
+    t->result = chan_msg_new(t->id, len + 1);
+    if (t->result == NULL) return NULL;
+    t->result->data[0] = OFFLOAD_OK;
+    return t->result->data + 1;
+}
+
+int offload_reply(offload_task_t *t, const void *data, size_t len) {
+    char *buf = offload_reply_buf(t, len);
+    if (buf == NULL) return -1;
+    memcpy(buf, data, len);
+    return 0;
+}
+
+int offload_fail(offload_task_t *t, const char *err) {
+    size_t len = strlen(err);
+    if (t->result) chan_msg_free(t->result);
+
+    t->result = chan_msg_new(t->id, len + 1);
+    if (t->result) {
+        t->result->data[0] = OFFLOAD_ERR;
+        memcpy(t->result->data + 1, err, len);
+    }
+    return -1;
+}
+
+// read_file(path) -> the whole file
+static int task_read_file(offload_task_t *t) {
+    if (t->nargs < 1) return offload_fail(t, "read_file: path expected");
+
+    int fd = open(t->args[0], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) goto _FAILE;
+
+    // read straight into the completion, a file that grows meanwhile is cut
+    size_t size = st.st_size;
+    char *buf = offload_reply_buf(t, size);
+    if (buf == NULL) goto _FAILE;
+
+    size_t n = 0;
+    while (n < size) {
+        ssize_t ret = read(fd, buf + n, size - n);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) goto _FAILE;
+        if (ret == 0) break;
+        n += ret;
+    }
+    t->result->len = n + 1;
+
+    close(fd);
+    return 0;
+
+_FAILE:
+    close(fd);
+    return -1;
+}
+
+// write_file(path, data [, "a"]) -> bytes written, "a" appends instead of truncating
+static int task_write_file(offload_task_t *t) {
+    if (t->nargs < 2) return offload_fail(t, "write_file: path and data expected");
+
+    int append = t->nargs > 2 && t->args[2][0] == 'a';
+    int fd = open(t->args[0], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+    if (fd < 0) return -1;
+
+    size_t n = 0;
+    while (n < t->lens[1]) {
+        ssize_t ret = write(fd, t->args[1] + n, t->lens[1] - n);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) {
+            close(fd);
+            return -1;
+        }
+        n += ret;
+    }
+    close(fd);
+
+    char num[32];
+    int len = snprintf(num, sizeof(num), "%zu", n);
+    return offload_reply(t, num, len);
+}
+
+// resolve(host [, port]) -> its addresses, one per line, in getaddrinfo() order
+static int task_resolve(offload_task_t *t) {
+    if (t->nargs < 1) return offload_fail(t, "resolve: host expected");
+
+    struct addrinfo hints, *res = NULL, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = getaddrinfo(t->args[0], t->nargs > 1 ? t->args[1] : NULL, &hints, &res);
+    if (rc != 0) return offload_fail(t, rc == EAI_SYSTEM ? strerror(errno) : gai_strerror(rc));
+
+    char out[1024];
+    size_t len = 0;
+    for (ai = res; ai; ai = ai->ai_next) {
+        char ip[INET6_ADDRSTRLEN];
+        const void *addr = ai->ai_family == AF_INET6 ? (const void *)&((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr
+                                                     : (const void *)&((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+        if (inet_ntop(ai->ai_family, addr, ip, sizeof(ip)) == NULL) continue;
+
+        size_t n = strlen(ip);
+        if (len + n + 1 > sizeof(out)) break;
+        if (len) out[len++] = '\n';
+        memcpy(out + len, ip, n);
+        len += n;
+    }
+    freeaddrinfo(res);
+
+    if (len == 0) return offload_fail(t, "resolve: no address");
+    return offload_reply(t, out, len);
+}
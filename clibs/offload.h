@@ -0,0 +1,78 @@
+#ifndef CLIBS_OFFLOAD_H_
+#define CLIBS_OFFLOAD_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "chan.h"
+
+/*
+ * fixed pool of threads for blocking work a reactor must not do itself:
+ * file I/O, name resolution, anything CPU heavy. A reactor submits tasks
+ * with the offload_queue_t it owns and gets each result back on that
+ * queue's chan_t, whose eventfd sits in its epoll set: a worker never
+ * touches reactor state, completions of a busy reactor cost no syscall.
+ *
+ * The pool is process wide, started on first use, and gone in a forked
+ * child until that uses it again.
+ */
+
+#define OFFLOAD_THREADS 4  // default pool size
+#define OFFLOAD_ARGS 4     // string arguments per task
+#define OFFLOAD_TASKS 32   // registered task kinds at most
+
+typedef struct offload_queue offload_queue_t;
+typedef struct offload_task offload_task_t;
+
+/*
+ * a task body, run on a pool thread. It produces its result with
+ * offload_reply() / offload_reply_buf() and returns 0, or returns -1 with
+ * errno set (the message is strerror(errno)) or after offload_fail().
+ */
+typedef int (*offload_fn_t)(offload_task_t *t);
+
+struct offload_task {
+    offload_task_t *next;
+    offload_fn_t fn;
+    offload_queue_t *q;
+    int id;  // chosen by the submitter, comes back with the result
+    int nargs;
+    char *args[OFFLOAD_ARGS];  // nul terminated copies
+    size_t lens[OFFLOAD_ARGS];
+    chan_msg_t *result;
+    chan_msg_t *oom;  // the error completion sent instead when result cannot be allocated
+};
+
+/*
+ * a completion: tag is the task id, data[0] OFFLOAD_OK or OFFLOAD_ERR, the
+ * result or the error message follows.
+ */
+#define OFFLOAD_OK 0
+#define OFFLOAD_ERR 1
+
+// start n threads (0: OFFLOAD_THREADS) unless the pool runs, returns its size
+int offload_start(int n);
+
+// make fn available under name, the built-in ones are read_file, write_file, resolve
+int offload_register(const char *name, offload_fn_t fn);
+offload_fn_t offload_lookup(const char *name);
+
+offload_queue_t *offload_queue_new(void);
+// the owner lets go, the queue lives on until its last task completed
+void offload_queue_release(offload_queue_t *q);
+chan_t *offload_queue_chan(offload_queue_t *q);
+
+// queue fn(args) on the pool, -1 when out of memory
+int offload_submit(offload_queue_t *q, int id, offload_fn_t fn, int nargs, const char **args, const size_t *lens);
+
+// for task bodies: a result of len bytes, copied from data or filled in place
+int offload_reply(offload_task_t *t, const void *data, size_t len);
+char *offload_reply_buf(offload_task_t *t, size_t len);
+int offload_fail(offload_task_t *t, const char *err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // CLIBS_OFFLOAD_H_
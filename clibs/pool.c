@@ -0,0 +1,94 @@
+#include "pool.h"
+
+#include "util.h"
+
+typedef struct pool_block {
+    struct pool_block *next;
+} pool_block_t;
+
+typedef struct pool {
+    pool_block_t *free[POOL_CLASSES];
+    size_t nfree[POOL_CLASSES];
+    pool_stats_t stats;
+} pool_t;
+
+static __thread pool_t pool;
+
+// the class serving size bytes, -1 above POOL_MAX_SIZE
+static inline int pool_class(size_t size) {
+    if (size <= ((size_t)1 << POOL_MIN_SHIFT)) return 0;
+    if (size > POOL_MAX_SIZE) return -1;
+
+    int shift = 64 - __builtin_clzll((unsigned long long)(size - 1));  // ceil(log2(size))
+    return (shift - POOL_MIN_SHIFT + 1) / 2;
+}
+
+static inline size_t pool_class_size(int cls) { return (size_t)1 << (POOL_MIN_SHIFT + 2 * cls); }
+
+void *pool_get(size_t size, size_t *cap) {
+    pool.stats.gets++;
+
+    int cls = pool_class(size);
+    if (cls < 0) {
+        void *p = malloc(size);
+        if (p == NULL) return NULL;
+        *cap = size;
+        pool.stats.inuse += size;
+        return p;
+    }
+
+    size_t csize = pool_class_size(cls);
+    pool_block_t *b = pool.free[cls];
+    if (b) {
+        pool.free[cls] = b->next;
+        pool.nfree[cls]--;
+        pool.stats.cached -= csize;
+        pool.stats.hits++;
+    } else {
+        b = (pool_block_t *)malloc(csize);
+        if (b == NULL) return NULL;
+    }
+
+    *cap = csize;
+    pool.stats.inuse += csize;
+    return b;
+}
+
+void pool_put(void *p, size_t cap) {
+    if (p == NULL) return;
+    pool.stats.puts++;
+    pool.stats.inuse -= cap;
+
+    int cls = pool_class(cap);
+    // only exact class sizes came from a free list
+    if (cls < 0 || pool_class_size(cls) != cap || (pool.nfree[cls] + 1) * cap > POOL_CACHE_BYTES) {
+        free(p);
+        return;
+    }
+
+    pool_block_t *b = (pool_block_t *)p;
+    b->next = pool.free[cls];
+    pool.free[cls] = b;
+    pool.nfree[cls]++;
+    pool.stats.cached += cap;
+}
+
+size_t pool_cap(size_t size) {
+    int cls = pool_class(size);
+    return cls < 0 ? size : pool_class_size(cls);
+}
+
+void pool_trim(void) {
+    int cls;
+    for (cls = 0; cls < POOL_CLASSES; cls++) {
+        while (pool.free[cls]) {
+            pool_block_t *b = pool.free[cls];
+            pool.free[cls] = b->next;
+            free(b);
+        }
+        pool.nfree[cls] = 0;
+    }
+    pool.stats.cached = 0;
+}
+
+pool_stats_t *pool_stats(void) { return &pool.stats; }
@@ -0,0 +1,53 @@
+#ifndef CLIBS_POOL_H_
+#define CLIBS_POOL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * size class buffer pool. Blocks of 256B, 1K, 4K, 16K, 64K and 256K are
+ * recycled through a LIFO free list per class, so the buffer a connection
+ * gives back is the next one handed out, still warm in cache. Larger
+ * requests go straight to malloc. Every class caches at most
+ * POOL_CACHE_BYTES, the rest is freed on return.
+ *
+ * There is one pool per thread, i.e. per reactor: nothing is locked and a
+ * block must be returned on the thread that took it. Each shared object
+ * linking pool.o (libepoll.so and libsock.so) has its own set of them, so
+ * a block also goes back through the library that handed it out.
+ */
+
+#define POOL_CLASSES 6
+#define POOL_MIN_SHIFT 8  // smallest class, 256 bytes, each next one 4x larger
+#define POOL_MAX_SIZE ((size_t)1 << (POOL_MIN_SHIFT + 2 * (POOL_CLASSES - 1)))
+#define POOL_CACHE_BYTES (4 * 1024 * 1024)
+
+typedef struct pool_stats {
+    uint64_t gets;
+    uint64_t hits;    // served from a free list
+    uint64_t puts;
+    size_t inuse;     // bytes handed out and not returned yet
+    size_t cached;    // bytes sitting in the free lists
+} pool_stats_t;
+
+/*
+ * a block of at least size bytes, its real size (to pass back to pool_put)
+ * in *cap. NULL when out of memory.
+ */
+void *pool_get(size_t size, size_t *cap);
+void pool_put(void *p, size_t cap);
+// the cap pool_get(size) hands out, for callers that do not keep it
+size_t pool_cap(size_t size);
+// free everything cached on this thread
+void pool_trim(void);
+pool_stats_t *pool_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // CLIBS_POOL_H_
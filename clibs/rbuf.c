@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include "rbuf.h"
+
+#include "pool.h"
+#include "util.h"
+
+void rbuf_free(rbuf_t *self) {
+    pool_put(self->data, self->cap);
+    MEMSET_P(self);
+}
+
+void rbuf_consume(rbuf_t *self, size_t n) {
+    if (n >= rbuf_len(self)) {
+        // a drained buffer goes back to the pool, idle connections hold none
+        rbuf_free(self);
+        return;
+    }
+
+    self->head += n;
+    if (self->scan < self->head) self->scan = self->head;
+}
+
+// make room for at least size bytes after tail
+static int rbuf_reserve(rbuf_t *self, size_t size) {
+    if (self->cap - self->tail >= size) return 0;
+
+    size_t len = rbuf_len(self);
+    if (self->head > 0) {
+        memmove(self->data, self->data + self->head, len);
+        self->scan -= self->head;
+        self->head = 0;
+        self->tail = len;
+        if (self->cap - self->tail >= size) return 0;
+    }
+
+    size_t cap = self->cap ? self->cap : RBUF_CHUNK;
+    while (cap - len < size) cap <<= 1;
+
+    char *data = (char *)pool_get(cap, &cap);
+    if (data == NULL) return -1;
+
+    if (self->data) {
+        memcpy(data, self->data, len);
+        pool_put(self->data, self->cap);
+    }
+    self->data = data;
+    self->cap = cap;
+    return 0;
+}
+
+int rbuf_append(rbuf_t *self, const void *data, size_t len) {
+    if (len == 0) return 0;
+    if (rbuf_reserve(self, len) < 0) return -1;
+
+    memcpy(self->data + self->tail, data, len);
+    self->tail += len;
+    return 0;
+}
+
+ssize_t rbuf_fill(rbuf_t *self, int fd, size_t want) {
+    size_t total = 0;
+
+    while (1) {
+        size_t need = want > rbuf_len(self) ? want - rbuf_len(self) : 0;
+        if (rbuf_reserve(self, need > RBUF_CHUNK ? need : RBUF_CHUNK) < 0) return total ? (ssize_t)total : -1;
+
+        size_t room = self->cap - self->tail;
+        int ret = Read(fd, self->data + self->tail, room);
+        if (ret <= 0 && rbuf_len(self) == 0) rbuf_free(self);  // nothing to hold on to while waiting
+        if (ret < 0) {
+            if (total) return total;
+            return ret == -EAGAIN ? -EAGAIN : -1;
+        }
+
+        if (ret == 0) return total;  // EOF, reported once nothing is left to return
+
+        self->tail += ret;
+        total += ret;
+
+        // a short read drained the socket
+        if ((size_t)ret < room) return total;
+        if (rbuf_len(self) >= want && total >= RBUF_DRAIN_MAX) return total;
+    }
+}
+
+ssize_t rbuf_find(rbuf_t *self, const char *delim, size_t dlen) {
+    if (dlen == 0) return 0;
+    if (self->data == NULL) return -1;
+
+    // scan only holds for the delimiter it was reached with
+    int same = dlen <= RBUF_DELIM_MAX && dlen == self->sdlen && memcmp(self->sdelim, delim, dlen) == 0;
+    size_t from = same && self->scan > self->head ? self->scan : self->head;
+    // a delimiter may straddle the previous search end
+    if (from - self->head >= dlen - 1)
+        from -= dlen - 1;
+    else
+        from = self->head;
+
+    const char *p;
+    if (dlen == 1)
+        p = memchr(self->data + from, delim[0], self->tail - from);
+    else
+        p = memmem(self->data + from, self->tail - from, delim, dlen);
+
+    if (p == NULL) {
+        self->scan = self->tail;
+        self->sdlen = dlen <= RBUF_DELIM_MAX ? dlen : 0;
+        memcpy(self->sdelim, delim, self->sdlen);
+        return -1;
+    }
+
+    return p - (self->data + self->head);
+}
@@ -0,0 +1,61 @@
+#ifndef CLIBS_RBUF_H_
+#define CLIBS_RBUF_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * growable receive buffer. Unread bytes live in data[head, tail), they are
+ * slid back to the front instead of wrapping around so that a frame is
+ * always contiguous: delimiter scans are a single memchr/memmem and a frame
+ * becomes a Lua string with one copy. The storage is borrowed from the
+ * thread's pool (see pool.h) and given back as soon as it is drained.
+ */
+
+#define RBUF_CHUNK (16 * 1024)       // minimum free space offered to read()
+#define RBUF_DRAIN_MAX (256 * 1024)  // stop draining the kernel beyond this
+#define RBUF_DELIM_MAX 8             // longer delimiters are searched from head every time
+
+typedef struct rbuf {
+    char *data;
+    size_t cap;
+    size_t head;  // first unread byte
+    size_t tail;  // end of buffered data
+    size_t scan;  // delimiter search already done up to here
+    char sdelim[RBUF_DELIM_MAX];  // ... for this delimiter
+    size_t sdlen;
+} rbuf_t;
+
+inline static size_t rbuf_len(rbuf_t *self) { return self->tail - self->head; }
+inline static char *rbuf_peek(rbuf_t *self) { return self->data + self->head; }
+
+void rbuf_free(rbuf_t *self);
+void rbuf_consume(rbuf_t *self, size_t n);
+
+/*
+ * read from fd until the kernel buffer is drained (a short read or EAGAIN),
+ * want bytes are buffered, or RBUF_DRAIN_MAX was taken in this call.
+ * Returns the bytes read (> 0), 0 on EOF, -EAGAIN if nothing was available
+ * and -1 on error.
+ */
+ssize_t rbuf_fill(rbuf_t *self, int fd, size_t want);
+
+// put len bytes behind the buffered ones, -1 when out of memory
+int rbuf_append(rbuf_t *self, const void *data, size_t len);
+
+/*
+ * offset (from head) of the first delim, -1 if it is not buffered yet.
+ * Resumes where the previous unsuccessful search for the same delim
+ * stopped, any other delimiter is searched from head.
+ */
+ssize_t rbuf_find(rbuf_t *self, const char *delim, size_t dlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // CLIBS_RBUF_H_
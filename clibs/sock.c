@@ -1,7 +1,38 @@
+#define _GNU_SOURCE
 #include "sock.h"
 
+#include <linux/filter.h>
+#include <netinet/udp.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+__thread sock_stats_t sock_totals;
+
+#define sock_count(self, field, n)  \
+    do {                            \
+        (self)->stats.field += (n); \
+        sock_totals.field += (n);   \
+    } while (0)
+
 static const char *sock_type_str(sock_t *self) {
     switch (self->type) {
         case SOCK_TCP_SERVER:
@@ -22,22 +53,26 @@ static const char *sock_type_str(sock_t *self) {
 }
 
 void sock_tostring(sock_t *self) {
-    printf("sock info: fd(%d), type(%s), ", self->fd, sock_type_str(self));
-    sock_type_t type = self->type & SOCKET_TYPE_MASK;
-    if (type == SOCK_TCP || type == SOCK_UDP) {
-        printf("ip(%s), port(%u)\n", self->addr.net.ip, self->addr.net.port);
-    } else if (type == SOCK_UNIX) {
-        printf("path(%s)\n", self->addr.upath);
-    } else {
-        printf("invalid \n");
-    }
+    char peer[128] = "-";
+    if (self->is_connected) sock_peer(self, peer, sizeof(peer));
+    printf("sock info: fd(%d), type(%s), peer(%s)\n", self->fd, sock_type_str(self), peer);
 }
+
+// what sock_init() needs from the info string, gone once the fd exists
+typedef struct sock_info {
+    uint8_t type;
+    int domain;
+    char ip[64];
+    uint16_t port;
+    char upath[108];
+} sock_info_t;
+
 /*
  * for example:
  * serv: @tcp:127.0.0.1:8000
  * client: >tcp:127.0.0.1:8000
  */
-static int _parse_socket_info(const char *info, sock_t *self) {
+static int _parse_socket_info(const char *info, sock_info_t *self) {
     uint16_t offset = 0;
     uint8_t is_server = 0;
 
@@ -71,7 +106,8 @@ static int _parse_socket_info(const char *info, sock_t *self) {
 
     offset += 1;  // skip ":"
     if (self->type > SOCK_UNIX) {
-        strncpy(self->addr.upath, info + offset, sizeof(self->addr.upath));
+        strncpy(self->upath, info + offset, sizeof(self->upath) - 1);
+        self->upath[sizeof(self->upath) - 1] = 0;
         return 0;
     }
 
@@ -85,9 +121,9 @@ static int _parse_socket_info(const char *info, sock_t *self) {
         }
 
         uint8_t len = end - flag - 1;
-        if (len > (sizeof(self->addr.net.ip) - 1)) return -1;
-        memcpy(self->addr.net.ip, flag + 1, len);
-        self->addr.net.ip[len] = 0;
+        if (len > (sizeof(self->ip) - 1)) return -1;
+        memcpy(self->ip, flag + 1, len);
+        self->ip[len] = 0;
         offset += (len + 1 + 2);
 
         self->domain = AF_INET6;
@@ -96,53 +132,58 @@ static int _parse_socket_info(const char *info, sock_t *self) {
         if (flag == NULL) return -1;
 
         uint8_t len = flag - info - offset;
-        if (len > (sizeof(self->addr.net.ip) - 1)) return -1;
-        memcpy(self->addr.net.ip, info + offset, len);
-        self->addr.net.ip[len] = 0;
+        if (len > (sizeof(self->ip) - 1)) return -1;
+        memcpy(self->ip, info + offset, len);
+        self->ip[len] = 0;
         offset += (len + 1);
 
-        if (self->addr.net.ip[0] == '*')
+        if (self->ip[0] == '*')
             self->domain = AF_INET6;
         else
             self->domain = AF_INET;
     }
 
     // parse port
-    self->addr.net.port = atoi(info + offset);
+    self->port = atoi(info + offset);
     return 0;
 }
 
 int sock_init(sock_t *self, const char *info) {
+    memset(self, 0, sizeof(sock_t));
     self->fd = -1;
     DBG("info:%s\n", info);
-    if (_parse_socket_info(info, self) < 0) {
+
+    sock_info_t si;
+    memset(&si, 0, sizeof(si));
+    if (_parse_socket_info(info, &si) < 0) {
         DBG("_parse_socket_info fail");
         return -1;
     }
+    self->type = si.type;
 
     switch (self->type) {
         case SOCK_TCP_SERVER:
-            self->fd = tcp_server_create(self->addr.net.ip, self->addr.net.port, 1024);
+            self->fd = tcp_server_create(si.ip, si.port, 1024);
             break;
 
         case SOCK_TCP_CLIENT:
-            self->fd = tcp_client_create(self->addr.net.ip, self->addr.net.port, &self->is_connected);
+            self->fd = tcp_client_create(si.ip, si.port, &self->is_connected);
             break;
 
         case SOCK_UDP_SERVER:
-            self->fd = udp_server_create(self->addr.net.ip, self->addr.net.port);
+            self->fd = udp_server_create(si.ip, si.port);
             break;
 
         case SOCK_UDP_CLIENT:
-            self->fd = udp_client_create(self->addr.net.ip, self->addr.net.port);
+            self->fd = udp_client_create(si.ip, si.port);
             break;
 
         case SOCK_UNIX_SERVER:
-            self->fd = unix_udp_server_create(self->addr.upath);
+            self->fd = unix_udp_server_create(si.upath);
             break;
 
         case SOCK_UNIX_CLIENT:
-            self->fd = unix_udp_client_create(self->addr.upath);
+            self->fd = unix_udp_client_create(si.upath);
             break;
 
         default:
@@ -152,63 +193,109 @@ int sock_init(sock_t *self, const char *info) {
     }
 
     if (self->fd < 0) {
-        sock_tostring(self);
+        ERR("sock_init %s fail", info);
         return -1;
     }
 
     return 0;
 }
 
+// a connected tcp socket around fd, its address is left to sock_peer()
+static void sock_set_conn(sock_t *self, int fd) {
+    memset(self, 0, sizeof(sock_t));
+    self->fd = fd;
+    self->type = SOCK_TCP_CLIENT;
+    self->is_connected = 1;
+}
+
+// accepted fds come out non-blocking and close-on-exec, no fcntl round
+// trips, and without their address: nothing is formatted on this path
+static int sock_accept_fd(sock_t *self) {
+    int fd;
+
+    do {
+        fd = accept4(sock_fd(self), NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    } while (fd < 0 && errno == EINTR);
+
+    if (fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return -EAGAIN;
+        ERR("accept4 fail");
+        return -1;
+    }
+
+    sock_count(self, accepted, 1);
+    return fd;
+}
+
 int sock_accept(sock_t *self, sock_t *cli) {
     assert(self);
     assert(self->type == SOCK_TCP_SERVER);
     assert(cli);
 
-    int fd = -1;
-    socklen_t addr_len = 0;
-    struct sockaddr_in v4;
-    struct sockaddr_in6 v6;
+    int fd = sock_accept_fd(self);
+    if (fd < 0) return fd;
 
-_AGAIN:
-    if (self->domain == AF_INET) {
-        addr_len = sizeof(v4);
-        fd = accept(sock_fd(self), (struct sockaddr *)(&v4), &addr_len);
-    } else {
-        addr_len = sizeof(v6);
-        fd = accept(sock_fd(self), (struct sockaddr *)(&v6), &addr_len);
-    }
+    sock_set_conn(cli, fd);
+    return 0;
+}
 
-    if (fd < 0) {
-        if (errno == EINTR) goto _AGAIN;
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            return -EAGAIN;
+int sock_accept_batch(sock_t *self, sock_t *clis, int max) {
+    assert(self);
+    assert(self->type == SOCK_TCP_SERVER);
+    assert(clis);
+
+    int n = 0;
+
+    while (n < max) {
+        int fd = sock_accept_fd(self);
+        if (fd == -EAGAIN) break;
+        if (fd < 0) {
+            // hand out what was accepted, the error shows up again next call
+            if (n > 0) break;
+            return -1;
         }
 
-        ERR("accept fail");
-        return -1;
+        sock_set_conn(&clis[n], fd);
+        n++;
     }
 
-    if (set_nonblock(fd) < 0) {
-        ERR("set_nonblock fail");
-        close(fd);
+    return n;
+}
+
+int sock_from_listen_fd(sock_t *self, int fd) {
+    assert(self);
+
+    if (fd < 0) {
+        errno = EBADF;
         return -1;
     }
 
-    cli->fd = fd;
-    cli->domain = self->domain;
-    cli->type = SOCK_TCP_CLIENT;
+    memset(self, 0, sizeof(sock_t));
+    self->fd = fd;
+    self->type = SOCK_TCP_SERVER;
+    return 0;
+}
 
-    if (cli->domain == AF_INET) {
-        inet_ntop(AF_INET, &v4.sin_addr, cli->addr.net.ip, addr_len);
-        cli->addr.net.port = ntohs(v4.sin_port);
-    } else {
-        inet_ntop(AF_INET6, &v6.sin6_addr, cli->addr.net.ip, addr_len);
-        cli->addr.net.port = ntohs(v6.sin6_port);
+int sock_from_fd(sock_t *self, int fd) {
+    assert(self);
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
     }
 
+    sock_set_conn(self, fd);
     return 0;
 }
 
+int sock_peer(sock_t *self, char *buf, size_t size) {
+    struct sockaddr_storage ss;
+    socklen_t addr_len = sizeof(ss);
+
+    if (sock_is_closed(self) || getpeername(sock_fd(self), (struct sockaddr *)&ss, &addr_len) < 0) return -1;
+    return sock_addr_format(&ss, buf, size);
+}
+
 int sock_write(sock_t *self, void *data, size_t len) {
     assert(self);
     assert(data);
@@ -221,10 +308,43 @@ int sock_write(sock_t *self, void *data, size_t len) {
 
     int ret = Write(sock_fd(self), data, len);
     if (ret < 0) {
+        int err = errno;
         ERR("Write fail");
+        errno = err;  // ERR() may clobber it
+        return -1;
+    }
+
+    if (ret > 0)
+        sock_count(self, tx_bytes, ret);
+    else if (len > 0)
+        sock_count(self, tx_eagain, 1);
+
+    return ret;
+}
+
+int sock_writev(sock_t *self, const struct iovec *iov, int cnt) {
+    assert(self);
+    assert(iov);
+    assert(self->type != SOCK_UNKONW_TYPE);
+
+    if (sock_is_closed(self)) {
+        DBG("socket closed");
         return -1;
     }
 
+    int ret = Writev(sock_fd(self), iov, cnt);
+    if (ret < 0) {
+        int err = errno;
+        ERR("Writev fail");
+        errno = err;  // ERR() may clobber it
+        return -1;
+    }
+
+    if (ret > 0)
+        sock_count(self, tx_bytes, ret);
+    else if (cnt > 0)
+        sock_count(self, tx_eagain, 1);
+
     return ret;
 }
 
@@ -240,13 +360,614 @@ int sock_read(sock_t *self, void *data, size_t size) {
 
     int ret = Read(sock_fd(self), data, size);
     if (ret < 0 && ret != -EAGAIN) {
+        int err = errno;
         ERR("fd_read fail");
+        errno = err;  // ERR() may clobber it
         return -1;
     }
 
+    if (ret > 0)
+        sock_count(self, rx_bytes, ret);
+    else if (ret == -EAGAIN)
+        sock_count(self, rx_eagain, 1);
+
     return ret;
 }
 
+ssize_t sock_fill(sock_t *self, size_t want) {
+    assert(self);
+    assert(self->rbuf);
+
+    ssize_t ret = rbuf_fill(self->rbuf, sock_fd(self), want);
+    if (ret > 0)
+        sock_count(self, rx_bytes, ret);
+    else if (ret == -EAGAIN)
+        sock_count(self, rx_eagain, 1);
+
+    return ret;
+}
+
+int sock_sendfile(sock_t *self, int in_fd, off_t *offset, size_t count) {
+    assert(self);
+    assert(offset);
+
+    if (sock_is_closed(self)) {
+        DBG("socket closed");
+        return -1;
+    }
+
+    if (count == 0) return 0;
+
+    ssize_t ret;
+    do {
+        ret = sendfile(sock_fd(self), in_fd, offset, count);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            sock_count(self, tx_eagain, 1);
+            return 0;
+        }
+        int err = errno;
+        ERR("sendfile fail");
+        errno = err;  // ERR() may clobber it
+        return -1;
+    }
+
+    sock_count(self, tx_bytes, ret);
+    return ret;
+}
+
+int sock_pipe_init(sock_pipe_t *self) {
+    assert(self);
+    memset(self, 0, sizeof(sock_pipe_t));
+
+    if (pipe2(self->fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        ERR("pipe2 fail");
+        self->fds[0] = self->fds[1] = -1;
+        return -1;
+    }
+
+    // a bigger pipe means fewer splice calls per wakeup, the default is fine too
+    fcntl(self->fds[1], F_SETPIPE_SZ, SOCK_PIPE_SIZE);
+    return 0;
+}
+
+int sock_pump(sock_pipe_t *self, sock_t *src, sock_t *dst, int *state) {
+    assert(self);
+    assert(src);
+    assert(dst);
+
+    int moved = 0;
+    ssize_t n;
+    *state = 0;
+
+    while (moved < SOCK_PUMP_BUDGET) {
+        // drain the pipe into dst first
+        while (self->pending > 0) {
+            n = splice(self->fds[0], NULL, sock_fd(dst), NULL, self->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    sock_count(dst, tx_eagain, 1);
+                    *state |= SOCK_PUMP_OUT;
+                    return moved;
+                }
+                int err = errno;
+                ERR("splice to fd=%d fail", sock_fd(dst));
+                errno = err;  // ERR() may clobber it
+                return -1;
+            }
+
+            sock_count(dst, tx_bytes, n);
+            self->pending -= n;
+            moved += n;
+        }
+
+        if (self->eof) {
+            *state |= SOCK_PUMP_EOF;
+            return moved;
+        }
+
+        // the pipe is empty here, so EAGAIN can only come from src
+        n = splice(sock_fd(src), NULL, self->fds[1], NULL, SOCK_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                sock_count(src, rx_eagain, 1);
+                *state |= SOCK_PUMP_IN;
+                return moved;
+            }
+            int err = errno;
+            ERR("splice from fd=%d fail", sock_fd(src));
+            errno = err;  // ERR() may clobber it
+            return -1;
+        }
+
+        if (n == 0) self->eof = 1;
+        sock_count(src, rx_bytes, n);
+        self->pending += n;
+    }
+
+    return moved;
+}
+
+struct sock_mmsg {
+    struct mmsghdr hdrs[SOCK_MMSG_MAX];
+    struct iovec iovs[SOCK_MMSG_MAX];
+    struct sockaddr_storage addrs[SOCK_MMSG_MAX];
+    char *bufs;      // receive slots, SOCK_MMSG_MAX * SOCK_DGRAM_SIZE or with
+    size_t slot;     // UDP_GRO on SOCK_GRO_BATCH * SOCK_GRO_SIZE
+    int8_t gro;
+    uint16_t segs[SOCK_MMSG_MAX];  // gso_size of coalesced receives, 0 if single
+    char ctrl[SOCK_MMSG_MAX][CMSG_SPACE(sizeof(int))];
+};
+
+static int sock_mmsg_bufs(sock_mmsg_t *m, int gro) {
+    size_t size = gro ? SOCK_GRO_BATCH * SOCK_GRO_SIZE : SOCK_MMSG_MAX * SOCK_DGRAM_SIZE;
+    char *bufs = (char *)malloc(size);
+    if (bufs == NULL) return -1;
+
+    safe_free(m->bufs);
+    m->bufs = bufs;
+    m->slot = gro ? SOCK_GRO_SIZE : SOCK_DGRAM_SIZE;
+    m->gro = gro;
+    return 0;
+}
+
+static sock_mmsg_t *sock_mmsg_reserve(sock_t *self) {
+    if (self->mmsg) return self->mmsg;
+
+    sock_mmsg_t *m = (sock_mmsg_t *)MALLOC(sizeof(sock_mmsg_t));
+    if (m == NULL) return NULL;
+
+    if (sock_mmsg_bufs(m, 0) < 0) {
+        safe_free(m);
+        return NULL;
+    }
+
+    self->mmsg = m;
+    return m;
+}
+
+void sock_mmsg_free(sock_t *self) {
+    if (self->mmsg == NULL) return;
+
+    safe_free(self->mmsg->bufs);
+    safe_free(self->mmsg);
+}
+
+int sock_recv_batch(sock_t *self, int n) {
+    assert(self);
+
+    sock_mmsg_t *m = sock_mmsg_reserve(self);
+    if (m == NULL) return -1;
+    if (n > SOCK_MMSG_MAX) n = SOCK_MMSG_MAX;
+    if (m->gro && n > SOCK_GRO_BATCH) n = SOCK_GRO_BATCH;
+
+    int i;
+    for (i = 0; i < n; i++) {
+        m->iovs[i].iov_base = m->bufs + i * m->slot;
+        m->iovs[i].iov_len = m->slot;
+        memset(&m->hdrs[i].msg_hdr, 0, sizeof(struct msghdr));
+        m->hdrs[i].msg_hdr.msg_iov = &m->iovs[i];
+        m->hdrs[i].msg_hdr.msg_iovlen = 1;
+        m->hdrs[i].msg_hdr.msg_name = &m->addrs[i];
+        m->hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        if (m->gro) {
+            m->hdrs[i].msg_hdr.msg_control = m->ctrl[i];
+            m->hdrs[i].msg_hdr.msg_controllen = sizeof(m->ctrl[i]);
+        }
+    }
+
+    int ret;
+    do {
+        ret = recvmmsg(sock_fd(self), m->hdrs, n, MSG_DONTWAIT, NULL);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            sock_count(self, rx_eagain, 1);
+            return 0;
+        }
+        ERR("recvmmsg fail");
+        return -1;
+    }
+
+    for (i = 0; i < ret; i++) {
+        sock_count(self, rx_bytes, m->hdrs[i].msg_len);
+        m->segs[i] = 0;
+        if (!m->gro) continue;
+
+        struct cmsghdr *cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&m->hdrs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&m->hdrs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int seg = 0;
+                memcpy(&seg, CMSG_DATA(cmsg), sizeof(seg));
+                m->segs[i] = seg;
+            }
+        }
+    }
+
+    return ret;
+}
+
+const char *sock_mmsg_data(sock_t *self, int i, size_t *len) {
+    *len = self->mmsg->hdrs[i].msg_len;
+    return self->mmsg->bufs + i * self->mmsg->slot;
+}
+
+int sock_mmsg_segsize(sock_t *self, int i) { return self->mmsg->segs[i]; }
+
+int sock_set_gro(sock_t *self, int on) {
+    assert(self);
+
+    sock_mmsg_t *m = sock_mmsg_reserve(self);
+    if (m == NULL) return -1;
+
+    on = on ? 1 : 0;
+    if (setsockopt(sock_fd(self), SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        ERR("setsockopt UDP_GRO fail");
+        return -1;
+    }
+
+    if (m->gro != on && sock_mmsg_bufs(m, on) < 0) return -1;
+    return 0;
+}
+
+int sock_send_gso(sock_t *self, const char *data, size_t len, uint16_t seg, const char *peer) {
+    assert(self);
+    assert(data);
+
+    struct sockaddr_storage ss;
+    socklen_t addr_len = 0;
+    if (peer && sock_addr_parse(peer, &ss, &addr_len) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (seg == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // one send carries at most SOCK_GSO_SEGS segments and one udp payload
+    size_t segs = SOCK_GSO_MAX / seg;
+    if (segs > SOCK_GSO_SEGS) segs = SOCK_GSO_SEGS;
+    if (segs == 0) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    size_t chunk = segs * seg;
+
+    char ctrl[CMSG_SPACE(sizeof(uint16_t))];
+    struct iovec iov;
+    struct msghdr msg;
+    size_t sent = 0;
+
+    while (sent < len) {
+        size_t n = len - sent > chunk ? chunk : len - sent;
+        iov.iov_base = (void *)(data + sent);
+        iov.iov_len = n;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (peer) {
+            msg.msg_name = &ss;
+            msg.msg_namelen = addr_len;
+        }
+
+        // a single segment needs no offload
+        if (n > seg) {
+            memset(ctrl, 0, sizeof(ctrl));
+            msg.msg_control = ctrl;
+            msg.msg_controllen = sizeof(ctrl);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cmsg), &seg, sizeof(seg));
+        }
+
+        ssize_t ret;
+        do {
+            ret = sendmsg(sock_fd(self), &msg, MSG_DONTWAIT);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                sock_count(self, tx_eagain, 1);
+                break;
+            }
+            if (sent > 0) break;  // report what went out, the error comes back next call
+            ERR("sendmsg UDP_SEGMENT fail");
+            return -1;
+        }
+
+        sent += n;
+    }
+
+    sock_count(self, tx_bytes, sent);
+    return sent;
+}
+
+int sock_mmsg_peer(sock_t *self, int i, char *buf, size_t size) {
+    return sock_addr_format(&self->mmsg->addrs[i], buf, size);
+}
+
+int sock_mmsg_set(sock_t *self, int i, const void *data, size_t len, const char *peer) {
+    assert(i < SOCK_MMSG_MAX);
+
+    sock_mmsg_t *m = sock_mmsg_reserve(self);
+    if (m == NULL) return -1;
+
+    m->iovs[i].iov_base = (void *)data;
+    m->iovs[i].iov_len = len;
+    memset(&m->hdrs[i].msg_hdr, 0, sizeof(struct msghdr));
+    m->hdrs[i].msg_hdr.msg_iov = &m->iovs[i];
+    m->hdrs[i].msg_hdr.msg_iovlen = 1;
+
+    if (peer) {
+        socklen_t addr_len = 0;
+        if (sock_addr_parse(peer, &m->addrs[i], &addr_len) < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        m->hdrs[i].msg_hdr.msg_name = &m->addrs[i];
+        m->hdrs[i].msg_hdr.msg_namelen = addr_len;
+    }
+
+    return 0;
+}
+
+int sock_send_batch(sock_t *self, int n) {
+    assert(self);
+
+    if (n <= 0 || self->mmsg == NULL) return 0;
+    if (n > SOCK_MMSG_MAX) n = SOCK_MMSG_MAX;
+
+    int ret;
+    do {
+        ret = sendmmsg(sock_fd(self), self->mmsg->hdrs, n, MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            sock_count(self, tx_eagain, 1);
+            return 0;
+        }
+        ERR("sendmmsg fail");
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < ret; i++) sock_count(self, tx_bytes, self->mmsg->hdrs[i].msg_len);
+    return ret;
+}
+
+int sock_set_busy_poll(sock_t *self, int us, int prefer) {
+    assert(self);
+
+    if (setsockopt(sock_fd(self), SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0) {
+        ERR("setsockopt SO_BUSY_POLL fail");
+        return -1;
+    }
+
+    prefer = prefer ? 1 : 0;
+    if (setsockopt(sock_fd(self), SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) < 0 && prefer) {
+        ERR("setsockopt SO_PREFER_BUSY_POLL fail");
+        return -1;
+    }
+
+    return 0;
+}
+
+int sock_set_incoming_cpu(sock_t *self, int cpu) {
+    assert(self);
+
+    if (setsockopt(sock_fd(self), SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+        ERR("setsockopt SO_INCOMING_CPU fail");
+        return -1;
+    }
+    return 0;
+}
+
+int sock_incoming_cpu(sock_t *self) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+
+    if (getsockopt(sock_fd(self), SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0) return -1;
+    return cpu;
+}
+
+int sock_steer_by_cpu(sock_t *self, int n) {
+    assert(self);
+
+    if (n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // A = the cpu the packet came in on; return A % n, the group index
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)n},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {.len = sizeof(code) / sizeof(code[0]), .filter = code};
+
+    if (setsockopt(sock_fd(self), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        ERR("setsockopt SO_ATTACH_REUSEPORT_CBPF fail");
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct sock_slot {
+    sock_t sk;
+    uint32_t gen;
+    int8_t used;
+} sock_slot_t;
+
+static sock_slot_t *sock_slab[SOCK_SLAB_PAGES];
+
+static sock_slot_t *sock_slot(int fd, int create) {
+    if (fd < 0) return NULL;
+
+    size_t page = (size_t)fd >> SOCK_SLAB_PAGE_SHIFT;
+    if (page >= SOCK_SLAB_PAGES) return NULL;
+
+    sock_slot_t *slots = sock_slab[page];
+    if (slots == NULL) {
+        if (!create) return NULL;
+
+        slots = (sock_slot_t *)calloc((size_t)1 << SOCK_SLAB_PAGE_SHIFT, sizeof(sock_slot_t));
+        if (slots == NULL) return NULL;
+        // another reactor thread may have installed this page meanwhile
+        if (!__sync_bool_compare_and_swap(&sock_slab[page], NULL, slots)) {
+            free(slots);
+            slots = sock_slab[page];
+        }
+    }
+
+    return &slots[fd & ((1 << SOCK_SLAB_PAGE_SHIFT) - 1)];
+}
+
+sock_t *sock_slab_add(const sock_t *src, uint32_t *gen) {
+    assert(src);
+
+    sock_slot_t *slot = sock_slot(src->fd, 1);
+    if (slot == NULL) {
+        errno = src->fd < 0 ? EBADF : EMFILE;
+        ERR("sock_slab_add fd(%d) fail", src->fd);
+        return NULL;
+    }
+
+    /*
+     * the kernel handed out this fd, so a sock still sitting here was leaked
+     * without a release: free its buffers but never close() the fd, the
+     * number belongs to the new connection now.
+     */
+    if (__atomic_load_n(&slot->used, __ATOMIC_ACQUIRE)) {
+        slot->sk.fd = -1;
+        sock_term(&slot->sk);
+    }
+
+    memcpy(&slot->sk, src, sizeof(sock_t));
+    slot->gen++;
+    __atomic_store_n(&slot->used, 1, __ATOMIC_RELEASE);
+    if (gen) *gen = slot->gen;
+    return &slot->sk;
+}
+
+sock_t *sock_slab_get(int fd, uint32_t gen) {
+    sock_slot_t *slot = sock_slot(fd, 0);
+    if (slot == NULL || !slot->used || slot->gen != gen) return NULL;
+    return &slot->sk;
+}
+
+void sock_slab_release(sock_t *self) {
+    assert(self);
+
+    sock_slot_t *slot = sock_slot(self->fd, 0);
+    if (slot == NULL || &slot->sk != self) {
+        // not slab owned (or already released)
+        sock_term(self);
+        return;
+    }
+
+    /*
+     * empty the slot before the fd is closed: from then on another thread's
+     * accept4() may get the same number and sock_slab_add() it here.
+     */
+    sock_t sk;
+    memcpy(&sk, &slot->sk, sizeof(sock_t));
+    slot->sk.fd = -1;
+    slot->sk.rbuf = NULL;
+    slot->sk.mmsg = NULL;
+    slot->gen++;
+    __atomic_store_n(&slot->used, 0, __ATOMIC_RELEASE);
+
+    sock_term(&sk);
+}
+
+int sock_slab_detach(sock_t *self) {
+    assert(self);
+
+    int fd = self->fd;
+    sock_slot_t *slot = sock_slot(fd, 0);
+
+    // sock_term() leaves a negative fd alone
+    self->fd = -1;
+    sock_term(self);
+    if (slot && &slot->sk == self) {
+        slot->gen++;
+        __atomic_store_n(&slot->used, 0, __ATOMIC_RELEASE);
+    }
+    return fd;
+}
+
+int sock_addr_parse(const char *str, struct sockaddr_storage *ss, socklen_t *len) {
+    char ip[64];
+    const char *colon = strrchr(str, ':');
+    if (colon == NULL) return -1;
+
+    size_t n = colon - str;
+    if (str[0] == '[') {
+        if (n < 2 || str[n - 1] != ']') return -1;
+        str++;
+        n -= 2;
+    }
+    if (n >= sizeof(ip)) return -1;
+    memcpy(ip, str, n);
+    ip[n] = 0;
+
+    int port = atoi(colon + 1);
+    memset(ss, 0, sizeof(*ss));
+
+    struct sockaddr_in *v4 = (struct sockaddr_in *)ss;
+    if (inet_pton(AF_INET, ip, &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(port);
+        *len = sizeof(struct sockaddr_in);
+        return 0;
+    }
+
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)ss;
+    if (inet_pton(AF_INET6, ip, &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(port);
+        *len = sizeof(struct sockaddr_in6);
+        return 0;
+    }
+
+    return -1;
+}
+
+int sock_addr_format(const struct sockaddr_storage *ss, char *buf, size_t size) {
+    char ip[INET6_ADDRSTRLEN];
+
+    if (ss->ss_family == AF_INET) {
+        const struct sockaddr_in *v4 = (const struct sockaddr_in *)ss;
+        inet_ntop(AF_INET, &v4->sin_addr, ip, sizeof(ip));
+        return snprintf(buf, size, "%s:%u", ip, ntohs(v4->sin_port));
+    }
+
+    if (ss->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *v6 = (const struct sockaddr_in6 *)ss;
+        inet_ntop(AF_INET6, &v6->sin6_addr, ip, sizeof(ip));
+        return snprintf(buf, size, "[%s]:%u", ip, ntohs(v6->sin6_port));
+    }
+
+    if (ss->ss_family == AF_UNIX) {
+        const struct sockaddr_un *un = (const struct sockaddr_un *)ss;
+        return snprintf(buf, size, "%s", un->sun_path);
+    }
+
+    return snprintf(buf, size, "?");
+}
+
 int8_t is_ipv6(const char *ip) {
     size_t len = strlen(ip);
     size_t i = 0;
@@ -262,12 +983,11 @@ int tcp_server_create(const char *ip_str, uint16_t port, int backlog) {
     int domain = AF_INET;
     if (is_ipv6(ip_str)) domain = AF_INET6;
 
-    int fd = socket(domain, SOCK_STREAM, 0);
+    int fd = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (fd < 0) {
         ERR("socket fail");
         goto _FAILE;
     }
-    if (set_nonblock(fd) < 0) goto _FAILE;
 
     int reuseaddr = 1;
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(reuseaddr)) < 0) {
@@ -329,9 +1049,8 @@ int tcp_client_create(const char *ip_str, uint16_t port, int8_t *is_connected) {
     if (is_ipv6(ip_str)) domain = AF_INET6;
     if (is_connected) *is_connected = 0;
 
-    int fd = socket(domain, SOCK_STREAM, 0);
+    int fd = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (fd < 0) return -1;
-    if (set_nonblock(fd) < 0) goto _FAILE;
 
     if (domain == AF_INET) {
         struct sockaddr_in addr;
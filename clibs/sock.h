@@ -13,6 +13,7 @@ extern "C" {
 #include <sys/uio.h>
 #include <sys/un.h>
 
+#include "rbuf.h"
 #include "util.h"
 
 #define SOCKET_TYPE_MASK 0xf0
@@ -31,32 +32,82 @@ typedef enum {
 
 } sock_type_t;
 
-struct netaddr {
-    char ip[64];
-    uint16_t port;
-};
+#define SOCK_MMSG_MAX 64       // datagrams per recv_batch/send_batch call
+#define SOCK_DGRAM_SIZE 4096   // receive room per datagram, longer ones are truncated
+#define SOCK_GRO_BATCH 8       // coalesced receives per call with UDP_GRO on
+#define SOCK_GRO_SIZE 65536    // receive room per coalesced datagram
+#define SOCK_GSO_SEGS 64       // UDP_MAX_SEGMENTS of older kernels
+#define SOCK_GSO_MAX 65507     // udp payload limit for one GSO send
 
+// preallocated recvmmsg/sendmmsg state, allocated by the first batch call
+typedef struct sock_mmsg sock_mmsg_t;
+
+/*
+ * I/O counters, bumped by every sock_* call that touches the fd. Each socket
+ * keeps its own and the per-thread sock_totals sum them up, so closed
+ * sockets still count there. accepted is only set on listening sockets,
+ * closed (connections, not listeners) only in sock_totals.
+ */
+typedef struct sock_stats {
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t rx_eagain;
+    uint64_t tx_eagain;
+    uint64_t accepted;
+    uint64_t closed;
+} sock_stats_t;
+
+extern __thread sock_stats_t sock_totals;
+
+/*
+ * a socket is kept small: no address is stored, sock_peer() asks the kernel
+ * when somebody actually wants to know.
+ */
 typedef struct sock {
     int fd;
-    int domain;
-    sock_type_t type;
+    uint8_t type;  // sock_type_t
     int8_t is_connected;
-    union {
-        struct netaddr net;
-        char upath[108];
-    } addr;
+    rbuf_t *rbuf;       // receive buffer, allocated by the first framed read
+    sock_mmsg_t *mmsg;  // datagram batches, allocated by the first batch call
+    sock_stats_t stats;
 } sock_t;
 
 void sock_tostring(sock_t *self);
 int sock_init(sock_t *self, const char *info);
+void sock_mmsg_free(sock_t *self);
 inline static void sock_term(sock_t *self) {
+    if (self->fd > 0 && (self->type == SOCK_TCP_CLIENT || self->type == SOCK_UNIX_CLIENT)) sock_totals.closed++;
     safe_close(self->fd);
+    if (self->rbuf) {
+        rbuf_free(self->rbuf);
+        safe_free(self->rbuf);
+    }
+    sock_mmsg_free(self);
     memset(self, 0, sizeof(sock_t));
+    self->fd = -1;
 }
 
 int sock_accept(sock_t *self, sock_t *cli);
+// accept up to max pending connections into clis, 0 if none is pending
+int sock_accept_batch(sock_t *self, sock_t *clis, int max);
+// wrap an already connected tcp fd (e.g. one accepted by io_uring)
+int sock_from_fd(sock_t *self, int fd);
+// wrap a listening tcp fd, e.g. one inherited from the process that bound it
+int sock_from_listen_fd(sock_t *self, int fd);
+// "ip:port", "[ip6]:port" or the unix path of the peer into buf, -1 on error
+int sock_peer(sock_t *self, char *buf, size_t size);
 int sock_write(sock_t *self, void *data, size_t len);
+// gather write, bytes written or 0 when the socket buffer is full
+int sock_writev(sock_t *self, const struct iovec *iov, int cnt);
 int sock_read(sock_t *self, void *data, size_t size);
+// rbuf_fill() on the socket's receive buffer (allocated by the caller)
+ssize_t sock_fill(sock_t *self, size_t want);
+/*
+ * kernel to kernel copy of count bytes of in_fd from *offset (advanced by
+ * what was sent). Returns bytes sent, 0 when the socket buffer is full,
+ * -1 on error.
+ */
+int sock_sendfile(sock_t *self, int in_fd, off_t *offset, size_t count);
 
 inline static int sock_fd(sock_t *self) { return self->fd; }
 
@@ -66,10 +117,57 @@ inline static void sock_close(sock_t *self) { safe_close(self->fd); }
 
 inline static int sock_set_nonblock(sock_t *self) { return set_nonblock(sock_fd(self)); }
 
+/*
+ * let reads and epoll waits on this socket busy poll the device queue for up
+ * to us microseconds (SO_BUSY_POLL), prefer: ask the kernel to keep
+ * interrupts off while the application polls (SO_PREFER_BUSY_POLL, 5.11+).
+ * Raising us above net.core.busy_read needs CAP_NET_ADMIN.
+ */
+int sock_set_busy_poll(sock_t *self, int us, int prefer);
+
+/*
+ * cpu steering of a SO_REUSEPORT group. sock_steer_by_cpu() attaches a
+ * classic BPF program (SO_ATTACH_REUSEPORT_CBPF) to the group of the
+ * listener self: a connection whose packets arrive on cpu c goes to the
+ * (c % n)th listener of the group, counting in the order they were bound.
+ * Pin the worker behind listener k to cpu k and softirq, socket and handler
+ * share one core. On a listener SO_INCOMING_CPU names the cpu it prefers
+ * (kernels without the program still use it, 6.1+), on a connection
+ * sock_incoming_cpu() tells where its packets are received, -1 on error.
+ */
+int sock_steer_by_cpu(sock_t *self, int n);
+int sock_set_incoming_cpu(sock_t *self, int cpu);
+int sock_incoming_cpu(sock_t *self);
+
 inline static void sock_lcopy(sock_t *src, sock_t *dst) {
     if (src && dst) memcpy(dst, src, sizeof(sock_t));
 }
 
+/*
+ * fd-indexed slab every long-lived sock_t lives in. Slots sit in fixed
+ * pages, so a sock_t never moves, and carry a generation bumped on every
+ * add and release: a handle of (fd, gen) outlives its socket safely, even
+ * after the fd number was reused. Pages are installed lock-free, a slot is
+ * only touched by the thread that owns the fd, sock_slab_detach() and a
+ * message to another thread hand that ownership over. A release frees the
+ * slot before it closes the fd, the next owner of the number finds it free.
+ */
+#define SOCK_SLAB_PAGE_SHIFT 10
+#define SOCK_SLAB_PAGES 4096  // fds up to 4M
+
+// move src (an initialized sock with a valid fd) into the slot of its fd
+sock_t *sock_slab_add(const sock_t *src, uint32_t *gen);
+// the sock behind a handle, NULL once it was released or its slot reused
+sock_t *sock_slab_get(int fd, uint32_t gen);
+// sock_term() and free the slot
+void sock_slab_release(sock_t *self);
+/*
+ * free the slot like sock_slab_release() but leave the fd open and return
+ * it, for handing the connection to another thread. Buffered bytes are
+ * dropped with the sock, take them out first.
+ */
+int sock_slab_detach(sock_t *self);
+
 /**
  *Desc: new a sock_t object.
  *Argument:
@@ -82,24 +180,84 @@ inline static void sock_lcopy(sock_t *src, sock_t *dst) {
  *Return: sock_t *
  */
 inline static sock_t *sock_new(const char *info) {
-    sock_t *self = (sock_t *)MALLOC(sizeof(sock_t));
-    if (self) {
-        if (sock_init(self, info) < 0) {
-            DBG("sock_init fail");
-            safe_free(self);
-        }
+    sock_t sk;
+    if (sock_init(&sk, info) < 0) {
+        DBG("sock_init fail");
+        return NULL;
     }
 
+    sock_t *self = sock_slab_add(&sk, NULL);
+    if (self == NULL) sock_term(&sk);
     return self;
 }
 
 inline static void sock_destroy(sock_t **p_self) {
     if (p_self && *p_self) {
-        sock_term(*p_self);
-        safe_free(*p_self);
+        sock_slab_release(*p_self);
+        *p_self = NULL;
     }
 }
 
+/*
+ * one direction of a socket to socket relay: bytes are spliced from src
+ * into a pipe and from there into dst, they never reach user space.
+ */
+#define SOCK_PIPE_SIZE (256 * 1024)    // requested pipe capacity
+#define SOCK_PUMP_BUDGET (1024 * 1024) // bytes per sock_pump() call, for fairness
+
+#define SOCK_PUMP_IN 0x01   // src has nothing more right now, wait for EPOLLIN
+#define SOCK_PUMP_OUT 0x02  // dst is full with bytes still in the pipe, wait for EPOLLOUT
+#define SOCK_PUMP_EOF 0x04  // src reached EOF and everything was delivered
+
+typedef struct sock_pipe {
+    int fds[2];
+    size_t pending;  // bytes sitting in the pipe
+    int8_t eof;
+} sock_pipe_t;
+
+int sock_pipe_init(sock_pipe_t *self);
+inline static void sock_pipe_term(sock_pipe_t *self) {
+    safe_close(self->fds[0]);
+    safe_close(self->fds[1]);
+    self->pending = 0;
+}
+
+/*
+ * move what is available from src to dst. Returns the bytes delivered to
+ * dst, or -1 on error, and sets *state to the SOCK_PUMP_* bits telling
+ * what to wait for. *state == 0 means the budget ran out with more to do.
+ */
+int sock_pump(sock_pipe_t *self, sock_t *src, sock_t *dst, int *state);
+
+/*
+ * datagram batches over the preallocated self->mmsg arrays. recv takes up
+ * to n datagrams, read them back with sock_mmsg_data()/sock_mmsg_peer().
+ * send transmits the n messages put in place by sock_mmsg_set(), peer NULL
+ * for a connected socket. Both return the count, 0 when the socket would
+ * block, -1 on error.
+ */
+int sock_recv_batch(sock_t *self, int n);
+const char *sock_mmsg_data(sock_t *self, int i, size_t *len);
+int sock_mmsg_peer(sock_t *self, int i, char *buf, size_t size);
+
+int sock_mmsg_set(sock_t *self, int i, const void *data, size_t len, const char *peer);
+int sock_send_batch(sock_t *self, int n);
+
+/*
+ * segmentation offload. With UDP_GRO on, the kernel may hand over several
+ * datagrams of one flow as a single buffer, sock_mmsg_segsize() is then the
+ * size they were cut at (the last may be shorter), 0 for a plain datagram.
+ * sock_send_gso() sends data as seg sized datagrams, up to 64 per syscall,
+ * and returns the bytes sent (0 when the socket buffer is full).
+ */
+int sock_set_gro(sock_t *self, int on);
+int sock_mmsg_segsize(sock_t *self, int i);
+int sock_send_gso(sock_t *self, const char *data, size_t len, uint16_t seg, const char *peer);
+
+// "ip:port" / "[ip6]:port" <-> sockaddr
+int sock_addr_parse(const char *str, struct sockaddr_storage *ss, socklen_t *len);
+int sock_addr_format(const struct sockaddr_storage *ss, char *buf, size_t size);
+
 int8_t is_ipv6(const char *ip);
 
 int tcp_server_create(const char *ip_str, uint16_t port, int backlog);
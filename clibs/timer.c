@@ -0,0 +1,143 @@
+#include "timer.h"
+
+#include <time.h>
+
+#define TIMER_L0_MASK (TIMER_L0_SIZE - 1)
+#define TIMER_LN_MASK (TIMER_LN_SIZE - 1)
+#define TIMER_MAX_DELTA 0xffffffffULL
+
+uint64_t timer_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(timer_wheel_t *self) {
+    int i, j;
+    for (i = 0; i < TIMER_L0_SIZE; i++) timer_list_init(&self->l0[i]);
+    for (i = 0; i < TIMER_LEVELS; i++)
+        for (j = 0; j < TIMER_LN_SIZE; j++) timer_list_init(&self->ln[i][j]);
+
+    self->count = 0;
+    self->now = timer_now_ms();
+}
+
+static void timer_list_append(timer_node_t *head, timer_node_t *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void timer_list_unlink(timer_node_t *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+}
+
+static void timer_place(timer_wheel_t *self, timer_node_t *node) {
+    uint64_t expire = node->expire;
+    timer_node_t *head;
+
+    if (expire < self->now) {
+        head = &self->l0[self->now & TIMER_L0_MASK];
+    } else {
+        uint64_t delta = expire - self->now;
+        if (delta < TIMER_L0_SIZE) {
+            head = &self->l0[expire & TIMER_L0_MASK];
+        } else {
+            if (delta > TIMER_MAX_DELTA) expire = self->now + TIMER_MAX_DELTA;
+
+            int level = 0;
+            while (level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_L0_BITS + (level + 1) * TIMER_LN_BITS)))
+                level++;
+            head = &self->ln[level][(expire >> (TIMER_L0_BITS + level * TIMER_LN_BITS)) & TIMER_LN_MASK];
+        }
+    }
+
+    timer_list_append(head, node);
+}
+
+void timer_add(timer_wheel_t *self, timer_node_t *node, uint32_t ms) {
+    if (timer_pending(node)) timer_del(self, node);
+
+    node->expire = timer_now_ms() + ms;
+    timer_place(self, node);
+    self->count++;
+}
+
+void timer_del(timer_wheel_t *self, timer_node_t *node) {
+    if (!timer_pending(node)) return;
+
+    timer_list_unlink(node);
+    self->count--;
+}
+
+int timer_next_timeout(timer_wheel_t *self) {
+    if (!self->count) return -1;
+
+    // exact within level 0, otherwise wake up for the next cascade
+    int idx = self->now & TIMER_L0_MASK;
+    int i;
+    for (i = idx; i < TIMER_L0_SIZE; i++) {
+        if (!timer_list_empty(&self->l0[i])) break;
+    }
+
+    uint64_t due = self->now + (i - idx);
+    uint64_t now = timer_now_ms();
+    return due > now ? (int)(due - now) : 0;
+}
+
+static void timer_cascade(timer_wheel_t *self, int level, int idx) {
+    timer_node_t list;
+    timer_node_t *head = &self->ln[level][idx];
+    if (timer_list_empty(head)) return;
+
+    // detach the whole slot first, nodes may land back in the same level
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    timer_list_init(head);
+
+    while (!timer_list_empty(&list)) {
+        timer_node_t *node = list.next;
+        timer_list_unlink(node);
+        timer_place(self, node);
+    }
+}
+
+int timer_expire(timer_wheel_t *self, timer_node_t *expired) {
+    uint64_t now = timer_now_ms();
+    int n = 0;
+
+    if (!self->count) {
+        if (now >= self->now) self->now = now + 1;
+        return 0;
+    }
+
+    while (self->now <= now) {
+        int idx = self->now & TIMER_L0_MASK;
+        if (idx == 0) {
+            int level;
+            for (level = 0; level < TIMER_LEVELS; level++) {
+                int j = (self->now >> (TIMER_L0_BITS + level * TIMER_LN_BITS)) & TIMER_LN_MASK;
+                timer_cascade(self, level, j);
+                if (j != 0) break;
+            }
+        }
+
+        timer_node_t *head = &self->l0[idx];
+        while (!timer_list_empty(head)) {
+            timer_node_t *node = head->next;
+            timer_list_unlink(node);
+            timer_list_append(expired, node);
+            self->count--;
+            n++;
+        }
+
+        self->now++;
+    }
+
+    return n;
+}
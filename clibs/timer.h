@@ -0,0 +1,68 @@
+#ifndef CLIBS_TIMER_H_
+#define CLIBS_TIMER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * hierarchical timing wheel with 1ms ticks: 256 slots for the next 256ms,
+ * then 4 levels of 64 slots each covering up to 2^32ms. Add and delete are
+ * O(1), far timers are cascaded down a level at a time as the wheel turns,
+ * so a few hundred thousand idle deadlines cost nothing until they are due.
+ *
+ * nodes are intrusive, the owner embeds a timer_node_t and keeps it alive
+ * while it is pending.
+ */
+
+#define TIMER_L0_BITS 8
+#define TIMER_LN_BITS 6
+#define TIMER_L0_SIZE (1 << TIMER_L0_BITS)
+#define TIMER_LN_SIZE (1 << TIMER_LN_BITS)
+#define TIMER_LEVELS 4
+
+typedef struct timer_node {
+    struct timer_node *prev;
+    struct timer_node *next;
+    uint64_t expire;  // absolute, in ms of timer_now_ms()
+} timer_node_t;
+
+typedef struct timer_wheel {
+    uint64_t now;  // next tick to run
+    size_t count;  // pending timers
+    timer_node_t l0[TIMER_L0_SIZE];
+    timer_node_t ln[TIMER_LEVELS][TIMER_LN_SIZE];
+} timer_wheel_t;
+
+uint64_t timer_now_ms(void);
+
+void timer_wheel_init(timer_wheel_t *self);
+
+inline static void timer_list_init(timer_node_t *head) { head->prev = head->next = head; }
+inline static int timer_list_empty(timer_node_t *head) { return head->next == head; }
+inline static int timer_pending(timer_node_t *node) { return node->next != NULL; }
+
+void timer_add(timer_wheel_t *self, timer_node_t *node, uint32_t ms);
+void timer_del(timer_wheel_t *self, timer_node_t *node);
+
+/*
+ * ms until the wheel has something to do, -1 if nothing is pending. Far
+ * timers are only looked at when they cascade, so this may return early
+ * (at most 256ms) with nothing due yet.
+ */
+int timer_next_timeout(timer_wheel_t *self);
+
+/*
+ * run the wheel up to now, moving every due node onto the expired list
+ * (a timer_list_init()ed head). Returns the number of nodes moved.
+ */
+int timer_expire(timer_wheel_t *self, timer_node_t *expired);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // CLIBS_TIMER_H_
@@ -0,0 +1,400 @@
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "epoll.h"
+#include "util.h"
+
+#define URING_OP_POLL 1
+#define URING_OP_REMOVE 2
+#define URING_OP_READ 3
+#define URING_OP_WRITE 4
+#define URING_OP_ACCEPT 5
+
+// user_data layout: op(8) | gen(24) | fd(32)
+#define URING_UDATA(op, gen, fd) \
+    (((uint64_t)(op) << 56) | (((uint64_t)(gen)&0xffffff) << 32) | (uint32_t)(fd))
+#define URING_UDATA_OP(u) ((int)((u) >> 56))
+#define URING_UDATA_GEN(u) ((uint32_t)(((u) >> 32) & 0xffffff))
+#define URING_UDATA_FD(u) ((int)(uint32_t)(u))
+
+// flags epoll understands but poll does not
+#define URING_POLL_IGNORE (EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE | EPOLLWAKEUP)
+
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags,
+                              void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int uring_init(uring_t *self, unsigned int entries) {
+    struct io_uring_params p;
+    MEMSET(p);
+    MEMSET_P(self);
+    self->ring_fd = -1;
+
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 2;
+    int fd = sys_io_uring_setup(entries, &p);
+    if (fd < 0) {
+        DBG("io_uring_setup fail: %s", strerror(errno));
+        return -1;
+    }
+
+    // the timeout of uring_wait() relies on IORING_ENTER_EXT_ARG (5.11+)
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        DBG("io_uring lacks IORING_FEAT_EXT_ARG");
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    self->ring_fd = fd;
+    self->features = p.features;
+    self->sq_entries = p.sq_entries;
+
+    self->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    self->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (self->cq_len > self->sq_len) self->sq_len = self->cq_len;
+        self->cq_len = self->sq_len;
+    }
+
+    self->sq_ptr = mmap(NULL, self->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (self->sq_ptr == MAP_FAILED) goto _FAILE;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        self->cq_ptr = self->sq_ptr;
+    } else {
+        self->cq_ptr =
+            mmap(NULL, self->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (self->cq_ptr == MAP_FAILED) goto _FAILE;
+    }
+
+    self->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    self->sqes = mmap(NULL, self->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (self->sqes == MAP_FAILED) goto _FAILE;
+
+    char *sq = (char *)self->sq_ptr;
+    self->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    self->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    self->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    self->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+    char *cq = (char *)self->cq_ptr;
+    self->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    self->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    self->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    self->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+_FAILE:
+    ERR("io_uring mmap fail");
+    uring_exit(self);
+    return -1;
+}
+
+void uring_exit(uring_t *self) {
+    if (self->sqes && self->sqes != MAP_FAILED) munmap(self->sqes, self->sqes_len);
+    if (self->cq_ptr && self->cq_ptr != MAP_FAILED && self->cq_ptr != self->sq_ptr) munmap(self->cq_ptr, self->cq_len);
+    if (self->sq_ptr && self->sq_ptr != MAP_FAILED) munmap(self->sq_ptr, self->sq_len);
+    safe_free(self->slots);
+    safe_close(self->ring_fd);
+    MEMSET_P(self);
+    self->ring_fd = -1;
+}
+
+static int uring_flush(uring_t *self) {
+    while (self->sq_pending) {
+        int ret = sys_io_uring_enter(self->ring_fd, self->sq_pending, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        self->sq_pending -= ret;
+    }
+
+    return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_t *self) {
+    unsigned int tail = *self->sq_tail;
+    if (tail - smp_load_acquire(self->sq_head) >= self->sq_entries) {
+        // ring full, hand the backlog to the kernel before queueing more
+        if (uring_flush(self) < 0) return NULL;
+        if (tail - smp_load_acquire(self->sq_head) >= self->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    unsigned int idx = tail & *self->sq_mask;
+    struct io_uring_sqe *sqe = &self->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    self->sq_array[idx] = idx;
+    smp_store_release(self->sq_tail, tail + 1);
+    self->sq_pending++;
+    return sqe;
+}
+
+static int uring_slot_reserve(uring_t *self, int fd) {
+    if (fd < self->nslots) return 0;
+
+    int size = self->nslots ? self->nslots : 1024;
+    while (size <= fd) size <<= 1;
+
+    uring_slot_t *slots = (uring_slot_t *)realloc(self->slots, sizeof(uring_slot_t) * size);
+    if (slots == NULL) return -1;
+
+    memset(slots + self->nslots, 0, sizeof(uring_slot_t) * (size - self->nslots));
+    self->slots = slots;
+    self->nslots = size;
+    return 0;
+}
+
+static int uring_arm(uring_t *self, int fd) {
+    uring_slot_t *slot = &self->slots[fd];
+    struct io_uring_sqe *sqe = uring_get_sqe(self);
+    if (sqe == NULL) return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = slot->events & ~URING_POLL_IGNORE;
+    if (slot->events & EPOLLET) sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_UDATA(URING_OP_POLL, slot->gen, fd);
+    slot->armed = 1;
+    return 0;
+}
+
+static int uring_disarm(uring_t *self, int fd) {
+    uring_slot_t *slot = &self->slots[fd];
+    if (slot->armed) {
+        struct io_uring_sqe *sqe = uring_get_sqe(self);
+        if (sqe == NULL) return -1;
+
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = URING_UDATA(URING_OP_POLL, slot->gen, fd);
+        sqe->user_data = URING_UDATA(URING_OP_REMOVE, 0, fd);
+        slot->armed = 0;
+    }
+
+    slot->gen++;
+    return 0;
+}
+
+int uring_fd_add(uring_t *self, int fd, uint32_t event, uint64_t data) {
+    if (uring_slot_reserve(self, fd) < 0) return -1;
+
+    uring_slot_t *slot = &self->slots[fd];
+    if (slot->events) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    slot->events = event ? event : EPOLLERR;
+    slot->data = data;
+    slot->gen++;
+    return uring_arm(self, fd);
+}
+
+int uring_fd_mod(uring_t *self, int fd, uint32_t event, uint64_t data) {
+    if (fd >= self->nslots || self->slots[fd].events == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (uring_disarm(self, fd) < 0) return -1;
+
+    uring_slot_t *slot = &self->slots[fd];
+    slot->events = event ? event : EPOLLERR;
+    slot->data = data;
+    return uring_arm(self, fd);
+}
+
+int uring_fd_del(uring_t *self, int fd) {
+    if (fd >= self->nslots || self->slots[fd].events == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (uring_disarm(self, fd) < 0) return -1;
+    self->slots[fd].events = 0;
+    return 0;
+}
+
+int uring_submit_read(uring_t *self, int fd, void *buf, size_t len) {
+    struct io_uring_sqe *sqe = uring_get_sqe(self);
+    if (sqe == NULL) return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = URING_UDATA(URING_OP_READ, 0, fd);
+    return 0;
+}
+
+int uring_submit_write(uring_t *self, int fd, const void *buf, size_t len) {
+    struct io_uring_sqe *sqe = uring_get_sqe(self);
+    if (sqe == NULL) return -1;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_UDATA(URING_OP_WRITE, 0, fd);
+    return 0;
+}
+
+int uring_submit_accept(uring_t *self, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(self);
+    if (sqe == NULL) return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_UDATA(URING_OP_ACCEPT, 0, fd);
+    return 0;
+}
+
+int uring_submit_cancel(uring_t *self, int fd, uint32_t done) {
+    int op;
+    if (done & REACTOR_DONE_READ)
+        op = URING_OP_READ;
+    else if (done & REACTOR_DONE_WRITE)
+        op = URING_OP_WRITE;
+    else if (done & REACTOR_DONE_ACCEPT)
+        op = URING_OP_ACCEPT;
+    else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(self);
+    if (sqe == NULL) return -1;
+
+    // the cancelled request still completes, with -ECANCELED
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = URING_UDATA(op, 0, fd);
+    sqe->user_data = URING_UDATA(URING_OP_REMOVE, 0, fd);
+    return 0;
+}
+
+// translate one cqe, returns 1 if it produced an event
+static int uring_reap_one(uring_t *self, struct io_uring_cqe *cqe, struct epoll_event *ev) {
+    uint64_t udata = cqe->user_data;
+    int fd = URING_UDATA_FD(udata);
+
+    switch (URING_UDATA_OP(udata)) {
+        case URING_OP_POLL: {
+            if (fd >= self->nslots) return 0;
+            uring_slot_t *slot = &self->slots[fd];
+            if (slot->events == 0 || URING_UDATA_GEN(udata) != (slot->gen & 0xffffff)) return 0;
+
+            if (!(cqe->flags & IORING_CQE_F_MORE)) slot->armed = 0;
+            if (cqe->res <= 0) {
+                // the kernel ended the poll on its own, e.g. on overflow: it is still wanted
+                if (cqe->res == 0 || cqe->res == -ECANCELED) {
+                    if (!slot->armed) uring_arm(self, fd);
+                    return 0;
+                }
+
+                // the fd itself failed, report it like epoll would
+                ev->events = EPOLLERR;
+                ev->data.u64 = slot->data;
+                return 1;
+            }
+
+            // re-arm, level-triggered unless the caller asked for EPOLLONESHOT
+            if (!slot->armed && !(slot->events & EPOLLONESHOT)) uring_arm(self, fd);
+            ev->events = cqe->res;
+            ev->data.u64 = slot->data;
+            return 1;
+        }
+
+        case URING_OP_READ:
+            ev->events = REACTOR_DONE_READ;
+            break;
+        case URING_OP_WRITE:
+            ev->events = REACTOR_DONE_WRITE;
+            break;
+        case URING_OP_ACCEPT:
+            ev->events = REACTOR_DONE_ACCEPT;
+            break;
+        default:
+            return 0;
+    }
+
+    ev->data.u64 = ((uint64_t)(uint32_t)cqe->res << 32) | (uint32_t)fd;
+    return 1;
+}
+
+static int uring_reap(uring_t *self, struct epoll_event *events, int size) {
+    int n = 0;
+    unsigned int head = *self->cq_head;
+    unsigned int tail = smp_load_acquire(self->cq_tail);
+
+    while (head != tail && n < size) {
+        struct io_uring_cqe *cqe = &self->cqes[head & *self->cq_mask];
+        n += uring_reap_one(self, cqe, &events[n]);
+        head++;
+    }
+
+    smp_store_release(self->cq_head, head);
+    return n;
+}
+
+int uring_wait(uring_t *self, struct epoll_event *events, int size, int64_t timeout_us) {
+    struct timespec deadline;
+    if (timeout_us > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_us / 1000000;
+        deadline.tv_nsec += (timeout_us % 1000000) * 1000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    while (1) {
+        int n = uring_reap(self, events, size);
+        if (n > 0) return n;
+
+        struct __kernel_timespec ts = {0, 0};
+        struct io_uring_getevents_arg arg;
+        MEMSET(arg);
+        unsigned int flags = IORING_ENTER_GETEVENTS;
+        if (timeout_us >= 0) {
+            if (timeout_us > 0) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                long left = (deadline.tv_sec - now.tv_sec) * 1000000000L + (deadline.tv_nsec - now.tv_nsec);
+                if (left < 0) left = 0;
+                ts.tv_sec = left / 1000000000L;
+                ts.tv_nsec = left % 1000000000L;
+            }
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+
+        int ret = sys_io_uring_enter(self->ring_fd, self->sq_pending, 1, flags, timeout_us >= 0 ? &arg : NULL,
+                                     timeout_us >= 0 ? sizeof(arg) : 0);
+        if (ret < 0 && errno != ETIME) return -1;
+        if (ret > 0) self->sq_pending -= ret;
+
+        n = uring_reap(self, events, size);
+        if (n > 0 || timeout_us == 0) return n;
+        if (ret < 0) return 0;  // ETIME
+    }
+}
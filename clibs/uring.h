@@ -0,0 +1,82 @@
+#ifndef CLIBS_URING_H_
+#define CLIBS_URING_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/*
+ * a minimal io_uring reactor driven by raw syscalls (no liburing).
+ *
+ * readiness is emulated with IORING_OP_POLL_ADD: a one-shot poll re-armed
+ * after every completion gives epoll level-triggered semantics, EPOLLET maps
+ * to a multishot poll. Re-arms and read/write/accept submissions are only
+ * queued, they reach the kernel together with the next uring_wait(), so a
+ * whole round of socket work costs one io_uring_enter.
+ */
+
+typedef struct uring_slot {
+    uint64_t data;    // epoll_data_t handed back with readiness events
+    uint32_t events;  // requested mask, 0 if fd is not registered
+    uint32_t gen;     // bumped on every re-registration, filters stale cqes
+    int8_t armed;     // a poll sqe is in flight
+} uring_slot_t;
+
+typedef struct uring {
+    int ring_fd;
+    unsigned int features;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_entries;
+    unsigned int sq_pending;  // queued but not yet handed to the kernel
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+
+    uring_slot_t *slots;  // indexed by fd
+    int nslots;
+} uring_t;
+
+int uring_init(uring_t *self, unsigned int entries);
+void uring_exit(uring_t *self);
+
+int uring_fd_add(uring_t *self, int fd, uint32_t event, uint64_t data);
+int uring_fd_mod(uring_t *self, int fd, uint32_t event, uint64_t data);
+int uring_fd_del(uring_t *self, int fd);
+
+int uring_submit_read(uring_t *self, int fd, void *buf, size_t len);
+int uring_submit_write(uring_t *self, int fd, const void *buf, size_t len);
+int uring_submit_accept(uring_t *self, int fd);
+// cancel the in-flight read/write/accept (a REACTOR_DONE_* bit) on fd
+int uring_submit_cancel(uring_t *self, int fd, uint32_t done);
+
+/*
+ * submit everything queued and reap up to size completions into events.
+ * Readiness shows up exactly like epoll_wait would report it, finished
+ * submissions carry one of the REACTOR_DONE_* bits (see epoll.h) with the
+ * fd in the low and the result in the high 32 bits of data.u64.
+ * timeout_us is in microseconds, -1 waits forever.
+ */
+int uring_wait(uring_t *self, struct epoll_event *events, int size, int64_t timeout_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // CLIBS_URING_H_
@@ -1,5 +1,8 @@
+#define _GNU_SOURCE
 #include "util.h"
 
+#include <sched.h>
+
 int set_nonblock(int fd) {
     int val;
     if ((val = fcntl(fd, F_GETFL, 0)) == -1) {
@@ -18,6 +21,29 @@ int set_nonblock(int fd) {
     return 0;
 }
 
+int set_cpu_affinity(int cpu) {
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    // pid 0 is the calling thread, not the whole process
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        ERR("sched_setaffinity cpu=%d fail", cpu);
+        return -1;
+    }
+    return 0;
+}
+
+int cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
 // read until timeout, error, specific size.
 int Read(int fd, void *data, size_t size) {
     if (fd < 0 || data == NULL) {
@@ -68,3 +94,28 @@ _AGAIN:
 
     return ret;
 }
+
+int Writev(int fd, const struct iovec *iov, int cnt) {
+    if (fd < 0 || iov == NULL) {
+        DBG("invalid args");
+        return -1;
+    }
+
+    if (cnt <= 0) return 0;
+
+    ssize_t ret = -1;
+_AGAIN:
+    ret = writev(fd, iov, cnt);
+    if (ret < 0) {
+        if (errno == EINTR) goto _AGAIN;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            DBG("EAGAIN");
+            return 0;
+        }
+
+        return -1;
+    }
+
+    return ret;
+}
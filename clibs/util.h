@@ -15,6 +15,7 @@
 #include <sys/stat.h>
 #include <sys/times.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
@@ -90,8 +91,13 @@ extern "C" {
 #define MEMSET_P(p) memset(p, 0, sizeof(*(p)))
 
 int set_nonblock(int fd);
+// pin the calling thread to cpu, see sched_setaffinity(2)
+int set_cpu_affinity(int cpu);
+// online cpus, at least 1
+int cpu_count(void);
 int Read(int fd, void *data, size_t size);
 int Write(int fd, void *data, size_t len);
+int Writev(int fd, const struct iovec *iov, int cnt);
 
 #ifdef __cplusplus
 }
@@ -2,85 +2,498 @@ module(..., package.seeall)
 
 local epoll = require("epoll")
 local sock = require("sock")
+local sys = require("sys")
+local bit = require("bit")
 
 if not epoll then error("require epoll fail") end
 if not sock then error("require sock fail") end
+if not sys then error("require sys fail") end
 print(sock.version())
 print(epoll.version())
 
+-- FFI fast paths for the hot sock/epoll methods where LuaJIT allows it,
+-- COSOCK_NO_FFI=1 keeps the classic C bindings only
+if not os.getenv("COSOCK_NO_FFI") then
+    local ok, sockffi = pcall(require, "sockffi")
+    if ok then sockffi.enable() end
+end
+
 local ep, err = epoll.create(1024)
 if err then error(err) end
+local backend = "epoll"
+
+-- busy polling, see set_busy_poll()
+local spin_us = 0
+local sock_busy_us = nil
+
+-- the offload completion queue registered with ep, see offload()
+local offq = nil
+
+-- spin for spin_us microseconds after activity before the loop blocks in
+-- the kernel again: requests that arrive meanwhile skip the wakeup, at the
+-- price of a core spinning. sock_us additionally sets SO_BUSY_POLL (with
+-- SO_PREFER_BUSY_POLL) on every accepted or connected socket, best effort:
+-- values above net.core.busy_read need CAP_NET_ADMIN. 0 turns it off.
+function set_busy_poll(us, sock_us)
+    spin_us = us or 0
+    sock_busy_us = sock_us and sock_us > 0 and sock_us or nil
+    return ep:busy_poll(spin_us)
+end
+
+-- swap in a reactor of another backend ("epoll" or "uring"), must be called
+-- before any tcp_listen/tcp_connect. With "uring" reads, writes and accepts
+-- are completions, a whole round of them costs one io_uring_enter. Returns
+-- the backend actually in use, io_uring falls back to epoll when unusable.
+function set_backend(name)
+    local r, err = epoll.create(1024, name)
+    if err then return nil, err end
+
+    ep:close()
+    ep = r
+    backend = ep:backend()
+    ep:busy_poll(spin_us)
+    offq = nil  -- registered with the old reactor
+    return backend
+end
+
+local is_uring = function(r)
+    return r:backend() == "uring"
+end
+
+-- how readiness mode sockets are polled, see set_trigger()
+local edge = false
+local EDGE_MASK = epoll.EPOLLIN + epoll.EPOLLOUT + epoll.EPOLLET + epoll.EPOLLRDHUP
+local WAKE_ANY = epoll.EPOLLERR + epoll.EPOLLHUP + epoll.EPOLLRDHUP
+
+-- "level" (default) or "edge", must be called before any tcp_listen or
+-- tcp_connect. Level-triggered sockets are re-armed for the direction they
+-- wait in. Edge-triggered ones are registered once for both directions and
+-- never touched again, a coroutine only waits after its call hit EAGAIN and
+-- sleeps through edges of the other direction. Only affects the epoll
+-- backend, io_uring client sockets run on completions. Returns the mode.
+function set_trigger(name)
+    if name ~= "edge" and name ~= "level" then return nil, "invalid trigger" end
+    edge = name == "edge"
+    return name
+end
+
+-- yield until the running coroutine is resumed again, for at most ms when
+-- ms is given. Returns the resume values, ev == epoll.TIMEOUT on expiry.
+local wait = function(r, ms)
+    if not ms then return coroutine.yield() end
+
+    local h, err = r:timer(ms, coroutine.running())
+    if err then error(err) end
+
+    local ev, res, data = coroutine.yield()
+    if ev ~= epoll.TIMEOUT then r:cancel(h) end
+    return ev, res, data
+end
+
+-- suspend the running coroutine for ms, the rest of the loop keeps going.
+-- Yielding epoll.PARKED tells ep:run() the coroutine waits for no fd: a
+-- socket of it that still wakes it meanwhile is muted until its next wait.
+function sleep(ms)
+    local co = coroutine.running()
+    if not co then error("sleep outside of a coroutine") end
+
+    local _, err = ep:timer(ms, co)
+    if err then error(err) end
+
+    repeat
+        local ev = coroutine.yield(epoll.PARKED)
+    until ev == epoll.TIMEOUT
+end
 
-local fd_to_co = {_size = 0}
+-- the fd -> coroutine registry lives in ep, ep:run() resumes them from C
 local add_co = function (fd, co)
-    fd_to_co[fd] = co
-    fd_to_co._size = fd_to_co._size + 1
+    local _, err = ep:bind(fd, co)
+    if err then error(err) end
 end
 local del_co = function (fd)
-    fd_to_co[fd] = nil 
-    fd_to_co._size = fd_to_co._size - 1
+    ep:unbind(fd)
+end
+
+-- coroutine -> obj of the connection it handles, see drop_sock()
+local serving = setmetatable({}, {__mode = "k"})
+
+-- what run() does for a coroutine that failed, for the resumes done from
+-- Lua: unbind the fd of its connection (obj, may be nil) and close it
+local drop_sock = function(obj)
+    if not obj or obj._fd == -1 then return end
+    if obj._reg then obj._r:del(obj._fd) end
+    del_co(obj._fd)
+    obj._sk:close()
+    obj._fd = -1
+end
+
+-- blocking work runs on the offload pool, its results come back through a
+-- completion queue per reactor, created by the first offload(). The
+-- coroutine draining it is bound only while tasks are out, so it does not
+-- keep loop() going.
+local off_co = nil
+local off_waiting = {}  -- task id -> coroutine
+local off_pending = 0
+local off_id = 0
+local OFFLOADED = {}    -- resume value of a finished task
+
+local offload_queue = function()
+    if offq then return offq end
+    local q, err = require("offload").queue()
+    if err then error(err) end
+    local fd = q:fd()
+
+    local _, err = ep:attach(fd, epoll.EPOLLIN)
+    if err then error(err) end
+
+    off_co = coroutine.create(function()
+        while true do
+            local id, res, err = q:poll()
+            if not id then
+                coroutine.yield()
+            else
+                local co = off_waiting[id]
+                off_waiting[id] = nil
+                off_pending = off_pending - 1
+                if off_pending == 0 then del_co(fd) end
+
+                if co then
+                    local ok, e = coroutine.resume(co, OFFLOADED, res, err)
+                    if not ok then
+                        print("offload resume fail: " .. tostring(e))
+                        drop_sock(serving[co])
+                    end
+                end
+            end
+        end
+    end)
+    coroutine.resume(off_co)
+    offq = q
+    return q
+end
+
+-- run the blocking task name with up to 4 string arguments on the offload
+-- pool: read_file(path), write_file(path, data [, "a"]), resolve(host) or
+-- one a C module registered with offload_register(). Only the calling
+-- coroutine waits, the loop goes on. Returns the result string, or nil, err.
+-- The pool has 4 threads unless require("offload").start(n) said otherwise.
+function offload(name, ...)
+    local co = coroutine.running()
+    if not co then error("offload outside of a coroutine") end
+    local q = offload_queue()
+
+    off_id = off_id % 0x7fffffff + 1
+    local id = off_id
+    local _, err = q:submit(id, name, ...)
+    if err then return nil, err end
+
+    off_waiting[id] = co
+    off_pending = off_pending + 1
+    if off_pending == 1 then
+        -- unbinding moved the fd to a new generation, register it in that
+        add_co(q:fd(), off_co)
+        ep:modify(q:fd(), epoll.EPOLLIN)
+    end
+
+    -- whatever else wakes the caller meanwhile is not for this call, parked
+    -- like in sleep()
+    local ev, res, err
+    repeat
+        ev, res, err = coroutine.yield(epoll.PARKED)
+    until ev == OFFLOADED
+    return res, err
 end
-local active_fd_nums = function()
-    return fd_to_co._size
+
+function read_file(path)
+    return offload("read_file", path)
+end
+
+-- append: add to the file instead of replacing it. Returns bytes written.
+function write_file(path, data, append)
+    local n, err = offload("write_file", path, data, append and "a" or "w")
+    return tonumber(n), err
+end
+
+-- the addresses of host, a list of ip strings
+function resolve(host)
+    local ips, err = offload("resolve", host)
+    if not ips then return nil, err end
+
+    local t = {}
+    for ip in ips:gmatch("[^\n]+") do t[#t + 1] = ip end
+    return t
+end
+
+-- an address sock.new() takes as is, no name to resolve
+local is_address = function(host)
+    return host == "*" or host:find(":", 1, true) ~= nil or host:match("^%d+%.%d+%.%d+%.%d+$") ~= nil
 end
 
-local make_sock = function(r, sk)
+-- the ip to connect to for host, v6 in the brackets sock.new() expects
+local lookup = function(host)
+    if is_address(host) then return host end
+
+    local ips, err = resolve(host)
+    if not ips then return nil, err end
+    local ip = ips[1]
+    return ip:find(":", 1, true) and "[" .. ip .. "]" or ip
+end
+
+-- connection migration between runtime threads, see balance()
+local MIGRATE = {}            -- resume value that moves a parked handler away
+local MIGRATED = "migrated"   -- error unwinding the handler on the way out
+local MSG_USER, MSG_STEAL, MSG_CONN = 0, 1, 2  -- inbox message tags
+local parked = {}     -- fd -> obj of movable connections waiting for input
+local listeners = {}  -- "ip:port" -> {f, idle} of listeners opened with migrate
+local moved = {steals = 0, migrated_in = 0, migrated_out = 0, migrate_fail = 0}
+local tick = 0        -- balance() intervals so far
+local PIN_TICKS = 20  -- a connection that just arrived stays for that many
+
+local make_sock = function(r, sk, idle)
     local r = r or ep
     local sk = sk
     if not sk then error("sk is nil") end
     local fd = sk:fd()
 
-    local obj = {_sk = sk, _r = r, _fd = fd}
-
-    -- function obj.readn(N)
-    --     local buf = {}
-    --     local n = 0
-    --     while len < N do
-    --         local data, err = obj.read()
-    --         if err then return table.concat(buf), err end
-            
-    --         table.insert(buf, data)
-    --         n = n + #data
-    --     end
-    --     return table.concat(buf)
-    -- end
-
-    function obj.read(self, flag)
+    -- idle: default read deadline in ms, a connection that stays quiet that
+    -- long gets "idle" from read() so its handler can drop it
+    -- _reg: fd is registered with the reactor (readiness mode only), which
+    -- happens the first time the socket has to wait, not at accept
+    -- _edge: that registration is the edge-triggered one for both directions
+    local obj = {_sk = sk, _r = r, _fd = fd, _uring = is_uring(r), _idle = idle, _reg = false, _edge = false}
+
+    -- wait for readiness after a non-blocking call hit EAGAIN, completion
+    -- mode never polls client fds, it registers one just for this wait
+    local ready = function(self, event, timeout)
+        local _, err
+        if self._uring then
+            _, err = self._r:attach(self._fd, event)
+        else
+            _, err = self:_arm(event)
+        end
+        if err then error(err) end
+
+        -- a handler waiting for input holds nothing half done, this is
+        -- where balance() may restart it on another thread
+        local movable = self._key and not self._uring and event == epoll.EPOLLIN and (self._pin or 0) <= tick
+        if movable then parked[self._fd] = self end
+
+        local ev = wait(self._r, timeout)
+        if self._uring then self._r:del(self._fd) end
+
+        -- an edge of the other direction changes nothing for this call
+        while self._edge and ev ~= epoll.TIMEOUT and ev ~= MIGRATE and bit.band(ev, event + WAKE_ANY) == 0 do
+            ev = wait(self._r, timeout)
+        end
+
+        if movable then parked[self._fd] = nil end
+        if ev == MIGRATE then self:_migrate() end
+        return ev
+    end
+
+    -- hand the connection with its buffered bytes to thread _dest, which
+    -- starts its own handler of the listener on it, and unwind this one
+    function obj._migrate(self)
+        local fd = self._fd
+        if self._reg then self._r:del(fd) end
+        del_co(fd)
+        self._fd = -1
+
+        local fd, pending = self._sk:detach()
+        if fd then
+            local _, err = require("runtime").send(self._dest, fd .. " " .. self._key .. "\n" .. pending, MSG_CONN)
+            if err then
+                sys.close_fd(fd)
+                moved.migrate_fail = moved.migrate_fail + 1
+            else
+                moved.migrated_out = moved.migrated_out + 1
+            end
+        end
+        error(MIGRATED, 0)
+    end
+
+    -- set the interest of the fd, registering it on first use. The reactor
+    -- remembers the mask, waiting in the same direction again is free. In
+    -- edge mode the first call registers EDGE_MASK and the rest are no-ops.
+    function obj._arm(self, event)
+        if self._edge then return true end
+
+        local mask = edge and EDGE_MASK or event
+        local ok, err
+        if self._reg then
+            ok, err = self._r:modify(self._fd, mask)
+        else
+            ok, err = self._r:attach(self._fd, mask)
+        end
+        if ok then
+            self._reg = true
+            self._edge = edge
+        end
+        return ok, err
+    end
+
+    -- framed reads, see sock readn/readline/read_until: the sock buffers
+    -- natively and hands back exactly one string per frame
+    local frame = function(self, timeout, method, ...)
+        local expired = timeout and "timeout" or "idle"
+        timeout = timeout or self._idle
+
+        while true do
+            local data, err = method(self._sk, ...)
+            if data or err then return data, err end
+
+            if ready(self, epoll.EPOLLIN, timeout) == epoll.TIMEOUT then return nil, expired end
+        end
+    end
+
+    -- max: bound for n, which usually comes off the wire, see sock readn
+    function obj.readn(self, n, timeout, max)
+        return frame(self, timeout, self._sk.readn, n, max)
+    end
+
+    -- a line without its "\n" / "\r\n"
+    function obj.readline(self, timeout, max)
+        return frame(self, timeout, self._sk.readline, max)
+    end
+
+    function obj.read_until(self, delim, timeout, max)
+        return frame(self, timeout, self._sk.read_until, delim, max)
+    end
+
+    -- up to n buffered bytes, left in place until consume()
+    function obj.peek(self, n, timeout, max)
+        return frame(self, timeout, self._sk.peek, n, max)
+    end
+
+    function obj.consume(self, n)
+        return self._sk:consume(n)
+    end
+
+    -- timeout: ms to wait for data, defaults to the idle deadline if any
+    function obj.read(self, timeout)
+        local expired = timeout and "timeout" or "idle"
+        timeout = timeout or self._idle
+
+        if self._uring and self._sk:buffered() == 0 then
+            local _, err = self._r:submit_read(self._fd)
+            if err then return nil, err end
+
+            local ev, n, data = wait(self._r, timeout)
+            if ev == epoll.TIMEOUT then
+                -- the read still completes, with -ECANCELED unless data won the race
+                self._r:submit_cancel(self._fd, epoll.DONE_READ)
+                ev, n, data = coroutine.yield()
+                if n < 0 then return nil, expired end
+            end
+
+            if n < 0 then return nil, data end
+            if n == 0 then return nil, "EOF" end
+            return data, nil
+        end
+
         while true do
             local n, data, err = self._sk:read()
             if err then return data, err end
             if n == 0 then return nil, "EOF" end
             if n > 0 then return data, nil end
 
-            _, err = self._r:modify(self._fd, epoll.EPOLLIN)
-            if err then error(err) end
-            coroutine.yield()
+            if ready(self, epoll.EPOLLIN, timeout) == epoll.TIMEOUT then return nil, expired end
         end
     end
 
-    function obj.write(self, data)
-        local size = #data
+    -- data: a string, or a table of strings sent as one stream (header,
+    -- body and trailer go out in a single writev, nothing is concatenated)
+    -- timeout: ms to wait each time the socket buffer is full
+    function obj.write(self, data, timeout)
+        local vec = type(data) == "table"
 
-        local n, err = self._sk:write(data)
-        if err then return n, err end
-        local nb = n
+        if self._uring then
+            -- completion writes take one buffer
+            if vec then data = table.concat(data) end
+            local size = #data
+            local nb = 0
+            while nb < size do
+                local _, err = self._r:submit_write(self._fd, data, nb)
+                if err then return nb, err end
 
-        while nb < size do
-            if n == 0 then
-                _, err = self._r:modify(self._fd, epoll.EPOLLOUT)
-                if err then error(err) end
-                coroutine.yield()
+                local ev, n, err = wait(self._r, timeout)
+                if ev == epoll.TIMEOUT then
+                    self._r:submit_cancel(self._fd, epoll.DONE_WRITE)
+                    ev, n, err = coroutine.yield()
+                    if n < 0 then return nb, "timeout" end
+                end
+
+                if n < 0 then return nb, err end
+                nb = nb + n
+            end
+            return nb, nil
+        end
+
+        local size = 0
+        if vec then
+            for i = 1, #data do size = size + #data[i] end
+        else
+            size = #data
+        end
+
+        -- partial writes resume from offset nb, no substrings
+        local send = vec and self._sk.writev or self._sk.write
+        local nb = 0
+        while true do
+            local n, err = send(self._sk, data, nb)
+            if err then return nb, err end
+            nb = nb + n
+            if nb >= size then return nb, nil end
+
+            if n == 0 and ready(self, epoll.EPOLLOUT, timeout) == epoll.TIMEOUT then return nb, "timeout" end
+        end
+    end
+
+    -- send len bytes (default: the rest) of a file from offset, the data
+    -- goes from the page cache to the socket without entering Lua.
+    -- file: a path or an fd from sys.open(). Returns bytes sent and err.
+    function obj.sendfile(self, file, offset, len, timeout)
+        local fd, size = file, nil
+        if type(file) == "string" then
+            fd, size = sys.open(file)
+            if not fd then return 0, size end
+        end
+
+        offset = offset or 0
+        if not len then
+            if not size then
+                local err
+                size, err = sys.fsize(fd)
+                if not size then return 0, err end
             end
+            len = size - offset
+        end
 
-            n, err = self._sk:write(string.sub(data, nb, -1))
-            if err then break end
+        local nb, err = 0, nil
+        while nb < len do
+            local n
+            n, err = self._sk:sendfile(fd, offset + nb, len - nb)
+            if not n then break end
             nb = nb + n
+
+            if n == 0 and ready(self, epoll.EPOLLOUT, timeout) == epoll.TIMEOUT then
+                err = "timeout"
+                break
+            end
         end
 
+        if fd ~= file then sys.close_fd(fd) end
         return nb, err
     end
 
+    -- sockets from connect() belong to the caller and are released here,
+    -- the others are closed by the coroutine that runs their handler
     function obj.close(self)
+        if self._own and self._fd ~= -1 then
+            if self._reg then self._r:del(self._fd) end
+            del_co(self._fd)
+            self._sk:close()
+        end
         self._fd = -1
     end
 
@@ -91,35 +504,84 @@ local make_sock = function(r, sk)
     return obj
 end
 
-local do_cli = function(r, sk, f)
+-- key: "ip:port" of a listener opened with migrate, nil if it was not,
+-- pin: the balance() tick before which the connection is not moved
+local do_cli = function(r, sk, f, idle, key, pin)
     local r = r
     local sk = sk
     local fd = sk:fd()
+    if sock_busy_us then sk:set_busy_poll(sock_busy_us, true) end
 
-    r:add(fd, epoll.EPOLLERR)
-    f(make_sock(r, sk))
-    r:del(fd)
+    -- a connection served without ever blocking is never registered
+    local obj = make_sock(r, sk, idle)
+    obj._key = key
+    obj._pin = pin
+    obj._co = coroutine.running()
+    serving[obj._co] = obj
+    f(obj)
+    if obj._reg then r:del(fd) end
     sk:close()
-    del_co(tostring(fd))
+    del_co(fd)
+end
+
+-- run the new coroutine co for socket sk up to its first wait. fd is bound
+-- before: one that finishes without ever waiting unbinds it on its own way
+-- out. One that fails is unbound and sk closed, as run() would.
+local start_co = function(co, sk, ...)
+    local fd = sk:fd()
+    add_co(fd, co)
+    local ok, err = coroutine.resume(co, ...)
+    if not ok then
+        print("co at fd=" .. fd .. " fail: " .. tostring(err))
+        ep:del(fd)
+        del_co(fd)
+        sk:close()
+    end
+    return ok
 end
 
-local do_connect = function(r, sk, f)
+local do_connect = function(r, sk, f, timeout)
     local fd = sk:fd()
-    r:add(fd, epoll.EPOLLOUT + epoll.EPOLLERR)
-    local ev = coroutine.yield()
+    r:attach(fd, epoll.EPOLLOUT + epoll.EPOLLERR)
+    local ev = wait(r, timeout)
+    -- completion mode only polls for the connect itself
+    local poll = not is_uring(r)
+    if not poll then r:del(fd) end
+
     if ev == epoll.EPOLLOUT then
-        r:modify(fd, epoll.EPOLLERR)
-        f(make_sock(r, sk))
+        if sock_busy_us then sk:set_busy_poll(sock_busy_us, true) end
+        local obj = make_sock(r, sk)
+        if poll then
+            obj._reg = true
+            obj:_arm(epoll.EPOLLERR)
+        end
+        serving[coroutine.running()] = obj
+        f(obj)
+    elseif ev == epoll.TIMEOUT then
+        f(nil, "timeout")
     else
-        f(nil)
+        f(nil, "connect fail")
     end
 
-    r:del(fd)
+    if poll then r:del(fd) end
     sk:close()
-    del_co(tostring(fd))
+    del_co(fd)
 end
 
-function tcp_connect(ip, port, f)
+-- timeout: optional connect deadline in ms, f(nil, "timeout") on expiry.
+-- ip may be a host name, resolved on the offload pool first: errors past
+-- that point, name errors included, reach f as f(nil, err).
+function tcp_connect(ip, port, f, timeout)
+    if not is_address(ip) then
+        local co = coroutine.create(function()
+            local addr, err = lookup(ip)
+            if addr then err = tcp_connect(addr, port, f, timeout) end
+            if err then f(nil, err) end
+        end)
+        coroutine.resume(co)
+        return nil
+    end
+
     local r = ep
     local addr = ip .. ":" .. port
     local info = ">tcp:" .. addr
@@ -127,67 +589,530 @@ function tcp_connect(ip, port, f)
     local sk, err = sock.new(info)
     if err then return err end
 
-    local co = coroutine.create(do_connect)
-    coroutine.resume(co, r, sk, f)
-    add_co(tostring(sk:fd()), co)
+    start_co(coroutine.create(do_connect), sk, r, sk, f, timeout)
     return nil
 end
 
-function tcp_listen(ip, port, f)
+-- idle: optional ms after which a silent connection's read() gives "idle"
+-- opts.migrate: connections may be moved to other runtime threads by
+-- balance(), every thread must listen on the same ip and port with an
+-- equivalent f. f is then restarted from scratch on the new thread, any
+-- read of it that waits is a point where this can happen (the unwinding
+-- is an error, "migrated"): only for handlers keeping no state across
+-- reads and no other sockets, like most long-lived gateway connections.
+-- opts.fd: listen on this already bound fd of ip:port instead, see steer().
+function tcp_listen(ip, port, f, idle, opts)
     local addr = ip .. ":" .. port
     local info = "@tcp:" .. addr 
-    local sk, err = sock.new(info)
+    local sk, err
+    if opts and opts.fd then
+        sk, err = sock.from_listen_fd(opts.fd)
+    else
+        sk, err = sock.new(info)
+    end
     if err then error(err) end
     local r = ep
+    local uring = is_uring(r)
+    local key = nil
+    if opts and opts.migrate then
+        key = addr
+        listeners[key] = {f = f, idle = idle}
+    end
 
-    _, err = r:add(sk:fd(), epoll.EPOLLIN)
-    if err then error(err) end
+    -- accept_batch() drains the backlog until it comes back empty, which
+    -- is all edge-triggered needs
+    if not uring then
+        _, err = r:attach(sk:fd(), edge and epoll.EPOLLIN + epoll.EPOLLET or epoll.EPOLLIN)
+        if err then error(err) end
+    end
     local co = coroutine.create(function(r, sk, addr, f)
         local r = r
         local sk = sk
         local addr = addr
 
+        -- epoll mode drains the whole backlog per wakeup with accept4, in
+        -- completion mode every accept completion brings one connection
+        local accept = function()
+            if not uring then return sk:accept_batch() end
+
+            local _, err = r:submit_accept(sk:fd())
+            if err then return nil, err end
+
+            local _, new_fd, err = coroutine.yield()
+            if new_fd < 0 then return nil, err end
+
+            local new_sk, err = sock.from_fd(new_fd)
+            if err then return nil, err end
+            return {new_sk}
+        end
+
         while true do
-            local new_sk, err = sk:accept()
+            local socks, err = accept()
             if err then error(err) end
 
-            if new_sk then
-                local new_fd, err = new_sk:fd()
-                if err then error(err) end
+            for i = 1, #socks do
+                local new_sk = socks[i]
+                local new_fd = new_sk:fd()
 
-                local new_fd_str = "" .. new_fd
-                print("srv(" .. addr .. ") accept: " .. new_fd_str)
+                print("srv(" .. addr .. ") accept: " .. new_fd)
 
-                local co = coroutine.create(do_cli)
-                coroutine.resume(co, r, new_sk, f)
-                add_co(new_fd_str, co)
-            else
-                coroutine.yield()
+                start_co(coroutine.create(do_cli), new_sk, r, new_sk, f, idle, key)
             end
+
+            if #socks == 0 then coroutine.yield() end
         end
     end)
 
-    coroutine.resume(co, ep, sk, addr, f)
-    add_co(tostring(sk:fd()), co)    
+    start_co(co, sk, ep, sk, addr, f)
 end
 
-function loop()
+-- connect from inside a running coroutine, e.g. a tcp_listen handler that
+-- proxies: the socket is bound to that coroutine, release it with close().
+-- ip may be a host name, see tcp_connect().
+-- Returns the socket or nil, "timeout" | "connect fail" | a name error.
+function connect(ip, port, timeout)
+    local co = coroutine.running()
+    if not co then error("connect outside of a coroutine") end
+
+    local ip, err = lookup(ip)
+    if not ip then return nil, err end
+    local sk, err = sock.new(">tcp:" .. ip .. ":" .. port)
+    if err then return nil, err end
     local r = ep
+    local fd = sk:fd()
+
+    add_co(fd, co)
+    _, err = r:attach(fd, epoll.EPOLLOUT + epoll.EPOLLERR)
+    if err then error(err) end
+
+    local ev = wait(r, timeout)
+    if ev ~= epoll.EPOLLOUT then
+        r:del(fd)
+        del_co(fd)
+        sk:close()
+        return nil, ev == epoll.TIMEOUT and "timeout" or "connect fail"
+    end
+
+    if sock_busy_us then sk:set_busy_poll(sock_busy_us, true) end
+    local obj = make_sock(r, sk)
+    if obj._uring then
+        r:del(fd)
+    else
+        obj._reg = true
+        obj:_arm(epoll.EPOLLERR)
+    end
+    obj._own = true
+    return obj
+end
+
+-- shuttle bytes both ways between two sockets of the running coroutine
+-- until both directions reached EOF or one fails. A half-close is passed
+-- on with shutdown(), so request/response protocols keep working. The
+-- bytes are spliced through a pipe per direction and never enter Lua.
+-- idle: optional ms without any traffic after which the relay gives up.
+-- Returns bytes a->b, bytes b->a, err.
+function relay(a, b, idle)
+    local co = coroutine.running()
+    if not co then error("relay outside of a coroutine") end
+
+    local r = a._r
+    local uring = is_uring(r)
+    local dirs = {}
+    for i, d in ipairs({{a, b}, {b, a}}) do
+        local p, err = sock.pipe()
+        if err then
+            if dirs[1] then dirs[1].pipe:close() end
+            return 0, 0, err
+        end
+        dirs[i] = {src = d[1], dst = d[2], pipe = p, n = 0}
+    end
+
+    -- the reactor resumes us for readiness on either fd
+    add_co(a._fd, co)
+    add_co(b._fd, co)
+    local polled = {}
+    local interest = function(obj, mask)
+        if not uring then return obj:_arm(mask) end
+
+        local fd = obj._fd
+        if not polled[fd] then
+            r:attach(fd, mask)
+            polled[fd] = true
+        else
+            r:modify(fd, mask)
+        end
+    end
+
+    local err
     while true do
-        if active_fd_nums() == 0 then print("exit loop") return end
+        local want = {[a._fd] = 0, [b._fd] = 0}
+        local busy = false
+        local done = 0
+
+        for _, d in ipairs(dirs) do
+            if not d.eof then
+                local n, state = d.pipe:pump(d.src._sk, d.dst._sk)
+                if not n then
+                    err = state
+                    break
+                end
+
+                d.n = d.n + n
+                if state == sock.PUMP_EOF then
+                    d.eof = true
+                    d.dst._sk:shutdown("w")
+                elseif state == sock.PUMP_IN then
+                    want[d.src._fd] = want[d.src._fd] + epoll.EPOLLIN
+                elseif state == sock.PUMP_OUT then
+                    want[d.dst._fd] = want[d.dst._fd] + epoll.EPOLLOUT
+                else
+                    busy = true  -- out of budget, let others run first
+                end
+            end
+            if d.eof then done = done + 1 end
+        end
+        if err or done == 2 then break end
+
+        interest(a, want[a._fd] + epoll.EPOLLERR)
+        interest(b, want[b._fd] + epoll.EPOLLERR)
+
+        if wait(r, busy and 0 or idle) == epoll.TIMEOUT and not busy then
+            err = "idle"
+            break
+        end
+    end
+
+    for fd in pairs(polled) do r:del(fd) end
+    if not uring then
+        a:_arm(epoll.EPOLLERR)
+        b:_arm(epoll.EPOLLERR)
+    end
+    dirs[1].pipe:close()
+    dirs[2].pipe:close()
+    return dirs[1].n, dirs[2].n, err
+end
+
+-- reactor and socket counters in one flat table: ep:stats() merged with
+-- sock.stats(), io_uring completions folded into rx_bytes, tx_bytes and
+-- accepted, both buffer pools into pool_inuse and pool_cached, the
+-- migration counters (steals, migrated_in, migrated_out, migrate_fail),
+-- plus the backend and trigger in use. reset clears the counters afterwards.
+function stats(reset)
+    local t = ep:stats(reset)
+    for k, v in pairs(sock.stats(reset)) do t[k] = v end
+
+    local pool = sock.pool_stats()
+    t.pool_inuse = t.pool_inuse + pool.inuse
+    t.pool_cached = t.pool_cached + pool.cached
+
+    t.rx_bytes = t.rx_bytes + t.done_rx_bytes
+    t.tx_bytes = t.tx_bytes + t.done_tx_bytes
+    t.accepted = t.accepted + t.done_accepted
+    t.backend = backend
+    t.trigger = edge and "edge" or "level"
+    for k, v in pairs(moved) do
+        t[k] = v
+        if reset then moved[k] = 0 end
+    end
+    return t
+end
+
+function loop()
+    local _, err = ep:run()
+    if err then error(err) end
+    print("exit loop")
+end
+
+-- thread-per-core mode, see the runtime module: spawn(script [, n]) starts
+-- n threads (default one per cpu), each running the file script with
+-- (id, n, arg) as arguments in a lua_State of its own, arg is an optional
+-- string. Such a script requires
+-- cosock, which gives it a reactor of its own, sets up its listeners (one
+-- SO_REUSEPORT socket per thread) and calls loop(). The calling thread is
+-- id 0. Returns n.
+function spawn(script, n, arg)
+    return require("runtime").start(script, n, arg)
+end
+
+-- queue the string data for thread id, a copy crosses, nothing Lua does
+function send(id, data)
+    return require("runtime").send(id, data, MSG_USER)
+end
+
+local on_user = nil
+local balancing = nil  -- balance() options once it runs
+
+-- take a connection sk:detach()ed by another thread, see obj._migrate()
+local adopt = function(data)
+    local fd, key, pos = data:match("^(%d+) ([^\n]*)\n()")
+    fd = tonumber(fd)
+    local l = listeners[key]
+    if not l then
+        sys.close_fd(fd)
+        moved.migrate_fail = moved.migrate_fail + 1
+        return
+    end
+
+    -- nobody else holds the fd now: close it or the peer hangs on a dead end
+    local sk, err = sock.from_fd(fd, data:sub(pos))
+    if err then
+        sys.close_fd(fd)
+        moved.migrate_fail = moved.migrate_fail + 1
+        print("adopt fd " .. fd .. ": " .. tostring(err))
+        return
+    end
+    moved.migrated_in = moved.migrated_in + 1
+
+    -- no ping-pong: the loads get time to settle before it may move again
+    start_co(coroutine.create(do_cli), sk, ep, sk, l.f, l.idle, key, tick + PIN_TICKS)
+end
+
+-- thread thief asked for work, move up to batch parked connections over
+-- while this thread is still the more loaded one
+local donate = function(thief)
+    local runtime = require("runtime")
+    local loads = runtime.loads()
+    if not balancing or not loads[thief] or loads[runtime.id()] <= balancing.ratio * loads[thief] then return end
+
+    local n = 0
+    for fd, obj in pairs(parked) do
+        if n >= balancing.batch then break end
+        n = n + 1
+
+        parked[fd] = nil
+        obj._dest = thief
+        -- a handler failing any other way is dropped as run() would drop it
+        local ok, err = coroutine.resume(obj._co, MIGRATE)
+        if not ok and err ~= MIGRATED then
+            print("migrate fd " .. fd .. ": " .. tostring(err))
+            drop_sock(obj)
+        end
+    end
+end
+
+-- the coroutine draining this thread's inbox, started on first use. It
+-- sleeps on the inbox eventfd while the inbox is empty and keeps loop()
+-- going.
+local inbox_co = nil
+local inbox = function()
+    if inbox_co then return end
+    local runtime = require("runtime")
+    local fd, err = runtime.fd()
+    if err then error(err) end
+
+    local _, err = ep:attach(fd, epoll.EPOLLIN)
+    if err then error(err) end
+
+    inbox_co = coroutine.create(function()
+        while true do
+            local data, tag = runtime.recv()
+            if not data then
+                coroutine.yield()
+            elseif tag == MSG_CONN then
+                adopt(data)
+            elseif tag == MSG_STEAL then
+                donate(tonumber(data))
+            elseif on_user then
+                -- a failing on_message() handler must not take the inbox down
+                local ok, err = pcall(on_user, data)
+                if not ok then print("on_message: " .. tostring(err)) end
+            end
+        end
+    end)
+    add_co(fd, inbox_co)
+    local ok, err = coroutine.resume(inbox_co)
+    if not ok then
+        ep:del(fd)
+        del_co(fd)
+        inbox_co = nil
+        error(err)
+    end
+end
+
+-- after spawn(): f(data) for every message send() to this thread
+function on_message(f)
+    on_user = f
+    inbox()
+end
+
+-- work stealing between runtime threads, for connections of listeners
+-- opened with migrate. Every interval ms (default 100) the thread publishes
+-- its run-queue depth, the events one reactor wakeup hands out on average,
+-- smoothed. A thread whose depth is below the busiest one's by more than
+-- ratio (default 2), while that one is at min_depth (default 2) or more,
+-- asks it for work, and the busiest moves up to batch (default 4) of its
+-- connections waiting for input over. Every thread of the runtime that
+-- should take part calls it, readiness mode (the epoll backend) only.
+function balance(opts)
+    local opts = opts or {}
+    if backend == "uring" then return nil, "balance needs the epoll backend" end
+
+    local runtime = require("runtime")
+    local interval = opts.interval or 100
+    local min_depth = opts.min_depth or 2
+    balancing = {ratio = opts.ratio or 2, batch = opts.batch or 4}
+    inbox()
+
+    local co = coroutine.create(function()
+        local id = runtime.id()
+        local last = ep:stats()
+        local load = 0
+        local asked = -PIN_TICKS  -- tick of the last request for work
+        while true do
+            sleep(interval)
+            tick = tick + 1
 
-        local t_ev, t_fd, err = r:wait(-1)
+            local s = ep:stats()
+            local waits, events = s.waits - last.waits, s.events - last.events
+            last = s
+            -- 0 as well after somebody reset the counters
+            local depth = (waits > 0 and events >= 0) and events / waits or 0
+            load = load * 0.75 + depth * 0.25
+            runtime.set_load(load)
+
+            local loads = runtime.loads()
+            local busiest, max = nil, 0
+            for i = 0, #loads do
+                if i ~= id and loads[i] > max then busiest, max = i, loads[i] end
+            end
+            -- connections only come for listeners this thread has as well,
+            -- and the ones from the last request should show in load first
+            if next(listeners) and tick - asked >= PIN_TICKS / 4 and busiest and max >= min_depth
+                and max > balancing.ratio * load then
+                asked = tick
+                moved.steals = moved.steals + 1
+                runtime.send(busiest, tostring(id), MSG_STEAL)
+            end
+        end
+    end)
+    coroutine.resume(co)
+    return true
+end
+
+-- cpu steering for multi-worker servers: bind the n (default one per cpu)
+-- SO_REUSEPORT listeners of ip:port up front, in order, listener k
+-- preferring cpu k - 1, and attach the BPF program that hands a connection
+-- received on cpu c to listener c % n + 1. Returns their fds: worker k
+-- pins itself with pin(k - 1) and listens with tcp_listen(ip, port, f,
+-- idle, {fd = fds[k]}), so the softirq, the socket and the handler of a
+-- connection stay on one core. Call it in the master before serve{pin =
+-- true} or in thread 0 before spawn(), whose threads get the fds through
+-- arg, e.g. table.concat(fds, ","). The fds stay open in the caller, a
+-- restarted worker finds the connections queued meanwhile.
+function steer(ip, port, n)
+    local n = n or sys.cpus()
+    local fds = {}
+    local fail = function(err)
+        for k = 1, #fds do sys.close_fd(fds[k]) end
+        return nil, err
+    end
+
+    for k = 1, n do
+        local sk, err = sock.new("@tcp:" .. ip .. ":" .. port)
+        if err then return fail(err) end
+
+        -- the preference is a hint for kernels that skip the program
+        sk:set_incoming_cpu((k - 1) % sys.cpus())
+        -- once the group is complete, the program works for all of it
+        if k == n then
+            local _, err = sk:steer_by_cpu(n)
+            if err then
+                sk:close()
+                return fail(err)
+            end
+        end
+
+        -- the fd outlives the handle, in this process and in every child
+        fds[k] = sk:detach()
+    end
+    return fds
+end
+
+-- pin the calling thread, i.e. a prefork worker or a runtime thread, to
+-- cpu, counted modulo the online cpus
+function pin(cpu)
+    return sys.set_affinity(cpu % sys.cpus())
+end
+
+-- prefork mode: serve{workers = N, main = function(id) ... end}
+-- the master forks N workers and then only supervises them, restarting any
+-- that fails. Each worker starts from a fresh reactor of the same backend,
+-- calls main(id) to set up its own tcp_listen (SO_REUSEPORT lets every
+-- worker bind the same port, the kernel spreads connections) and runs loop().
+-- pin = true pins worker id to cpu id - 1 first, see steer().
+-- A worker exiting with 0 is done and stays down. One that fails within a
+-- second of its start is restarted after a backoff doubling from 100ms up
+-- to 5s, and given up on after max_fails (default 5) such failures in a
+-- row. Returns in the master once no worker is left.
+local SERVE_FAST_MS = 1000
+local SERVE_BACKOFF_MS = 100
+local SERVE_BACKOFF_MAX_MS = 5000
+
+function serve(opts)
+    local n = opts.workers or 1
+    local main = opts.main
+    if not main then error("serve: main is nil") end
+    local max_fails = opts.max_fails or 5
+
+    local workers = {}  -- pid -> worker id
+    local started = {}  -- worker id -> sys.now() of its last start
+    local fails = {}    -- worker id -> failures in a row, each shortly after its start
+    local spawn = function(id)
+        started[id] = sys.now()
+        local pid, err = sys.fork()
         if err then error(err) end
-        -- print("ep:wait ", #t_fd)
 
-        for i, ev in ipairs(t_ev) do
-            local fd = t_fd[i]
-            local co = fd_to_co[fd]
+        if pid == 0 then
+            if opts.pin then pin(id - 1) end
+            ep:close()
+            ep, err = epoll.create(1024, backend)
+            if err then error(err) end
+            -- the parent's tasks never complete here, the pool starts anew
+            offq, off_waiting, off_pending = nil, {}, 0
+            ep:busy_poll(spin_us)
+
+            local ok, err = pcall(main, id)
+            if not ok then
+                print("worker " .. id .. " main fail: " .. tostring(err))
+                os.exit(1)
+            end
+            loop()
+            os.exit(0)
+        end
+
+        workers[pid] = id
+    end
+
+    for id = 1, n do
+        fails[id] = 0
+        spawn(id)
+    end
+
+    while next(workers) do
+        local pid, code = sys.wait_child()
+        if not pid then error(code) end
+
+        local id = workers[pid]
+        if id then
+            workers[pid] = nil
+            if sys.now() - started[id] < SERVE_FAST_MS then
+                fails[id] = fails[id] + 1
+            else
+                fails[id] = 0
+            end
 
-            if co then
-                coroutine.resume(co, ev)
+            if code == 0 then
+                print("worker " .. id .. " (pid " .. pid .. ") done")
+            elseif fails[id] >= max_fails then
+                print("worker " .. id .. " (pid " .. pid .. ") exit " .. code .. ", failed " .. fails[id] .. " times in a row, giving up")
             else
-                print("co is nil at fd=" .. fd)
+                local backoff = 0
+                if fails[id] > 0 then
+                    backoff = math.min(SERVE_BACKOFF_MS * 2 ^ (fails[id] - 1), SERVE_BACKOFF_MAX_MS)
+                end
+                print("worker " .. id .. " (pid " .. pid .. ") exit " .. code .. ", restart in " .. backoff .. "ms")
+                if backoff > 0 then sys.sleep(backoff) end
+                spawn(id)
             end
         end
     end
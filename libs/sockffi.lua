@@ -0,0 +1,292 @@
+module(..., package.seeall)
+
+-- LuaJIT FFI fast paths for the hottest sock/epoll methods. enable() swaps
+-- them into the metatables the classic C modules registered, so every
+-- existing socket and reactor picks them up, and calls into the exported C
+-- functions straight from Lua: no luaL_checkudata or lua_pushlstring in
+-- the way, the compiler can trace through sk:read()/sk:write() in handler
+-- bodies. Anything off the fast path (io_uring completions, a receive
+-- buffer that has to be refilled, errors) falls through to the C method.
+--
+-- A sock userdata is a (fd, gen) handle into the sock_t slab, a handle
+-- whose socket is gone resolves to nil and takes the C method too.
+--
+-- The struct layouts below mirror sock.h, rbuf.h, epoll.h and lua_f_sock.c
+-- and have to be kept in sync with them.
+
+local ok, ffi = pcall(require, "ffi")
+if not ok then ffi = nil end
+
+local C_DEFS = [[
+typedef struct rbuf {
+    char *data;
+    size_t cap;
+    size_t head;
+    size_t tail;
+    size_t scan;
+    char sdelim[8];
+    size_t sdlen;
+} rbuf_t;
+
+typedef struct sock_stats {
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t rx_eagain;
+    uint64_t tx_eagain;
+    uint64_t accepted;
+    uint64_t closed;
+} sock_stats_t;
+
+typedef struct sock {
+    int fd;
+    uint8_t type;
+    int8_t is_connected;
+    rbuf_t *rbuf;
+    void *mmsg;
+    sock_stats_t stats;
+} sock_t;
+
+typedef struct lua_sock {
+    int fd;
+    uint32_t gen;
+} lua_sock_t;
+
+typedef union epoll_data {
+    void *ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+} epoll_data_t;
+
+typedef struct reactor_stats {
+    uint64_t waits;
+    uint64_t waits_empty;
+    uint64_t waits_full;
+    uint64_t events;
+    uint64_t hist[10];
+    uint64_t ctl_add;
+    uint64_t ctl_mod;
+    uint64_t ctl_mod_skipped;
+    uint64_t ctl_del;
+    uint64_t done_rx_bytes;
+    uint64_t done_tx_bytes;
+    uint64_t done_accepted;
+    uint64_t stale;
+    uint64_t spins;
+    uint64_t spin_hits;
+} reactor_stats_t;
+
+// the head of timer_wheel_t, only count is read
+typedef struct timer_wheel {
+    uint64_t now;
+    size_t count;
+} timer_wheel_t;
+
+typedef struct epoll_fd {
+    int epfd;
+    size_t size;
+    struct epoll_event *events;
+    int backend;
+    void *ring;
+    timer_wheel_t *timers;
+    reactor_stats_t stats;
+    void *fds;
+    int nfds;
+    uint32_t spin_us;
+    uint64_t active_ns;
+} epoll_fd_t;
+
+sock_t *sock_slab_get(int fd, uint32_t gen);
+int sock_read(sock_t *self, void *data, size_t size);
+int sock_write(sock_t *self, const void *data, size_t len);
+void rbuf_consume(rbuf_t *self, size_t n);
+ptrdiff_t rbuf_find(rbuf_t *self, const char *delim, size_t dlen);
+int epoll_fd_wait(epoll_fd_t *self, int timeout);
+char *strerror(int errnum);
+]]
+
+-- struct epoll_event is packed on x86_64 only
+local EVENT_DEF_PACKED = [[
+struct epoll_event {
+    uint32_t events;
+    epoll_data_t data;
+} __attribute__((packed));
+]]
+local EVENT_DEF = [[
+struct epoll_event {
+    uint32_t events;
+    epoll_data_t data;
+};
+]]
+
+local EAGAIN = 11
+local EINTR = 4
+local READ_SIZE = 4096
+local FRAME_MAX = 1024 * 1024  -- SOCK_FRAME_MAX of lua_f_sock.c
+local REACTOR_EPOLL = 0
+
+local enabled = false
+
+local strerror = function(C)
+    return ffi.string(C.strerror(ffi.errno()))
+end
+
+-- the same shared object require() loaded, dlopen hands back its handle
+local load_lib = function(name)
+    local path = package.searchpath(name, package.cpath)
+    if not path then return nil, "no " .. name .. " in package.cpath" end
+
+    local ok, lib = pcall(ffi.load, path)
+    if not ok then return nil, lib end
+    return lib
+end
+
+local patch_sock = function(S, C)
+    local mt = debug.getregistry()["ywh.SockMT"]
+    if not mt then return nil, "sock module not loaded" end
+    local m = mt.__index
+    local c_read, c_readn, c_readline = m.read, m.readn, m.readline
+
+    local handle_ptr = ffi.typeof("lua_sock_t *")
+    local cstr = ffi.typeof("const char *")
+    local buf = ffi.new("char[?]", READ_SIZE)
+
+    local lookup = function(sk)
+        local h = ffi.cast(handle_ptr, sk)
+        local s = S.sock_slab_get(h.fd, h.gen)
+        if s == nil then return nil end
+        return s
+    end
+
+    function m.fd(sk)
+        local s = lookup(sk)
+        if not s then return -1 end
+        return s.fd
+    end
+
+    function m.is_closed(sk)
+        local s = lookup(sk)
+        return not s or s.fd < 0
+    end
+
+    function m.read(sk)
+        local s = lookup(sk)
+        if not s or s.fd < 0 or (s.rbuf ~= nil and s.rbuf.tail > s.rbuf.head) then return c_read(sk) end
+
+        local ret = S.sock_read(s, buf, READ_SIZE)
+        if ret < 0 and ret ~= -EAGAIN then
+            return 0, nil, strerror(C) .. ": sock_read fail"
+        end
+        if ret <= 0 then return ret end
+        return ret, ffi.string(buf, ret)
+    end
+
+    function m.write(sk, data, offset)
+        local s = lookup(sk)
+        if not s or s.fd < 0 then return nil, "socket has closed" end
+
+        offset = offset or 0
+        local len = #data
+        if offset >= len then return 0 end
+
+        local ret = S.sock_write(s, ffi.cast(cstr, data) + offset, len - offset)
+        if ret < 0 then return nil, strerror(C) .. ": sock_send fail" end
+        return ret
+    end
+
+    -- framed reads: a frame that is already buffered is cut out here, the
+    -- C method only runs when the buffer has to be refilled
+    function m.readn(sk, n, max)
+        local s = lookup(sk)
+        local b = s and s.rbuf
+        if not s or b == nil or n < 0 or n > (max or FRAME_MAX) or b.tail - b.head < n then
+            return c_readn(sk, n, max)
+        end
+
+        local data = ffi.string(b.data + b.head, n)
+        S.rbuf_consume(b, n)
+        return data
+    end
+
+    function m.readline(sk, max)
+        local s = lookup(sk)
+        local b = s and s.rbuf
+        if not s or b == nil or b.tail == b.head then return c_readline(sk, max) end
+
+        local pos = tonumber(S.rbuf_find(b, "\n", 1))
+        if pos < 0 then return c_readline(sk, max) end
+
+        local p = b.data + b.head
+        local len = pos
+        if len > 0 and p[len - 1] == 13 then len = len - 1 end
+
+        local line = ffi.string(p, len)
+        S.rbuf_consume(b, pos + 1)
+        return line
+    end
+
+    return true
+end
+
+local patch_epoll = function(E, C)
+    local mt = debug.getregistry()["ywh.EpollMT"]
+    if not mt then return nil, "epoll module not loaded" end
+    local m = mt.__index
+    local c_wait_into = m.wait_into
+
+    local ep_ptr = ffi.typeof("epoll_fd_t *")
+
+    -- completions and due timers need the C side bookkeeping, only
+    -- readiness is done here
+    function m.wait_into(ep, t_ev, t_fd, timeout)
+        local e = ffi.cast(ep_ptr, ep)
+        if e.backend ~= REACTOR_EPOLL or e.timers.count > 0 then
+            return c_wait_into(ep, t_ev, t_fd, timeout)
+        end
+
+        local n = E.epoll_fd_wait(e, timeout or -1)
+        if n < 0 then
+            if ffi.errno() ~= EINTR then return nil, strerror(C) .. ": epoll_fd_wait fail" end
+            n = 0
+        end
+
+        local evs = e.events
+        for i = 0, n - 1 do
+            t_ev[i + 1] = evs[i].events
+            t_fd[i + 1] = evs[i].data.fd
+        end
+        return n
+    end
+
+    return true
+end
+
+-- patch the FFI fast paths in, once. Returns true, or nil, err when FFI is
+-- unavailable and the classic bindings stay in charge.
+function enable()
+    if enabled then return true end
+    if not ffi then return nil, "no ffi" end
+    if not jit or not jit.status() then return nil, "jit is off" end
+
+    local _, err = pcall(ffi.cdef, C_DEFS .. (ffi.arch == "x64" and EVENT_DEF_PACKED or EVENT_DEF))
+    if err then return nil, err end
+
+    local S, err = load_lib("sock")
+    if not S then return nil, err end
+    local E, err = load_lib("epoll")
+    if not E then return nil, err end
+
+    _, err = patch_sock(S, ffi.C)
+    if err then return nil, err end
+    _, err = patch_epoll(E, ffi.C)
+    if err then return nil, err end
+
+    enabled = true
+    return true
+end
+
+function is_enabled()
+    return enabled
+end
+
+return _M
@@ -0,0 +1,367 @@
+/*
+ * echo load generator: N connections spread over T threads, each keeping up
+ * to depth fixed-size requests in flight against an echo server. A request
+ * completes when its size bytes came back, its latency is the time from its
+ * first byte written to its last byte read.
+ *
+ *   ./bench -h 127.0.0.1 -p 8000 -c 64 -d 16 -s 64 -t 10 -w 1 -T 2 [-j] [-l label]
+ *
+ * Results cover the -t seconds after -w seconds of warmup. -j prints one
+ * JSON object per run, for bench.sh and anything that diffs runs.
+ */
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "../clibs/epoll.h"
+#include "../clibs/sock.h"
+
+#define BENCH_LAT_MAX 1000000  // us, one histogram bucket per us up to 1s
+#define BENCH_READ_SIZE 65536
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+typedef struct bench_conf {
+    const char *host;
+    int port;
+    int conns;
+    int depth;
+    size_t size;
+    int duration;  // s
+    int warmup;    // s
+    int threads;
+    int json;
+    const char *label;
+} bench_conf_t;
+
+typedef struct bench_conn {
+    sock_t *sk;
+    int8_t is_connected;
+    int8_t want_out;
+    uint64_t *sent;  // ring of the in-flight requests' send times, depth entries
+    int head;
+    int inflight;
+    size_t wpos;  // bytes of the last started request already written
+    size_t rpos;  // bytes of the oldest in-flight response already read
+} bench_conn_t;
+
+typedef struct bench_worker {
+    pthread_t tid;
+    int nconn;
+    bench_conn_t *conns;
+    uint64_t reqs;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t lat_over;
+    uint64_t lat_max;
+    uint64_t lat_sum;
+    uint32_t *lat;
+} bench_worker_t;
+
+static bench_conf_t conf = {
+    .host = "127.0.0.1",
+    .port = 8000,
+    .conns = 64,
+    .depth = 1,
+    .size = 64,
+    .duration = 10,
+    .warmup = 1,
+    .threads = 1,
+    .json = 0,
+    .label = "echo",
+};
+
+static char *payload;  // depth * size bytes, every request is cut from it
+static uint64_t t_begin, t_end;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record(bench_worker_t *w, uint64_t sent, uint64_t now, size_t bytes) {
+    if (sent < t_begin || now >= t_end) return;
+
+    uint64_t us = (now - sent) / 1000;
+    w->reqs++;
+    w->bytes += bytes;
+    w->lat_sum += us;
+    if (us > w->lat_max) w->lat_max = us;
+    if (us < BENCH_LAT_MAX) {
+        w->lat[us]++;
+    } else {
+        w->lat_over++;
+    }
+}
+
+// keep depth requests in flight, one write() for all that are missing
+static int conn_send(epoll_fd_t *r, bench_conn_t *c) {
+    size_t want = (size_t)(conf.depth - c->inflight) * conf.size;
+    if (c->wpos > 0) want += conf.size - c->wpos;
+    if (want == 0) return 0;
+
+    int ret = sock_write(c->sk, payload, want);
+    if (ret < 0) {
+        ERR("bench sock_write fail");
+        return -1;
+    }
+
+    uint64_t now = now_ns();
+    size_t left = ret;
+    if (c->wpos > 0) {
+        size_t n = MIN(left, conf.size - c->wpos);
+        c->wpos = (c->wpos + n) % conf.size;
+        left -= n;
+    }
+    while (left > 0) {
+        size_t n = MIN(left, conf.size);
+        c->sent[(c->head + c->inflight) % conf.depth] = now;
+        c->inflight++;
+        c->wpos = n % conf.size;
+        left -= n;
+    }
+
+    // a short write waits for EPOLLOUT, a full one goes back to EPOLLIN only
+    int8_t want_out = (size_t)ret < want;
+    if (want_out != c->want_out) {
+        c->want_out = want_out;
+        int event = EPOLLIN | EPOLLERR | (want_out ? EPOLLOUT : 0);
+        if (epoll_fd_mod(r, sock_fd(c->sk), event, c) < 0) return -1;
+    }
+    return 0;
+}
+
+static int conn_recv(bench_worker_t *w, bench_conn_t *c) {
+    static __thread char buf[BENCH_READ_SIZE];
+
+    while (1) {
+        int ret = sock_read(c->sk, buf, sizeof(buf));
+        if (ret == -EAGAIN) return 0;
+        if (ret <= 0) {
+            if (ret == 0) ERR("bench server closed fd=%d", sock_fd(c->sk));
+            return -1;
+        }
+
+        uint64_t now = now_ns();
+        c->rpos += ret;
+        while (c->rpos >= conf.size && c->inflight > 0) {
+            record(w, c->sent[c->head], now, conf.size);
+            c->head = (c->head + 1) % conf.depth;
+            c->inflight--;
+            c->rpos -= conf.size;
+        }
+        if (ret < (int)sizeof(buf)) return 0;
+    }
+}
+
+static int conn_connected(bench_conn_t *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(sock_fd(c->sk), SOL_SOCKET, SO_ERROR, (void *)&err, &len) == -1 || err) {
+        DBG("bench connect fail: err=%d", err);
+        return -1;
+    }
+
+    c->is_connected = 1;
+    return 0;
+}
+
+static void conn_drop(epoll_fd_t *r, bench_worker_t *w, bench_conn_t *c) {
+    epoll_fd_del(r, sock_fd(c->sk));
+    sock_destroy(&c->sk);
+    w->errors++;
+}
+
+static void *worker_run(void *arg) {
+    bench_worker_t *w = arg;
+    epoll_fd_t reactor;
+    if (epoll_fd_create(&reactor, w->nconn) < 0) {
+        ERR("epoll_fd_create fail");
+        return NULL;
+    }
+
+    char info[128];
+    snprintf(info, sizeof(info), ">tcp:%s:%d", conf.host, conf.port);
+
+    int alive = 0;
+    int i = 0;
+    for (i = 0; i < w->nconn; i++) {
+        bench_conn_t *c = &w->conns[i];
+        c->sk = sock_new(info);
+        if (c->sk == NULL) {
+            ERR("bench sock_new fail: %s", info);
+            w->errors++;
+            continue;
+        }
+
+        c->want_out = 1;
+        if (epoll_fd_add(&reactor, sock_fd(c->sk), EPOLLIN | EPOLLOUT | EPOLLERR, c) < 0) {
+            sock_destroy(&c->sk);
+            w->errors++;
+            continue;
+        }
+        alive++;
+    }
+
+    while (alive > 0 && now_ns() < t_end) {
+        int n = epoll_fd_wait(&reactor, 10);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ERR("epoll_fd_wait fail");
+            break;
+        }
+
+        struct epoll_event *events = epoll_events(&reactor);
+        for (i = 0; i < n; i++) {
+            bench_conn_t *c = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+
+            if (!c->is_connected && conn_connected(c) < 0) goto _DROP;
+            if ((ev & EPOLLIN) && conn_recv(w, c) < 0) goto _DROP;
+            if ((ev & (EPOLLIN | EPOLLOUT)) && conn_send(&reactor, c) < 0) goto _DROP;
+            if ((ev & EPOLLERR) && !(ev & EPOLLIN)) goto _DROP;
+            continue;
+
+        _DROP:
+            conn_drop(&reactor, w, c);
+            alive--;
+        }
+    }
+
+    for (i = 0; i < w->nconn; i++) {
+        if (w->conns[i].sk) sock_destroy(&w->conns[i].sk);
+    }
+    epoll_fd_close(&reactor);
+    return NULL;
+}
+
+static uint64_t percentile(const uint32_t *lat, uint64_t over, uint64_t total, double q) {
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank >= total) rank = total - 1;
+
+    uint64_t seen = 0;
+    uint64_t us = 0;
+    for (us = 0; us < BENCH_LAT_MAX; us++) {
+        seen += lat[us];
+        if (seen > rank) return us;
+    }
+    return over ? BENCH_LAT_MAX : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-h host] [-p port] [-c connections] [-d depth] [-s size]\n"
+            "          [-t seconds] [-w warmup seconds] [-T threads] [-j] [-l label]\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:d:s:t:w:T:jl:")) != -1) {
+        switch (opt) {
+            case 'h': conf.host = optarg; break;
+            case 'p': conf.port = atoi(optarg); break;
+            case 'c': conf.conns = atoi(optarg); break;
+            case 'd': conf.depth = atoi(optarg); break;
+            case 's': conf.size = strtoul(optarg, NULL, 10); break;
+            case 't': conf.duration = atoi(optarg); break;
+            case 'w': conf.warmup = atoi(optarg); break;
+            case 'T': conf.threads = atoi(optarg); break;
+            case 'j': conf.json = 1; break;
+            case 'l': conf.label = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (conf.conns <= 0 || conf.depth <= 0 || conf.size == 0 || conf.duration <= 0 || conf.warmup < 0 ||
+        conf.threads <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (conf.threads > conf.conns) conf.threads = conf.conns;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    payload = MALLOC(conf.depth * conf.size);
+    assert(payload);
+    memset(payload, 'x', conf.depth * conf.size);
+
+    t_begin = now_ns() + (uint64_t)conf.warmup * 1000000000ull;
+    t_end = t_begin + (uint64_t)conf.duration * 1000000000ull;
+
+    bench_worker_t *workers = MALLOC(conf.threads * sizeof(bench_worker_t));
+    assert(workers);
+    memset(workers, 0, conf.threads * sizeof(bench_worker_t));
+
+    int i = 0;
+    for (i = 0; i < conf.threads; i++) {
+        bench_worker_t *w = &workers[i];
+        w->nconn = conf.conns / conf.threads + (i < conf.conns % conf.threads);
+        w->conns = calloc(w->nconn, sizeof(bench_conn_t));
+        w->lat = calloc(BENCH_LAT_MAX, sizeof(uint32_t));
+        assert(w->conns && w->lat);
+
+        int j = 0;
+        for (j = 0; j < w->nconn; j++) {
+            w->conns[j].sent = calloc(conf.depth, sizeof(uint64_t));
+            assert(w->conns[j].sent);
+        }
+
+        if (pthread_create(&w->tid, NULL, worker_run, w) != 0) {
+            ERR("pthread_create fail");
+            return 1;
+        }
+    }
+
+    // fold every worker into the first one
+    bench_worker_t *all = &workers[0];
+    for (i = 0; i < conf.threads; i++) {
+        bench_worker_t *w = &workers[i];
+        pthread_join(w->tid, NULL);
+        if (w == all) continue;
+
+        all->reqs += w->reqs;
+        all->bytes += w->bytes;
+        all->errors += w->errors;
+        all->lat_over += w->lat_over;
+        all->lat_sum += w->lat_sum;
+        if (w->lat_max > all->lat_max) all->lat_max = w->lat_max;
+
+        int us = 0;
+        for (us = 0; us < BENCH_LAT_MAX; us++) all->lat[us] += w->lat[us];
+    }
+
+    double secs = conf.duration;
+    uint64_t p50 = 0, p99 = 0, p999 = 0, mean = 0;
+    if (all->reqs > 0) {
+        p50 = percentile(all->lat, all->lat_over, all->reqs, 0.50);
+        p99 = percentile(all->lat, all->lat_over, all->reqs, 0.99);
+        p999 = percentile(all->lat, all->lat_over, all->reqs, 0.999);
+        mean = all->lat_sum / all->reqs;
+    }
+
+    if (conf.json) {
+        printf("{\"label\":\"%s\",\"host\":\"%s\",\"port\":%d,\"connections\":%d,\"depth\":%d,\"size\":%zu,"
+               "\"threads\":%d,\"duration\":%d,\"requests\":%" PRIu64 ",\"errors\":%" PRIu64
+               ",\"rps\":%.1f,\"bytes_per_sec\":%.1f,"
+               "\"latency_us\":{\"mean\":%" PRIu64 ",\"p50\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64
+               ",\"max\":%" PRIu64 "}}\n",
+               conf.label, conf.host, conf.port, conf.conns, conf.depth, conf.size, conf.threads, conf.duration,
+               all->reqs, all->errors, all->reqs / secs, all->bytes / secs, mean, p50, p99, p999, all->lat_max);
+    } else {
+        printf("%s: %d conns x depth %d, %zu bytes, %d threads, %ds\n", conf.label, conf.conns, conf.depth,
+               conf.size, conf.threads, conf.duration);
+        printf("  requests  %" PRIu64 " (%" PRIu64 " errors)\n", all->reqs, all->errors);
+        printf("  req/s     %.1f\n", all->reqs / secs);
+        printf("  bytes/s   %.1f\n", all->bytes / secs);
+        printf("  latency   mean %" PRIu64 "us  p50 %" PRIu64 "us  p99 %" PRIu64 "us  p999 %" PRIu64
+               "us  max %" PRIu64 "us\n",
+               mean, p50, p99, p999, all->lat_max);
+    }
+
+    return all->reqs > 0 ? 0 : 1;
+}
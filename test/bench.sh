@@ -0,0 +1,61 @@
+#!/bin/sh
+# echo benchmark over loopback against the C reactor (srv.c), the raw Lua
+# loop (srv2.lua) and cosock (srv.lua), using the clibs of this tree.
+#
+#   ./bench.sh [srv.c] [srv2.lua] [srv.lua]
+#
+# Knobs come from the environment: CONNS, DEPTH, SIZE, DURATION, WARMUP,
+# THREADS, PORT (the servers listen on 8000), LUAJIT and BENCH_OUT. Every
+# run appends one JSON object to $BENCH_OUT (bench.json) and prints it.
+
+cd "$(dirname "$0")"
+
+CONNS=${CONNS:-64}
+DEPTH=${DEPTH:-16}
+SIZE=${SIZE:-64}
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-1}
+THREADS=${THREADS:-2}
+PORT=${PORT:-8000}
+LUAJIT=${LUAJIT:-luajit}
+BENCH_OUT=${BENCH_OUT:-bench.json}
+
+TARGETS=${*:-"srv.c srv2.lua srv.lua"}
+
+make -C ../clibs >/dev/null || exit 1
+make bench srv >/dev/null || exit 1
+
+export LD_LIBRARY_PATH="../clibs${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}"
+export LUA_CPATH="../clibs/lib?.so;;"
+export LUA_PATH="../libs/?.lua;;"
+
+wait_port() {
+    i=0
+    while [ $i -lt 50 ]; do
+        ./bench -p "$PORT" -c 1 -t 1 -w 0 >/dev/null 2>&1 && return 0
+        sleep 0.1
+        i=$((i + 1))
+    done
+    return 1
+}
+
+for target in $TARGETS; do
+    case "$target" in
+        *.c) ./"${target%.c}" >/dev/null 2>&1 & ;;
+        *.lua) "$LUAJIT" "$target" >/dev/null 2>&1 & ;;
+        *) echo "unknown target: $target" >&2; exit 1 ;;
+    esac
+    pid=$!
+
+    if ! wait_port; then
+        echo "$target did not come up on port $PORT" >&2
+        kill "$pid" 2>/dev/null
+        exit 1
+    fi
+
+    ./bench -p "$PORT" -c "$CONNS" -d "$DEPTH" -s "$SIZE" -t "$DURATION" -w "$WARMUP" \
+        -T "$THREADS" -j -l "$target" | tee -a "$BENCH_OUT"
+
+    kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+done
@@ -0,0 +1,120 @@
+#include <poll.h>
+#include <pthread.h>
+
+#include "../clibs/chan.h"
+#include "../clibs/util.h"
+#include "check.h"
+
+#define PRODUCERS 4
+#define PER_PRODUCER 200000
+
+typedef struct {
+    chan_t *ch;
+    int id;
+} producer_t;
+
+static void *produce(void *arg) {
+    producer_t *p = (producer_t *)arg;
+    int i;
+    for (i = 0; i < PER_PRODUCER; i++) {
+        // bursts with pauses, so the consumer really goes to sleep in between
+        if (i % 1000 == 0) usleep(100);
+        CHECK(chan_send(p->ch, p->id, &i, sizeof(i)) == 0);
+    }
+    return NULL;
+}
+
+// every message arrives once, in order per sender, and none is left asleep
+static void test_mpsc(void) {
+    chan_t ch;
+    CHECK(chan_init(&ch) == 0);
+
+    pthread_t tids[PRODUCERS];
+    producer_t ps[PRODUCERS];
+    int next[PRODUCERS] = {0};
+    int i, got = 0, lost = 0;
+
+    for (i = 0; i < PRODUCERS; i++) {
+        ps[i].ch = &ch;
+        ps[i].id = i;
+        pthread_create(&tids[i], NULL, produce, &ps[i]);
+    }
+
+    while (got < PRODUCERS * PER_PRODUCER) {
+        chan_msg_t *msg = chan_recv(&ch);
+        if (msg == NULL) {
+            // armed: a sender has to signal, a silent timeout is a lost wakeup
+            struct pollfd pfd = {chan_fd(&ch), POLLIN, 0};
+            if (poll(&pfd, 1, 2000) == 0) {
+                lost = 1;
+                break;
+            }
+            continue;
+        }
+
+        int seq;
+        memcpy(&seq, msg->data, sizeof(seq));
+        CHECK(msg->len == sizeof(seq));
+        CHECK(msg->tag >= 0 && msg->tag < PRODUCERS);
+        if (msg->tag >= 0 && msg->tag < PRODUCERS) {
+            CHECK(seq == next[msg->tag]);
+            next[msg->tag] = seq + 1;
+        }
+        chan_msg_free(msg);
+        got++;
+    }
+    CHECK(!lost);
+
+    for (i = 0; i < PRODUCERS; i++) pthread_join(tids[i], NULL);
+    CHECK(chan_recv(&ch) == NULL);
+    CHECK(ch.sent == PRODUCERS * PER_PRODUCER);
+    CHECK(ch.received == PRODUCERS * PER_PRODUCER);
+    CHECK(ch.wakeups <= ch.sent);
+    chan_term(&ch);
+}
+
+// a busy consumer is not signalled, an armed one is, exactly once
+static void test_wakeup(void) {
+    chan_t ch;
+    CHECK(chan_init(&ch) == 0);
+
+    CHECK(chan_send(&ch, 7, "a", 1) == 0);
+    CHECK(ch.wakeups == 0);
+
+    chan_msg_t *msg = chan_recv(&ch);
+    CHECK(msg && msg->tag == 7 && msg->len == 1 && msg->data[0] == 'a');
+    chan_msg_free(msg);
+
+    CHECK(chan_recv(&ch) == NULL);  // arms
+    CHECK(chan_send(&ch, 0, "b", 1) == 0);
+    CHECK(chan_send(&ch, 0, "c", 1) == 0);
+    CHECK(ch.wakeups == 1);
+
+    struct pollfd pfd = {chan_fd(&ch), POLLIN, 0};
+    CHECK(poll(&pfd, 1, 0) == 1);
+
+    int n = 0;
+    while ((msg = chan_recv(&ch)) != NULL) {
+        chan_msg_free(msg);
+        n++;
+    }
+    CHECK(n == 2);
+
+    // messages still queued are freed with the channel
+    CHECK(chan_send(&ch, 0, "d", 1) == 0);
+    chan_term(&ch);
+}
+
+// what the senders write shares no cache line with what the consumer writes
+static void test_layout(void) {
+    CHECK(offsetof(chan_t, tail) % 64 == 0);
+    CHECK(offsetof(chan_t, received) < offsetof(chan_t, tail));
+    CHECK(offsetof(chan_t, sent) > offsetof(chan_t, tail) && offsetof(chan_t, wakeups) > offsetof(chan_t, tail));
+}
+
+int main(void) {
+    test_layout();
+    test_wakeup();
+    test_mpsc();
+    return CHECK_DONE("chan");
+}
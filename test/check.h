@@ -0,0 +1,23 @@
+#ifndef TEST_CHECK_H_
+#define TEST_CHECK_H_
+
+#include <stdio.h>
+
+/*
+ * minimal assertions for the C unit tests: a failed CHECK() is reported and
+ * counted, the test goes on, CHECK_DONE() is its exit status.
+ */
+static int check_failures;
+
+#define CHECK(cond)                                                               \
+    do {                                                                          \
+        if (!(cond)) {                                                            \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            check_failures++;                                                     \
+        }                                                                         \
+    } while (0)
+
+#define CHECK_DONE(name)                                                  \
+    (printf("%s: %s\n", name, check_failures ? "FAIL" : "ok"), check_failures ? 1 : 0)
+
+#endif  // TEST_CHECK_H_
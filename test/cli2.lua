@@ -10,14 +10,13 @@ if err then error(err) end
 local cli_fd, err = cli:fd()
 if err then error(err) end
 
-local cli_fd_str = "" .. cli_fd
-print("cli fd=".. cli_fd_str)
+print("cli fd=".. cli_fd)
 
 _, err = ep:add(cli_fd, epoll.EPOLLOUT)
 if err then error(err) end
 
 local fd_to_sk = {}
-fd_to_sk[cli_fd_str] = {sk = cli, cnt = 1, name="C1"}
+fd_to_sk[cli_fd] = {sk = cli, cnt = 1, name="C1"}
 
 
 local cli, err = sock.new(">tcp:127.0.0.1:8000")
@@ -29,9 +28,8 @@ if err then error(err) end
 _, err = ep:add(cli_fd, epoll.EPOLLOUT)
 if err then error(err) end
 
-local cli_fd_str = "" .. cli_fd
-print("cli fd=".. cli_fd_str)
-fd_to_sk[cli_fd_str] = {sk = cli, cnt = 1, name="C2"}
+print("cli fd=".. cli_fd)
+fd_to_sk[cli_fd] = {sk = cli, cnt = 1, name="C2"}
 
 function do_cli(r, c, ev)
     local sk = c.sk
@@ -48,7 +46,7 @@ function do_cli(r, c, ev)
         if (cnt > 5) then
             r:del(sk:fd())
             sk:close()
-            fd_to_sk["" .. sk:fd()] = nil
+            fd_to_sk[sk:fd()] = nil
             return
         end
 
@@ -61,7 +59,7 @@ function do_cli(r, c, ev)
         if err then
             r:del(sk:fd())
             sk:close()
-            fd_to_sk["" .. sk:fd()] = nil
+            fd_to_sk[sk:fd()] = nil
             print(err)
             return
         end
@@ -75,7 +73,7 @@ function do_cli(r, c, ev)
             print("EOF")
             r:del(sk:fd())
             sk:close()
-            fd_to_sk["" .. sk:fd()] = nil
+            fd_to_sk[sk:fd()] = nil
             return
         end
 
@@ -87,13 +85,14 @@ function do_cli(r, c, ev)
     print("unknow ev: ", ev)
 end
 
+local t_ev, t_fd = {}, {}
 while true do
-    local t_ev, t_fd, err = ep:wait(-1)
+    local n, err = ep:wait_into(t_ev, t_fd, -1)
     if err then error(err) end
-    print("ep:wait ", #t_fd)
+    print("ep:wait ", n)
 
-    for i, ev in ipairs(t_ev) do
-        local fd = t_fd[i]
+    for i = 1, n do
+        local ev, fd = t_ev[i], t_fd[i]
         local c = fd_to_sk[fd]
         if c == nil then error("sk is nil at fd=" .. fd) end
 
@@ -0,0 +1,46 @@
+-- a due ep:timer() fires under a plain wait/wait_into loop, not only run()
+local epoll = require("epoll")
+
+local failures = 0
+local check = function(cond, what)
+    if not cond then
+        print("FAIL: " .. what)
+        failures = failures + 1
+    end
+end
+
+local loop = function(name, wait)
+    local ep, err = epoll.create(64)
+    if err then error(err) end
+
+    local fired = 0
+    local co = coroutine.create(function()
+        local r = coroutine.yield()
+        if r == epoll.TIMEOUT then fired = fired + 1 end
+    end)
+    coroutine.resume(co)
+    ep:timer(20, co)
+
+    -- each wait is cut short to the deadline, so a handful is plenty; a
+    -- loop that never expires the timer spins at timeout 0 forever
+    local waits = 0
+    while fired == 0 and waits < 1000 do
+        wait(ep)
+        waits = waits + 1
+    end
+    check(fired == 1, name .. ": timer fired")
+    check(waits < 10, name .. ": " .. waits .. " waits")
+    ep:close()
+end
+
+local t_ev, t_fd = {}, {}
+loop("wait", function(ep) return ep:wait(1000) end)
+loop("wait_into", function(ep) return ep:wait_into(t_ev, t_fd, 1000) end)
+
+local ok, ffi = pcall(require, "sockffi")
+if ok and ffi.enable() then
+    loop("ffi wait_into", function(ep) return ep:wait_into(t_ev, t_fd, 1000) end)
+end
+
+if failures > 0 then os.exit(1) end
+print("epoll_timer_test: ok")
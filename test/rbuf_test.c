@@ -0,0 +1,99 @@
+#include <unistd.h>
+
+#include "../clibs/rbuf.h"
+#include "../clibs/util.h"
+#include "check.h"
+
+#define FIND(b, d) rbuf_find(b, d, sizeof(d) - 1)
+#define APPEND(b, s) rbuf_append(b, s, sizeof(s) - 1)
+
+// a readline() miss must not hide a different delimiter that is buffered
+static void test_mixed_delimiters(void) {
+    rbuf_t b = {0};
+
+    APPEND(&b, "abc|def");
+    CHECK(FIND(&b, "\n") == -1);
+    CHECK(FIND(&b, "|") == 3);
+
+    rbuf_consume(&b, 4);
+    APPEND(&b, "hdr\r\nx");
+    CHECK(FIND(&b, "\r\n\r\n") == -1);
+    CHECK(FIND(&b, "\n") == 7);
+    CHECK(FIND(&b, "\r\n\r\n") == -1);
+    CHECK(FIND(&b, "def") == 0);
+
+    rbuf_free(&b);
+}
+
+// the same delimiter resumes, also when it straddles the previous search end
+static void test_resume(void) {
+    rbuf_t b = {0};
+
+    APPEND(&b, "ab\r\n\r");
+    CHECK(FIND(&b, "\r\n\r\n") == -1);
+    APPEND(&b, "\nrest");
+    CHECK(FIND(&b, "\r\n\r\n") == 2);
+
+    rbuf_consume(&b, 6);
+    CHECK(rbuf_len(&b) == 4);
+    CHECK(FIND(&b, "\r\n\r\n") == -1);
+    APPEND(&b, "\r\n\r\n");
+    CHECK(FIND(&b, "\r\n\r\n") == 4);
+
+    rbuf_free(&b);
+}
+
+// delimiters too long to remember are searched from head
+static void test_long_delimiter(void) {
+    rbuf_t b = {0};
+
+    APPEND(&b, "xx--boundary-");
+    CHECK(FIND(&b, "--boundary--") == -1);
+    CHECK(FIND(&b, "--boundary") == 2);
+    APPEND(&b, "-tail");
+    CHECK(FIND(&b, "--boundary--") == 2);
+
+    rbuf_free(&b);
+}
+
+// frames cut from a pipe with readline / read_until / readn style calls
+static void test_fill_framing(void) {
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    set_nonblock(fds[0]);
+
+    rbuf_t b = {0};
+    const char in[] = "line one\nk=v|5:hello";
+    CHECK(write(fds[1], in, sizeof(in) - 1) == sizeof(in) - 1);
+    CHECK(rbuf_fill(&b, fds[0], 0) == sizeof(in) - 1);
+
+    ssize_t n = FIND(&b, "\n");
+    CHECK(n == 8 && memcmp(rbuf_peek(&b), "line one", 8) == 0);
+    rbuf_consume(&b, n + 1);
+
+    CHECK(FIND(&b, "\n") == -1);
+    n = FIND(&b, "|");
+    CHECK(n == 3 && memcmp(rbuf_peek(&b), "k=v", 3) == 0);
+    rbuf_consume(&b, n + 1);
+
+    n = FIND(&b, ":");
+    CHECK(n == 1);
+    rbuf_consume(&b, n + 1);
+    CHECK(rbuf_len(&b) == 5 && memcmp(rbuf_peek(&b), "hello", 5) == 0);
+
+    // a drained buffer holds no storage
+    rbuf_consume(&b, 5);
+    CHECK(b.data == NULL && rbuf_len(&b) == 0);
+    CHECK(rbuf_fill(&b, fds[0], 0) == -EAGAIN);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(void) {
+    test_mixed_delimiters();
+    test_resume();
+    test_long_delimiter();
+    test_fill_framing();
+    return CHECK_DONE("rbuf");
+}
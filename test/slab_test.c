@@ -0,0 +1,143 @@
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../clibs/sock.h"
+#include "check.h"
+
+#define RACE_THREADS 4
+#define RACE_ROUNDS 20000
+
+static int fd_open(int fd) { return fcntl(fd, F_GETFD) >= 0; }
+
+// NULL on failure, callers CHECK() it: this also runs on the churn threads
+static sock_t *slab_add_fd(int fd, uint32_t *gen) {
+    sock_t sk;
+    if (sock_from_fd(&sk, fd) < 0) return NULL;
+    return sock_slab_add(&sk, gen);
+}
+
+// handles resolve while their socket lives, release closes and invalidates
+static void test_handles(void) {
+    int sv[2];
+    uint32_t gen, gen2;
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    sock_t *sk = slab_add_fd(sv[0], &gen);
+    CHECK(sk && sock_fd(sk) == sv[0]);
+    CHECK(sock_slab_get(sv[0], gen) == sk);
+    CHECK(sock_slab_get(sv[0], gen + 1) == NULL);
+
+    // buffered bytes go with the sock
+    sk->rbuf = (rbuf_t *)calloc(1, sizeof(rbuf_t));
+    CHECK(rbuf_append(sk->rbuf, "pending", 7) == 0);
+
+    sock_slab_release(sk);
+    CHECK(sock_slab_get(sv[0], gen) == NULL);
+    CHECK(!fd_open(sv[0]));
+
+    // the kernel hands the number out again: the old handle stays dead
+    int fd = dup(sv[1]);
+    CHECK(fd == sv[0]);
+    sk = slab_add_fd(fd, &gen2);
+    CHECK(gen2 != gen);
+    CHECK(sock_slab_get(fd, gen) == NULL);
+    CHECK(sock_slab_get(fd, gen2) == sk);
+    CHECK(sk && sk->rbuf == NULL);
+
+    sock_slab_release(sk);
+    close(sv[1]);
+}
+
+// a slot whose sock was leaked must not close the fd now living there
+static void test_leaked_slot(void) {
+    int sv[2];
+    uint32_t gen, gen2;
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    slab_add_fd(sv[0], &gen);
+    sock_t *sk = slab_add_fd(sv[0], &gen2);
+    CHECK(fd_open(sv[0]));
+    CHECK(sock_slab_get(sv[0], gen) == NULL);
+    CHECK(sock_slab_get(sv[0], gen2) == sk);
+    CHECK(write(sv[1], "x", 1) == 1);
+
+    char c;
+    CHECK(read(sv[0], &c, 1) == 1 && c == 'x');
+
+    sock_slab_release(sk);
+    close(sv[1]);
+}
+
+// detach frees the slot but hands the fd over open
+static void test_detach(void) {
+    int sv[2];
+    uint32_t gen;
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    sock_t *sk = slab_add_fd(sv[0], &gen);
+    CHECK(sk && sock_slab_detach(sk) == sv[0]);
+    CHECK(sock_slab_get(sv[0], gen) == NULL);
+    CHECK(fd_open(sv[0]));
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * CHECK() for the churn threads, check_failures is not theirs to bump: each
+ * counts into its own *failures, summed up after the join.
+ */
+#define CHURN_CHECK(cond)                                                         \
+    do {                                                                          \
+        if (!(cond)) {                                                            \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            (*failures)++;                                                        \
+        }                                                                         \
+    } while (0)
+
+/*
+ * reactor threads share the fd table: one thread's release and another's
+ * add of the same, just reused, number must not close the new socket.
+ */
+static void *churn(void *arg) {
+    int *failures = (int *)arg;
+    int i;
+    for (i = 0; i < RACE_ROUNDS; i++) {
+        int sv[2];
+        uint32_t gen;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) continue;
+
+        sock_t *sk = slab_add_fd(sv[0], &gen);
+        CHURN_CHECK(sk != NULL);
+        if (sk == NULL) continue;
+
+        char c = 'y';
+        CHURN_CHECK(write(sv[1], &c, 1) == 1);
+        CHURN_CHECK(read(sv[0], &c, 1) == 1);
+        CHURN_CHECK(sock_slab_get(sv[0], gen) == sk);
+
+        sock_slab_release(sk);
+        close(sv[1]);
+    }
+    return NULL;
+}
+
+static void test_release_race(void) {
+    pthread_t tids[RACE_THREADS];
+    int failures[RACE_THREADS] = {0};
+    int i;
+    for (i = 0; i < RACE_THREADS; i++) pthread_create(&tids[i], NULL, churn, &failures[i]);
+    for (i = 0; i < RACE_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+        check_failures += failures[i];
+    }
+}
+
+int main(void) {
+    test_handles();
+    test_leaked_slot();
+    test_detach();
+    test_release_race();
+    return CHECK_DONE("slab");
+}
@@ -1,18 +1,32 @@
+#include <signal.h>
+
 #include "../clibs/epoll.h"
 #include "../clibs/sock.h"
 
 static void do_srv(epoll_fd_t *r, sock_t *srv, struct epoll_event *ev) {
-    sock_t *cli = MALLOC(sizeof(sock_t));
-    assert(cli);
+    // edge triggered: take the whole backlog, not just one connection
+    while (1) {
+        sock_t sk;
+        int ret = sock_accept(srv, &sk);
+        if (ret == -EAGAIN) return;
+        if (ret < 0) {
+            ERR("srv sock_accept fail");
+            goto _FAILE;
+        }
 
-    if (sock_accept(srv, cli) < 0) {
-        ERR("srv sock_accept fail");
-        goto _FAILE;
-    }
-    printf("srv sock_accept ok: fd=%d, addr=%s:%d\n", sock_fd(cli), cli->addr.net.ip, cli->addr.net.port);
+        // connections live in the fd slab, a closed one's slot is reused by its fd
+        sock_t *cli = sock_slab_add(&sk, NULL);
+        if (cli == NULL) {
+            sock_term(&sk);
+            continue;
+        }
+
+        char peer[128] = "-";
+        sock_peer(cli, peer, sizeof(peer));
+        printf("srv sock_accept ok: fd=%d, addr=%s\n", sock_fd(cli), peer);
 
-    epoll_fd_add(r, sock_fd(cli), EPOLLIN | EPOLLET | EPOLLERR, cli);
-    return;
+        epoll_fd_attach(r, sock_fd(cli), EPOLLIN | EPOLLET | EPOLLERR, cli);
+    }
 
 _FAILE:
     epoll_fd_del(r, sock_fd(srv));
@@ -21,31 +35,39 @@ _FAILE:
 
 static void handle_cli(epoll_fd_t *r, sock_t *cli, struct epoll_event *ev) {
     DBG("cli ev=%d, fd=%d", ev->events, sock_fd(cli));
-    char buf[1024];
-    int ret = sock_read(cli, buf, sizeof(buf));
-    if (ret < 0) {
-        if (ret != -EAGAIN) {
-            ERR("cli sock_read fail");
-            goto _FAILE;
-        }
+    char buf[4096];
 
-        DBG("ci sock_read AGAIN");
-        return;
-    }
+    // edge triggered: read until EAGAIN or the rest is never reported
+    while (1) {
+        int ret = sock_read(cli, buf, sizeof(buf));
+        if (ret < 0) {
+            if (ret != -EAGAIN) {
+                ERR("cli sock_read fail");
+                goto _FAILE;
+            }
 
-    if (ret == 0) {
-        DBG("cli closed");
-        goto _FAILE;
-    }
+            DBG("ci sock_read AGAIN");
+            return;
+        }
+
+        if (ret == 0) {
+            DBG("cli closed");
+            goto _FAILE;
+        }
 
-    buf[ret] = '\0';
-    DBG("cli sock_read: %s\n", buf);
+        DBG("cli sock_read: %.*s\n", ret, buf);
 
-    if (sock_write(cli, buf, ret) <= 0) {
-        ERR("cli sock_write fail");
-        goto _FAILE;
+        // pipelining peers can fill the send buffer, finish the echo anyway
+        int off = 0;
+        while (off < ret) {
+            int n = sock_write(cli, buf + off, ret - off);
+            if (n < 0) {
+                ERR("cli sock_write fail");
+                goto _FAILE;
+            }
+            off += n;
+        }
     }
-    return;
 
 _FAILE:
     epoll_fd_del(r, sock_fd(cli));
@@ -53,6 +75,8 @@ _FAILE:
 }
 
 int main(int argc, char **argv) {
+    signal(SIGPIPE, SIG_IGN);
+
     epoll_fd_t reactor;
     if (epoll_fd_create(&reactor, 0) < 0) {
         ERR("epoll_fd_create fail");
@@ -10,14 +10,13 @@ if err then error(err) end
 local srv_fd, err = srv:fd()
 if err then error(err) end
 
-local srv_fd_str = "" .. srv_fd
-print("srv fd: ", srv_fd_str)
+print("srv fd: ", srv_fd)
 
 _, err = ep:add(srv_fd, epoll.EPOLLIN)
 if err then error(err) end
 
 local fd_to_sk = {}
-fd_to_sk[srv_fd_str] = srv
+fd_to_sk[srv_fd] = srv
 
 function do_srv(r, sk, ev)
     local new_sk, err = sk:accept()
@@ -26,19 +25,18 @@ function do_srv(r, sk, ev)
     local new_fd, err = new_sk:fd()
     if err then error(err) end
 
-    local new_fd_str = "" .. new_fd
-    print("srv accept: ", new_fd_str)
+    print("srv accept: ", new_fd)
 
     _, err = r:add(new_fd, epoll.EPOLLIN)
     if err then error(err) end
-    fd_to_sk[new_fd_str] = new_sk
+    fd_to_sk[new_fd] = new_sk
 end
 
 function handle_cli(r, sk, ev)
     local n, data, err = sk:read()
     if err then
         r:del(sk:fd())
-        fd_to_sk["" .. sk:fd()] = nil
+        fd_to_sk[sk:fd()] = nil
         print(err)
         return
     end
@@ -52,27 +50,32 @@ function handle_cli(r, sk, ev)
         print("EOF")
         r:del(sk:fd())
         sk:close()
-        fd_to_sk["" .. sk:fd()] = nil
+        fd_to_sk[sk:fd()] = nil
         return
     end
 
-    print("sock_read: ", data)
-    n, err = sk:write(data)
-    if err then error(err) end
-    if n ~= #data then error("sk:write fail") end
+    -- print("sock_read: ", data)
+    -- a pipelining peer can fill the send buffer, finish the echo anyway
+    local off = 0
+    while off < #data do
+        n, err = sk:write(data, off)
+        if err then error(err) end
+        off = off + n
+    end
 end
 
+local t_ev, t_fd = {}, {}
 while true do
-    local t_ev, t_fd, err = ep:wait(-1)
+    local n, err = ep:wait_into(t_ev, t_fd, -1)
     if err then error(err) end
-    print("ep:wait ", #t_fd)
+    -- print("ep:wait ", n)
 
-    for i, ev in ipairs(t_ev) do
-        local fd = t_fd[i]
+    for i = 1, n do
+        local ev, fd = t_ev[i], t_fd[i]
         local sk = fd_to_sk[fd]
         if sk == nil then error("sk is nil at fd=" .. fd) end
 
-        if fd == srv_fd_str then
+        if fd == srv_fd then
             do_srv(ep, sk, ev)
         else
             handle_cli(ep, sk, ev)
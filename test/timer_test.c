@@ -0,0 +1,91 @@
+#include <unistd.h>
+
+#include "../clibs/timer.h"
+#include "check.h"
+
+#define NTIMERS 8
+
+typedef struct {
+    timer_node_t node;  // first, expired nodes are cast back
+    uint32_t ms;
+    uint64_t fired;  // timer_now_ms() when it came out, 0 while pending
+} test_timer_t;
+
+// level 0 deadlines, ones that cascade down from level 1, and a cancelled one.
+// Only ordering and never-early are checked, how late a loaded box runs is not
+static void test_expire_order(void) {
+    static const uint32_t delays[NTIMERS] = {0, 1, 5, 255, 256, 300, 700, 1000};
+    timer_wheel_t wheel;
+    test_timer_t t[NTIMERS];
+    test_timer_t cancelled = {{0}};
+    int i, fired = 0;
+
+    timer_wheel_init(&wheel);
+    CHECK(timer_next_timeout(&wheel) == -1);
+
+    uint64_t start = timer_now_ms();
+    for (i = 0; i < NTIMERS; i++) {
+        t[i].node.prev = t[i].node.next = NULL;
+        t[i].ms = delays[i];
+        t[i].fired = 0;
+        timer_add(&wheel, &t[i].node, delays[i]);
+    }
+    timer_add(&wheel, &cancelled.node, 50);
+    CHECK(wheel.count == NTIMERS + 1);
+    timer_del(&wheel, &cancelled.node);
+    CHECK(!timer_pending(&cancelled.node));
+    CHECK(wheel.count == NTIMERS);
+
+    while (fired < NTIMERS && timer_now_ms() - start < 2000) {
+        int wait = timer_next_timeout(&wheel);
+        CHECK(wait >= 0 && wait <= TIMER_L0_SIZE);
+        if (wait > 0) usleep(wait * 1000);
+
+        timer_node_t expired;
+        timer_list_init(&expired);
+        timer_expire(&wheel, &expired);
+        while (!timer_list_empty(&expired)) {
+            test_timer_t *x = (test_timer_t *)expired.next;
+            expired.next = x->node.next;
+            x->node.next->prev = &expired;
+            x->node.prev = x->node.next = NULL;
+
+            CHECK(x != &cancelled && x->fired == 0);
+            x->fired = timer_now_ms();
+            fired++;
+        }
+    }
+
+    CHECK(fired == NTIMERS);
+    CHECK(wheel.count == 0);
+    for (i = 0; i < NTIMERS; i++) {
+        CHECK(t[i].fired >= start + t[i].ms);
+        if (i > 0) CHECK(t[i].fired >= t[i - 1].fired);
+    }
+    CHECK(cancelled.fired == 0);
+}
+
+// re-adding a pending node moves it instead of linking it twice
+static void test_readd(void) {
+    timer_wheel_t wheel;
+    test_timer_t t = {{0}};
+
+    timer_wheel_init(&wheel);
+    timer_add(&wheel, &t.node, 1000);
+    timer_add(&wheel, &t.node, 2);
+    CHECK(wheel.count == 1);
+
+    usleep(10 * 1000);
+    timer_node_t expired;
+    timer_list_init(&expired);
+    CHECK(timer_expire(&wheel, &expired) == 1);
+    CHECK(expired.next == &t.node && t.node.next == &expired);
+    CHECK(wheel.count == 0);
+    CHECK(timer_next_timeout(&wheel) == -1);
+}
+
+int main(void) {
+    test_readd();
+    test_expire_order();
+    return CHECK_DONE("timer");
+}